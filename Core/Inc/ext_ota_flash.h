@@ -0,0 +1,80 @@
+/*
+ * ext_ota_flash.h
+ *
+ *  Flash backends of the OTA session: page write-back cache, CPU, RAM and DMA programming (ext_ota_flash.c),
+ *  Flash job queue (ext_ota_flash_async.c) and cut-through programming (ext_ota_flash_cut.c)
+ */
+
+#ifndef EXT_OTA_FLASH_H
+#define EXT_OTA_FLASH_H
+
+#include "ext_ota_session.h"
+
+// Flash erase and halfword program of the session, from RAM along with the receive path
+#if EXT_OTA_RAM_EXEC_ENABLE
+#define EXT_OTA_FLASH_ERASE(erase, error)		EXT_OTA_Ram_Erase(erase, error)
+#define EXT_OTA_FLASH_PROGRAM(address, data)	EXT_OTA_Ram_Program(address, data)
+HAL_StatusTypeDef EXT_OTA_Ram_Erase(FLASH_EraseInitTypeDef* erase, uint32_t* page_error);
+HAL_StatusTypeDef EXT_OTA_Ram_Program(uint32_t address, uint16_t data);
+#else
+#define EXT_OTA_FLASH_ERASE(erase, error)		HAL_FLASHEx_Erase(erase, error)
+#define EXT_OTA_FLASH_PROGRAM(address, data)	HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address, data)
+#endif
+
+// Slot and configuration writes, through the page write-back cache
+void EXT_OTA_Flash_Open(void);
+void EXT_OTA_Flash_Close(void);
+void EXT_OTA_Flash_Report(void);
+HAL_StatusTypeDef EXT_OTA_Flash_Write(EXT_OTA_SLICE* payload, uint8_t is_first_block);
+HAL_StatusTypeDef EXT_OTA_Slot_Data_Write(const EXT_OTA_SLICE* data, uint8_t slot_num, uint8_t is_first_block);
+HAL_StatusTypeDef EXT_OTA_Write_Config(EXT_GNRL_CONFIG* cfg);
+HAL_StatusTypeDef EXT_OTA_Cache_Flush(void);
+void EXT_OTA_Cache_Discard(void);
+uint8_t EXT_OTA_Cache_Needed(uint32_t offset, uint16_t len);
+void EXT_OTA_Cache_Read(uint8_t* dst, uint32_t offset, uint16_t len);
+
+// Flash job queue, the payloads are programmed before the next frame is received without it
+#if EXT_OTA_FLASH_ASYNC_ENABLE
+void EXT_OTA_Flash_Queue_Open(void);
+void EXT_OTA_Flash_Queue_Close(void);
+void EXT_OTA_Flash_Queue_Report(void);
+HAL_StatusTypeDef EXT_OTA_Flash_Data(const EXT_OTA_SLICE* data, uint8_t is_first_block);
+uint32_t EXT_OTA_Flash_Keep(void);
+HAL_StatusTypeDef EXT_OTA_Flash_Poll(void);
+void EXT_OTA_Flash_Wait(void);
+HAL_StatusTypeDef EXT_OTA_Flash_Sync(void);
+uint8_t EXT_OTA_Flash_Hold_Ack(void);
+uint8_t EXT_OTA_Flash_Pending(void);
+#else
+#define EXT_OTA_Flash_Queue_Open()
+#define EXT_OTA_Flash_Queue_Close()
+#define EXT_OTA_Flash_Queue_Report()
+#define EXT_OTA_Flash_Poll()					(HAL_OK)
+#define EXT_OTA_Flash_Wait()
+#define EXT_OTA_Flash_Sync()					(HAL_OK)
+#define EXT_OTA_Flash_Hold_Ack()				(0u)
+#define EXT_OTA_Flash_Pending()					(0u)
+#endif
+
+// Cut-through programming, the payloads are programmed once their frame is checked without it
+#if EXT_OTA_CUT_THROUGH_ENABLE
+void EXT_OTA_Cut_Open(void);
+void EXT_OTA_Cut_Report(void);
+void EXT_OTA_Cut_Reset(void);
+HAL_StatusTypeDef EXT_OTA_Cut_Receive(uint8_t packet_type, uint32_t offset, uint16_t data_len);
+uint8_t EXT_OTA_Cut_Crc(uint16_t data_len, uint32_t* crc);
+void EXT_OTA_Cut_Drop(void);
+uint8_t EXT_OTA_Cut_Done(uint16_t data_len);
+HAL_StatusTypeDef EXT_OTA_Cut_Rollback(void);
+#else
+#define EXT_OTA_Cut_Open()
+#define EXT_OTA_Cut_Report()
+#define EXT_OTA_Cut_Reset()
+#define EXT_OTA_Cut_Receive(packet_type, offset, data_len)	(HAL_OK)
+#define EXT_OTA_Cut_Crc(data_len, crc)			(0u)
+#define EXT_OTA_Cut_Drop()
+#define EXT_OTA_Cut_Done(data_len)				(0u)
+#define EXT_OTA_Cut_Rollback()					(HAL_OK)
+#endif
+
+#endif
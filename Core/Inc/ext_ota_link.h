@@ -0,0 +1,77 @@
+/*
+ * ext_ota_link.h
+ *
+ *  Interface between the OTA core (ext_ota_update.c) and its link backends (ext_ota_link_*.c)
+ */
+
+#ifndef EXT_OTA_LINK_H
+#define EXT_OTA_LINK_H
+
+#include "ext_ota_update.h"
+
+// Links the OTA session can be opened on, USART1 first
+#define EXT_OTA_LINK_COUNT	(1u + EXT_OTA_LINK_USART3_ENABLE + EXT_OTA_LINK_USB_ENABLE + EXT_OTA_LINK_SPI_ENABLE + \
+							 EXT_OTA_LINK_CAN_ENABLE + EXT_OTA_LINK_LOOPBACK_ENABLE)
+
+// Bytes of a receive ring that can not take new bytes yet
+#if EXT_OTA_FLASH_ASYNC_ENABLE
+#define EXT_OTA_RX_USED(link)	((link)->rx_head - (link)->rx_keep)
+#else
+#define EXT_OTA_RX_USED(link)	((link)->rx_head - (link)->rx_tail)
+#endif
+
+/*
+ * Operations of a link backend, called by the core on the links it listens to.
+ * The backend adds the bytes it receives to rx_head and reports the responses it has sent
+ * with EXT_OTA_Link_Tx_Done(). The optional operations are NULL when the transport has nothing to do.
+ */
+typedef struct EXT_OTA_LINK_OPS
+{
+  // The ring is empty and about to be armed (optional)
+  void                (*start)(EXT_OTA_LINK* link);
+  // Stop filling the ring (optional)
+  void                (*stop)(EXT_OTA_LINK* link);
+  // Fill the next free region of the ring, called with the interrupts masked (optional)
+  void                (*arm)(EXT_OTA_LINK* link);
+  // Bytes already in the armed region, not added to rx_head yet (optional)
+  uint32_t            (*rx_pending)(EXT_OTA_LINK* link);
+  // Send a response frame: with TX DMA the frame at the tail of the queue is started,
+  // without it the frame is on the wire when the function returns
+  HAL_StatusTypeDef   (*tx)(EXT_OTA_LINK* link, uint8_t* frame, uint16_t len);
+  // Abort the response on the wire (optional)
+  void                (*tx_abort)(EXT_OTA_LINK* link);
+  // Hold the sender off while the CPU stalls on the Flash (on = 1), then let it go on (optional)
+  void                (*hold)(EXT_OTA_LINK* link, uint8_t on);
+  // Print the statistics of the session (optional)
+  void                (*report)(EXT_OTA_LINK* link);
+}EXT_OTA_LINK_OPS;
+
+// Links of the session, defined by the core
+extern EXT_OTA_LINK ota_links[EXT_OTA_LINK_COUNT];
+
+// Link backends
+extern const EXT_OTA_LINK_OPS ota_link_uart_ops;
+#if EXT_OTA_LINK_USB_ENABLE
+extern const EXT_OTA_LINK_OPS ota_link_usb_ops;
+#endif
+#if EXT_OTA_LINK_SPI_ENABLE
+extern const EXT_OTA_LINK_OPS ota_link_spi_ops;
+#endif
+#if EXT_OTA_LINK_CAN_ENABLE
+extern const EXT_OTA_LINK_OPS ota_link_can_ops;
+#endif
+#if EXT_OTA_LINK_LOOPBACK_ENABLE
+extern const EXT_OTA_LINK_OPS ota_link_loopback_ops;
+#endif
+
+// Core functions used by the backends
+EXT_OTA_LINK* EXT_OTA_Link_Find(UART_HandleTypeDef* huart);
+EXT_OTA_LINK* EXT_OTA_Link_Of_Type(EXT_OTA_LINK_TYPE type);
+#if EXT_OTA_TX_DMA_ENABLE
+void EXT_OTA_Link_Tx_Done(EXT_OTA_LINK* link);
+#endif
+#if EXT_OTA_RELAY_ENABLE
+uint8_t EXT_OTA_Relay_Tx_Cplt(EXT_OTA_LINK* link);
+#endif
+
+#endif
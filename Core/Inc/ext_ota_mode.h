@@ -0,0 +1,78 @@
+/*
+ * ext_ota_mode.h
+ *
+ *  Interface between the OTA core (ext_ota_update.c) and its session modes (ext_ota_mode_*.c):
+ *  pull, FEC, bond, multidrop broadcast and relay
+ */
+
+#ifndef EXT_OTA_MODE_H
+#define EXT_OTA_MODE_H
+
+#include "ext_ota_flash.h"
+
+/*
+ * Operations of a session mode. The host selects one mode per session with its command, the core
+ * serves the in-order push of the image when there is none. The optional operations are NULL when
+ * the mode leaves the step to the core.
+ */
+typedef struct EXT_OTA_MODE_OPS
+{
+  // DATA packets carry their offset in the image, in front of the payload
+  uint8_t             offset;
+  // DATA packets can not be streamed under flow control
+  uint8_t             no_stream;
+  // Reset the state of the mode for a new session, called on every mode compiled in (optional)
+  void                (*open)(void);
+  // Offered the packets the core does not handle, called on every mode compiled in:
+  // 1 - the packet is for the mode, ret is set (optional)
+  uint8_t             (*packet)(EXT_OTA_PACKET_VIEW* packet, EXT_OTA_EX* ret);
+  // The header has been accepted and the slot chosen (optional)
+  HAL_StatusTypeDef   (*header)(void);
+  // Receive the next packet into rcv_packet, in place of the session link (optional)
+  uint16_t            (*receive)(uint16_t max_len, uint32_t timeout);
+  // Write the payload of a DATA packet, in place of the in-order write (optional)
+  HAL_StatusTypeDef   (*data)(EXT_OTA_SLICE* payload, uint16_t len, uint8_t is_first_block);
+  // The DATA packet just accepted must be acknowledged (optional)
+  uint8_t             (*ack_due)(void);
+  // Send the response in the format of the mode: 1 - sent (optional)
+  uint8_t             (*respond)(uint8_t resp_type);
+  // Account for the packet lost or damaged, or not, with len 0 (optional): the resend flag of the core
+  uint8_t             (*resync)(uint16_t len, uint8_t resend);
+  // Get the packets lost in the DATA state sent again, retries counted (optional)
+  HAL_StatusTypeDef   (*recover)(uint8_t* retries);
+  // The ACK of a packet is out: the mode starts once its command has been acknowledged (optional)
+  void                (*activate)(void);
+  // Served while the host is waited for, and after each packet (optional)
+  void                (*poll)(void);
+  // The image has been checked on the END command, before the slot is marked (optional)
+  HAL_StatusTypeDef   (*end)(void);
+  // Print the statistics of the session (optional)
+  void                (*report)(void);
+  // The mode uses the UART besides the session link: 1 - in use (optional)
+  uint8_t             (*owns)(UART_HandleTypeDef* huart);
+  // The session is over (optional)
+  void                (*close)(void);
+}EXT_OTA_MODE_OPS;
+
+// Session mode selected by the host, NULL for the in-order push of the image
+extern const EXT_OTA_MODE_OPS* ota_mode;
+
+// Session modes
+extern const EXT_OTA_MODE_OPS ota_mode_pull_ops;
+#if EXT_OTA_FEC_ENABLE
+extern const EXT_OTA_MODE_OPS ota_mode_fec_ops;
+#endif
+#if EXT_OTA_BOND_ENABLE
+extern const EXT_OTA_MODE_OPS ota_mode_bond_ops;
+#endif
+#if EXT_OTA_MULTIDROP_ENABLE
+extern const EXT_OTA_MODE_OPS ota_mode_md_ops;
+#endif
+#if EXT_OTA_RELAY_ENABLE
+extern const EXT_OTA_MODE_OPS ota_mode_relay_ops;
+#endif
+
+// Core functions used by the modes
+uint8_t EXT_OTA_Mode_Free(const EXT_OTA_MODE_OPS* mode);
+
+#endif
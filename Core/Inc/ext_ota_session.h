@@ -0,0 +1,63 @@
+/*
+ * ext_ota_session.h
+ *
+ *  State of the OTA session and core functions (ext_ota_update.c) shared with the Flash backends
+ *  (ext_ota_flash*.c) and the session modes (ext_ota_mode_*.c)
+ */
+
+#ifndef EXT_OTA_SESSION_H
+#define EXT_OTA_SESSION_H
+
+#include "ext_ota_link.h"
+
+// Link of the current session
+extern EXT_OTA_LINK* ota_link;
+// Last received packet, and the status of its reception
+extern EXT_OTA_PACKET_VIEW rcv_packet;
+extern HAL_StatusTypeDef rx_status;
+// OTA state
+extern EXT_OTA_STATE ota_state;
+// Update firmware total size, and the size that we have received
+extern uint32_t ota_fw_total_size;
+extern uint32_t ota_fw_received_size;
+// Update firmware image 's CRC32
+extern uint32_t ota_fw_crc;
+// Slot number to write to the received firmware
+extern uint8_t slot_num_to_write_fw;
+// Number of packets accepted in the session
+extern uint32_t ota_packet_count;
+// Largest DATA payload accepted, and payload size advised to the host (0 - no advice)
+extern uint16_t ota_payload_max;
+extern uint16_t ota_payload_advice;
+// Only every Nth DATA packet is acknowledged
+extern uint8_t ota_ack_interval;
+#if EXT_OTA_FLOW_CONTROL_ENABLE
+// Streaming mode requested by the host
+extern uint8_t ota_pending_stream;
+#endif
+// Configuration
+extern EXT_GNRL_CONFIG *cfg_flash;
+// Bytes of the slot physically programmed, the erased ones left out
+extern uint32_t ota_flash_programmed;
+
+// Receive ring of the session link
+void EXT_OTA_Rx_Start(EXT_OTA_LINK* link);
+void EXT_OTA_Rx_Stop(EXT_OTA_LINK* link);
+void EXT_OTA_Rx_Arm(EXT_OTA_LINK* link);
+uint32_t EXT_OTA_Rx_Available(void);
+HAL_StatusTypeDef EXT_OTA_Rx_Wait(uint32_t count, uint32_t timeout);
+uint8_t EXT_OTA_Rx_Peek(uint32_t offset);
+void EXT_OTA_Rx_Slice(uint32_t offset, uint16_t len, EXT_OTA_SLICE* slice);
+void EXT_OTA_Rx_Release(uint32_t count);
+void EXT_OTA_Rx_Drain(uint32_t idle_time);
+uint16_t EXT_OTA_Receive_Chunk(EXT_OTA_PACKET_VIEW* packet, uint16_t max_len, uint32_t timeout);
+uint8_t EXT_OTA_Slice_Byte(const EXT_OTA_SLICE* slice, uint16_t idx);
+void EXT_OTA_Slice_Skip(EXT_OTA_SLICE* slice, uint16_t count);
+uint32_t EXT_OTA_Slice_Offset(const EXT_OTA_SLICE* slice);
+// Responses and transfer mode
+void EXT_OTA_Send_Resp(uint8_t resp_type);
+void EXT_OTA_Transmit_Resp(uint8_t* frame, uint8_t len);
+void EXT_OTA_Flush_Resp(void);
+uint8_t EXT_OTA_Is_Push_Mode(void);
+
+#endif
@@ -27,6 +27,157 @@
 #define EXT_OTA_DATA_MAX_SIZE	  1024
 #define EXT_OTA_DATA_OVERHEAD	  9
 #define EXT_OTA_PACKET_MAX_SIZE	(EXT_OTA_DATA_MAX_SIZE + EXT_OTA_DATA_OVERHEAD)
+#define EXT_OTA_PAYLOAD_PREFIX_MAX 4          // Parity count or pulled chunk offset, on top of a full chunk
+
+// Adaptive payload size: halved on a damaged frame, doubled after a run of good DATA packets
+#define EXT_OTA_DATA_MIN_SIZE	  64u
+#define EXT_OTA_ADAPT_GOOD_RUN	  16u
+
+// Receive ring of each link, filled by its RX DMA, holds at least one full packet
+#define EXT_OTA_RX_RING_SIZE    2048u
+
+// Links listened to for a session: USART1 (PA9/PA10), USART3 (PB10/PB11, shared with the log output), loopback
+#define EXT_OTA_LINK_USART3_ENABLE      1
+#define EXT_OTA_LINK_LOOPBACK_ENABLE    0
+#define EXT_OTA_LISTEN_SLICE            10u     // ms spent on the autobaud of USART1 before polling the other links
+
+// USB CDC-ACM link (PA11 - USB_DM, PA12 - USB_DP), needs the USB_DEVICE CDC middleware generated by CubeMX
+#define EXT_OTA_LINK_USB_ENABLE         0
+#define EXT_OTA_USB_PACKET_SIZE         64u     // Full-speed bulk OUT endpoint packet size
+
+// SPI1 slave link (PA4 - NSS, PA5 - SCK, PA6 - MISO, PA7 - MOSI, RX/TX on DMA1 Channel 2/3)
+#define EXT_OTA_LINK_SPI_ENABLE         0
+#define EXT_OTA_SPI_READY_PORT          GPIOB   // High while the ring can take a full frame
+#define EXT_OTA_SPI_READY_PIN           GPIO_PIN_0
+#define EXT_OTA_SPI_ATTN_PORT           GPIOB   // High while a response waits to be clocked out
+#define EXT_OTA_SPI_ATTN_PIN            GPIO_PIN_1
+
+// bxCAN link (PB8 - CAN_RX, PB9 - CAN_TX remapped), frames segmented ISO-TP style into 8-byte CAN frames
+#define EXT_OTA_LINK_CAN_ENABLE         0
+#define EXT_OTA_CAN_BITRATE             500000u // 125 kbit/s to 1 Mbit/s, 18 time quanta of PCLK1 @ 36 MHz
+#define EXT_OTA_CAN_RX_ID               0x7E0u  // Standard ID of the frames to this node, the only ID the filter lets in
+#define EXT_OTA_CAN_TX_ID               0x7E8u  // Standard ID of the frames sent by this node
+#define EXT_OTA_CAN_BLOCK_SIZE          16u     // Consecutive frames the host sends per flow control, 0: no limit
+#define EXT_OTA_CAN_STMIN               0u      // ms the host leaves between two consecutive frames
+
+// Header check: packet type flag announcing a CRC-8 of the type and length bytes
+#define EXT_OTA_PACKET_HDR_CHECK    0x80
+#define EXT_OTA_HDR_CHECK_REQUIRED  0           // 1: reject frames without header check
+
+// RS-485 multidrop bus on USART1: addressed frames, broadcast image and missing-chunk repair
+#define EXT_OTA_MULTIDROP_ENABLE    0
+#define EXT_OTA_PACKET_ADDRESSED    0x40        // Packet type flag: a node address follows the length
+#define EXT_OTA_NODE_ADDRESS        0x01u       // Address of this node on the bus (0x01 to 0xFE)
+#define EXT_OTA_ADDR_BROADCAST      0xFFu
+#define EXT_OTA_RS485_DE_PORT       GPIOA       // Transceiver driver enable, high while a response is sent
+#define EXT_OTA_RS485_DE_PIN        GPIO_PIN_8
+#define EXT_OTA_MD_BITMAP_SIZE      ((EXT_SLOT_MAX_SIZE / EXT_OTA_DATA_MIN_SIZE + 7u) / 8u)
+
+// COBS framing: frames are delimited by a zero byte that never appears inside them
+#define EXT_OTA_COBS_DELIMITER      0x00
+#define EXT_OTA_COBS_MAX_SIZE(n)    ((n) + ((n) / 254u) + 1u)   // Encoded size of n bytes
+
+// Reception timeouts (HAL tick) and retry policy of the OTA session
+#define EXT_OTA_INTER_BYTE_TIMEOUT  20u         // ms allowed between two bytes of a frame
+#define EXT_OTA_INTER_FRAME_TIMEOUT 1000u       // ms allowed between two frames
+#define EXT_OTA_MAX_RETRIES         5u          // NACKs sent in a row before the session is given up
+#define EXT_OTA_RETRY_IDLE_TIME     10u         // ms of line idle time before a retransmission is received
+
+// Forward error correction: XOR parity over groups of DATA packets
+#define EXT_OTA_FEC_ENABLE          1
+#define EXT_OTA_FEC_GROUP_MAX       16u         // DATA packets per parity packet
+
+// Pull mode: the bootloader requests the chunks of the image itself
+#define EXT_OTA_PULL_WINDOW_MAX     8u          // READ_CHUNK requests in flight
+
+// Link bonding: DATA packets striped over the session link and a second UART link
+#define EXT_OTA_BOND_ENABLE         EXT_OTA_LINK_USART3_ENABLE
+#define EXT_OTA_BOND_LINKS          2u
+
+// Store-and-forward relay: the image is sent on to the next board of a daisy chain over USART3
+#define EXT_OTA_RELAY_ENABLE        0
+#define EXT_OTA_RELAY_CHUNK         256u        // Image bytes per DATA packet sent down, the latency of a hop
+
+// Cut-through streaming: in-order DATA payloads are programmed while the rest of their frame arrives (SOF/EOF framing)
+#define EXT_OTA_CUT_THROUGH_ENABLE  0
+#define EXT_OTA_CUT_HISTORY         (FLASH_PAGE_SIZE / EXT_OTA_DATA_MIN_SIZE + 1u)  // Packet starts kept to roll a page back
+
+// Flash job queue: in-order DATA payloads are erased and programmed from the FLASH interrupt, their ACK follows
+#define EXT_OTA_FLASH_ASYNC_ENABLE  0
+#define EXT_OTA_FLASH_QUEUE_DEPTH   4u          // Erase and program jobs queued at most
+
+// Receive interrupts, ring code, Flash routines and CRC executed from RAM (.RamFunc): the UART links go on receiving during an erase
+#define EXT_OTA_RAM_EXEC_ENABLE     0
+#define EXT_OTA_RAM_VECTORS_ENABLE  EXT_OTA_RAM_EXEC_ENABLE     // The session runs on a RAM copy of the vector table
+
+// Experimental: the pages of the write-back cache are programmed by a memory-to-memory DMA
+// (DMA1 Channel 1, halfwords). The CPU programs them again if the Flash rejects the DMA writes.
+#define EXT_OTA_FLASH_DMA_ENABLE    0
+
+// Baud rate negotiation of the OTA link (USART1 on APB2 @ 72 MHz, oversampling 16)
+#define EXT_OTA_DEFAULT_BAUDRATE    115200u
+#define EXT_OTA_MIN_BAUDRATE        9600u
+#define EXT_OTA_MAX_BAUDRATE        4500000u    // PCLK2 / 16
+#define EXT_OTA_BAUD_PROBE_TIMEOUT  500u        // ms to wait for the probe at the new rate
+
+// Autobaud detection on the SOF byte (TIM1 CH3/CH4 input capture on PA10 - USART1_RX)
+#define EXT_OTA_AUTOBAUD_ENABLE     1
+#define EXT_OTA_AUTOBAUD_TOLERANCE  3u          // % deviation accepted from a standard baud rate
+#define EXT_OTA_AUTOBAUD_IDLE_TIME  20u         // ms of line idle time before retrying a failed measurement
+
+// RTS/CTS flow-controlled streaming mode (PA11 - USART1_CTS, PA12 - USART1_RTS)
+#define EXT_OTA_FLOW_CONTROL_ENABLE 1
+
+// Compact responses, acknowledging every Nth DATA packet cumulatively
+#define EXT_OTA_ACK_INTERVAL_MAX    32u
+
+// Non-blocking response path (USART1_TX on DMA1 Channel 4)
+#define EXT_OTA_TX_DMA_ENABLE       1
+#define EXT_OTA_TX_QUEUE_DEPTH      4u
+#define EXT_OTA_TX_TIMEOUT          100u        // ms for a queued response to leave before the queue is dropped
+
+#if EXT_OTA_LINK_USB_ENABLE && EXT_OTA_FLOW_CONTROL_ENABLE
+#error "PA11/PA12 carry either USB or USART1 CTS/RTS"
+#endif
+#if EXT_OTA_LINK_USB_ENABLE && !EXT_OTA_TX_DMA_ENABLE
+#error "The USB link sends its responses from the response queue"
+#endif
+#if EXT_OTA_LINK_SPI_ENABLE && EXT_OTA_LINK_USART3_ENABLE
+#error "SPI1 and USART3 share DMA1 Channel 2/3"
+#endif
+#if EXT_OTA_LINK_SPI_ENABLE && !EXT_OTA_TX_DMA_ENABLE
+#error "The SPI link sends its responses from the response queue"
+#endif
+#if EXT_OTA_LINK_CAN_ENABLE && EXT_OTA_LINK_USB_ENABLE
+#error "USB and bxCAN share their packet SRAM and can not be used together"
+#endif
+#if EXT_OTA_LINK_CAN_ENABLE && !EXT_OTA_TX_DMA_ENABLE
+#error "The CAN link sends its responses from the response queue"
+#endif
+#if EXT_OTA_MULTIDROP_ENABLE && EXT_OTA_FLOW_CONTROL_ENABLE
+#error "USART1 on the RS-485 bus has no RTS/CTS"
+#endif
+#if EXT_OTA_RELAY_ENABLE && !EXT_OTA_LINK_USART3_ENABLE
+#error "The relay sends the image down on the USART3 link"
+#endif
+#if EXT_OTA_RELAY_ENABLE && !EXT_OTA_TX_DMA_ENABLE
+#error "The relay sends its DATA packets from the TX DMA"
+#endif
+#if EXT_OTA_FLASH_ASYNC_ENABLE && EXT_OTA_CUT_THROUGH_ENABLE
+#error "Cut-through programs the payloads itself, the Flash job queue can not be used with it"
+#endif
+#if EXT_OTA_RAM_VECTORS_ENABLE && !EXT_OTA_RAM_EXEC_ENABLE
+#error "The RAM vector table only helps the handlers executed from RAM"
+#endif
+
+// Code and constants executed from RAM, copied there with .data by the startup code
+#if EXT_OTA_RAM_EXEC_ENABLE
+#define EXT_OTA_RAMFUNC     __RAM_FUNC __attribute__((noinline))
+#define EXT_OTA_RAMDATA     __attribute__((section(".data.ext_ota")))
+#else
+#define EXT_OTA_RAMFUNC
+#define EXT_OTA_RAMDATA
+#endif
 
 // Reboot reason
 #define EXT_FIRST_TIME_BOOT   ( 0xFFFFFFFF )
@@ -34,25 +185,6 @@
 #define EXT_OTA_REQUEST       ( 0xDEADBEEF )
 #define EXT_LOAD_PREV_APP     ( 0xFACEFADE )
 
-static const uint32_t crc_table[0x100] = {
-  0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9, 0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005, 0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61, 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD,
-  0x4C11DB70, 0x48D0C6C7, 0x4593E01E, 0x4152FDA9, 0x5F15ADAC, 0x5BD4B01B, 0x569796C2, 0x52568B75, 0x6A1936C8, 0x6ED82B7F, 0x639B0DA6, 0x675A1011, 0x791D4014, 0x7DDC5DA3, 0x709F7B7A, 0x745E66CD,
-  0x9823B6E0, 0x9CE2AB57, 0x91A18D8E, 0x95609039, 0x8B27C03C, 0x8FE6DD8B, 0x82A5FB52, 0x8664E6E5, 0xBE2B5B58, 0xBAEA46EF, 0xB7A96036, 0xB3687D81, 0xAD2F2D84, 0xA9EE3033, 0xA4AD16EA, 0xA06C0B5D,
-  0xD4326D90, 0xD0F37027, 0xDDB056FE, 0xD9714B49, 0xC7361B4C, 0xC3F706FB, 0xCEB42022, 0xCA753D95, 0xF23A8028, 0xF6FB9D9F, 0xFBB8BB46, 0xFF79A6F1, 0xE13EF6F4, 0xE5FFEB43, 0xE8BCCD9A, 0xEC7DD02D,
-  0x34867077, 0x30476DC0, 0x3D044B19, 0x39C556AE, 0x278206AB, 0x23431B1C, 0x2E003DC5, 0x2AC12072, 0x128E9DCF, 0x164F8078, 0x1B0CA6A1, 0x1FCDBB16, 0x018AEB13, 0x054BF6A4, 0x0808D07D, 0x0CC9CDCA,
-  0x7897AB07, 0x7C56B6B0, 0x71159069, 0x75D48DDE, 0x6B93DDDB, 0x6F52C06C, 0x6211E6B5, 0x66D0FB02, 0x5E9F46BF, 0x5A5E5B08, 0x571D7DD1, 0x53DC6066, 0x4D9B3063, 0x495A2DD4, 0x44190B0D, 0x40D816BA,
-  0xACA5C697, 0xA864DB20, 0xA527FDF9, 0xA1E6E04E, 0xBFA1B04B, 0xBB60ADFC, 0xB6238B25, 0xB2E29692, 0x8AAD2B2F, 0x8E6C3698, 0x832F1041, 0x87EE0DF6, 0x99A95DF3, 0x9D684044, 0x902B669D, 0x94EA7B2A,
-  0xE0B41DE7, 0xE4750050, 0xE9362689, 0xEDF73B3E, 0xF3B06B3B, 0xF771768C, 0xFA325055, 0xFEF34DE2, 0xC6BCF05F, 0xC27DEDE8, 0xCF3ECB31, 0xCBFFD686, 0xD5B88683, 0xD1799B34, 0xDC3ABDED, 0xD8FBA05A,
-  0x690CE0EE, 0x6DCDFD59, 0x608EDB80, 0x644FC637, 0x7A089632, 0x7EC98B85, 0x738AAD5C, 0x774BB0EB, 0x4F040D56, 0x4BC510E1, 0x46863638, 0x42472B8F, 0x5C007B8A, 0x58C1663D, 0x558240E4, 0x51435D53,
-  0x251D3B9E, 0x21DC2629, 0x2C9F00F0, 0x285E1D47, 0x36194D42, 0x32D850F5, 0x3F9B762C, 0x3B5A6B9B, 0x0315D626, 0x07D4CB91, 0x0A97ED48, 0x0E56F0FF, 0x1011A0FA, 0x14D0BD4D, 0x19939B94, 0x1D528623,
-  0xF12F560E, 0xF5EE4BB9, 0xF8AD6D60, 0xFC6C70D7, 0xE22B20D2, 0xE6EA3D65, 0xEBA91BBC, 0xEF68060B, 0xD727BBB6, 0xD3E6A601, 0xDEA580D8, 0xDA649D6F, 0xC423CD6A, 0xC0E2D0DD, 0xCDA1F604, 0xC960EBB3,
-  0xBD3E8D7E, 0xB9FF90C9, 0xB4BCB610, 0xB07DABA7, 0xAE3AFBA2, 0xAAFBE615, 0xA7B8C0CC, 0xA379DD7B, 0x9B3660C6, 0x9FF77D71, 0x92B45BA8, 0x9675461F, 0x8832161A, 0x8CF30BAD, 0x81B02D74, 0x857130C3,
-  0x5D8A9099, 0x594B8D2E, 0x5408ABF7, 0x50C9B640, 0x4E8EE645, 0x4A4FFBF2, 0x470CDD2B, 0x43CDC09C, 0x7B827D21, 0x7F436096, 0x7200464F, 0x76C15BF8, 0x68860BFD, 0x6C47164A, 0x61043093, 0x65C52D24,
-  0x119B4BE9, 0x155A565E, 0x18197087, 0x1CD86D30, 0x029F3D35, 0x065E2082, 0x0B1D065B, 0x0FDC1BEC, 0x3793A651, 0x3352BBE6, 0x3E119D3F, 0x3AD08088, 0x2497D08D, 0x2056CD3A, 0x2D15EBE3, 0x29D4F654,
-  0xC5A92679, 0xC1683BCE, 0xCC2B1D17, 0xC8EA00A0, 0xD6AD50A5, 0xD26C4D12, 0xDF2F6BCB, 0xDBEE767C, 0xE3A1CBC1, 0xE760D676, 0xEA23F0AF, 0xEEE2ED18, 0xF0A5BD1D, 0xF464A0AA, 0xF9278673, 0xFDE69BC4,
-  0x89B8FD09, 0x8D79E0BE, 0x803AC667, 0x84FBDBD0, 0x9ABC8BD5, 0x9E7D9662, 0x933EB0BB, 0x97FFAD0C, 0xAFB010B1, 0xAB710D06, 0xA6322BDF, 0xA2F33668, 0xBCB4666D, 0xB8757BDA, 0xB5365D03, 0xB1F740B4,
-};
-
 // Exception code
 typedef enum
 {
@@ -70,6 +202,19 @@ typedef enum
 	EXT_OTA_STATE_END,
 }EXT_OTA_STATE;
 
+// Step of the session the relay runs with the next board, as its host
+typedef enum
+{
+	EXT_OTA_RELAY_OFF,
+	EXT_OTA_RELAY_START,
+	EXT_OTA_RELAY_CMD,					// RELAY command for the boards further down
+	EXT_OTA_RELAY_HEADER,
+	EXT_OTA_RELAY_DATA,
+	EXT_OTA_RELAY_END,
+	EXT_OTA_RELAY_DONE,
+	EXT_OTA_RELAY_FAILED,
+}EXT_OTA_RELAY_STEP;
+
 // Packet type
 typedef enum
 {
@@ -77,16 +222,41 @@ typedef enum
 	EXT_OTA_PACKET_TYPE_DATA,
 	EXT_OTA_PACKET_TYPE_HEADER,
 	EXT_OTA_PACKET_TYPE_RESPONSE,
+	EXT_OTA_PACKET_TYPE_PARITY,
 }EXT_OTA_PACKET_TYPE;
 
+// Packets small enough to be copied out of the receive ring
+#define EXT_OTA_IS_CTRL_PACKET(type)    ((type) == EXT_OTA_PACKET_TYPE_CMD || (type) == EXT_OTA_PACKET_TYPE_HEADER)
+
 // OTA commands
 typedef enum
 {
 	EXT_OTA_CMD_START,
 	EXT_OTA_CMD_END,
 	EXT_OTA_CMD_ABORT,
+	EXT_OTA_CMD_SET_BAUD,
+	EXT_OTA_CMD_PROBE,
+	EXT_OTA_CMD_STREAM,
+	EXT_OTA_CMD_COMPACT_RESP,
+	EXT_OTA_CMD_FRAMING,
+	EXT_OTA_CMD_FEC,
+	EXT_OTA_CMD_PAYLOAD_SIZE,
+	EXT_OTA_CMD_PULL,
+	EXT_OTA_CMD_READ_CHUNK,
+	EXT_OTA_CMD_BOND,
+	EXT_OTA_CMD_MULTIDROP,
+	EXT_OTA_CMD_MISSING,
+	EXT_OTA_CMD_RELAY,
 }EXT_OTA_CMD;
 
+// Framing of the packets sent by the host
+typedef enum
+{
+	EXT_OTA_FRAMING_SOF_EOF,
+	EXT_OTA_FRAMING_COBS,
+	EXT_OTA_FRAMING_NONE = 0xFF,
+}EXT_OTA_FRAMING;
+
 // Slot table
 typedef struct
 {
@@ -117,6 +287,62 @@ typedef struct
 	uint32_t reserved_2;
 }__attribute__((packed)) meta_info;
 
+/*
+ * OTA Header check (protocol v2)
+ *
+ * When the packet type has EXT_OTA_PACKET_HDR_CHECK set, a CRC-8 (poly 0x07, init 0x00)
+ * of the type and length bytes follows the length. It is validated before the payload
+ * is received, so a corrupted length is rejected right away.
+ * _______________________________________________
+ * |     | Packet |     | Hdr   |      |     |     |
+ * | SOF | Type   | Len | Check | Data | CRC | EOF |
+ * |_____|________|_____|_______|______|_____|_____|
+ *   1B      1B     2B     1B     nB     4B    1B
+ */
+
+/*
+ * OTA Addressed frame (RS-485 multidrop bus)
+ *
+ * When the packet type has EXT_OTA_PACKET_ADDRESSED set, the destination node address
+ * follows the length (and the header check). The CRC covers the address and the data.
+ * In the COBS framing the address follows the length inside the encoded frame.
+ * ________________________________________________________
+ * |     | Packet |     | Hdr   |      |      |     |     |
+ * | SOF | Type   | Len | Check | Addr | Data | CRC | EOF |
+ * |_____|________|_____|_______|______|______|_____|_____|
+ *   1B      1B     2B    0/1B     1B    nB     4B    1B
+ *
+ * - A node takes the frames sent to its address or to EXT_OTA_ADDR_BROADCAST, and frames
+ *   without address. It skips the frames sent to the other nodes and their responses.
+ * - No node answers a broadcast frame, and no node NACKs on the bus: a damaged frame
+ *   may have been sent to another node.
+ * - The response of a node drives the bus once the host has released it after its own frame.
+ *
+ * Broadcast update:
+ * 1. START, MULTIDROP, HEADER to EXT_OTA_ADDR_BROADCAST. The nodes erase their slot on
+ *    the header, the host leaves them the erase time (about 25 ms per page) before the DATA.
+ * 2. DATA to EXT_OTA_ADDR_BROADCAST, each chunk once, offset then chunk as in the pull mode.
+ * 3. MISSING to each node in turn, the host sends the chunks missing from any node again to
+ *    EXT_OTA_ADDR_BROADCAST, until no node misses any chunk. The bus time grows with the
+ *    image size and the loss rate, the polls add a few bytes per node.
+ * 4. END to each node in turn, each node checks its image.
+ * A node that missed the set-up answers the poll with a NACK and leaves the session,
+ * the host then updates it on its own.
+ */
+
+/*
+ * OTA COBS framing
+ *
+ * The frame without SOF and EOF is COBS encoded and terminated by the delimiter.
+ * A damaged frame is dropped up to the next delimiter, the following one is received
+ * normally. Responses keep the format selected for them.
+ * ____________________________________________
+ * |                                     |     |
+ * | COBS( Type | Len | Data | CRC )     |  0  |
+ * |_____________________________________|_____|
+ *           1B + 2B + nB + 4B + overhead   1B
+ */
+
 /*
  * OTA Command format
  *
@@ -136,6 +362,226 @@ typedef struct
   uint8_t   eof;
 }__attribute__((packed)) EXT_OTA_COMMAND;
 
+/*
+ * OTA Set baud rate command format
+ *
+ * ___________________________________________________
+ * |     | Packet |     |     |          |     |     |
+ * | SOF | Type   | Len | CMD | Baudrate | CRC | EOF |
+ * |_____|________|_____|_____|__________|_____|_____|
+ *   1B      1B     2B    1B      4B       4B    1B
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   packet_type;
+  uint16_t  data_len;
+  uint8_t   cmd;
+  uint32_t  baudrate;
+  uint32_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) EXT_OTA_BAUD_COMMAND;
+
+/*
+ * OTA Compact response command format
+ *
+ * _______________________________________________________
+ * |     | Packet |     |     |     ACK      |     |     |
+ * | SOF | Type   | Len | CMD |   Interval   | CRC | EOF |
+ * |_____|________|_____|_____|______________|_____|_____|
+ *   1B      1B     2B    1B         1B         4B    1B
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   packet_type;
+  uint16_t  data_len;
+  uint8_t   cmd;
+  uint8_t   ack_interval;
+  uint32_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) EXT_OTA_RESP_MODE_COMMAND;
+
+/*
+ * OTA Framing command format
+ *
+ * _________________________________________________
+ * |     | Packet |     |     |         |     |     |
+ * | SOF | Type   | Len | CMD | Framing | CRC | EOF |
+ * |_____|________|_____|_____|_________|_____|_____|
+ *   1B      1B     2B    1B      1B       4B    1B
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   packet_type;
+  uint16_t  data_len;
+  uint8_t   cmd;
+  uint8_t   framing;
+  uint32_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) EXT_OTA_FRAMING_COMMAND;
+
+/*
+ * OTA FEC command format
+ *
+ * ______________________________________________________________
+ * |     | Packet |     |     |  Group  |  Chunk  |     |     |
+ * | SOF | Type   | Len | CMD |  Size   |  Length |     |     |
+ * |     |        |     |     |         |         | CRC | EOF |
+ * |_____|________|_____|_____|_________|_________|_____|_____|
+ *   1B      1B     2B    1B      1B        2B       4B    1B
+ *
+ * Group size:   DATA packets covered by each parity packet (2 to EXT_OTA_FEC_GROUP_MAX)
+ * Chunk length: payload length of every DATA packet but the last one of the image (even)
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   packet_type;
+  uint16_t  data_len;
+  uint8_t   cmd;
+  uint8_t   group_size;
+  uint16_t  chunk_len;
+  uint32_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) EXT_OTA_FEC_COMMAND;
+
+/*
+ * OTA Payload size command format
+ *
+ * ________________________________________________________
+ * |     | Packet |     |     |    Max    |     |     |
+ * | SOF | Type   | Len | CMD |  Payload  | CRC | EOF |
+ * |_____|________|_____|_____|___________|_____|_____|
+ *   1B      1B     2B    1B       2B        4B    1B
+ *
+ * Caps the DATA payload for the rest of the session and turns on the payload size
+ * advice in the full-format responses.
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   packet_type;
+  uint16_t  data_len;
+  uint8_t   cmd;
+  uint16_t  max_payload;
+  uint32_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) EXT_OTA_PAYLOAD_SIZE_COMMAND;
+
+/*
+ * OTA Pull command format
+ *
+ * _________________________________________________
+ * |     | Packet |     |     |        |     |     |
+ * | SOF | Type   | Len | CMD | Window | CRC | EOF |
+ * |_____|________|_____|_____|________|_____|_____|
+ *   1B      1B     2B    1B      1B      4B    1B
+ *
+ * Once the header is acknowledged, the bootloader sends READ_CHUNK commands with up to
+ * Window of them in flight, and the host answers each with a DATA packet whose payload
+ * starts with the offset of the chunk (4B) followed by the chunk.
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   packet_type;
+  uint16_t  data_len;
+  uint8_t   cmd;
+  uint8_t   window;
+  uint32_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) EXT_OTA_PULL_COMMAND;
+
+/*
+ * OTA Read chunk command format (bootloader to host)
+ *
+ * ________________________________________________________
+ * |     | Packet |     |     |        |        |     |     |
+ * | SOF | Type   | Len | CMD | Offset | Length | CRC | EOF |
+ * |_____|________|_____|_____|________|________|_____|_____|
+ *   1B      1B     2B    1B      4B       2B      4B    1B
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   packet_type;
+  uint16_t  data_len;
+  uint8_t   cmd;
+  uint32_t  offset;
+  uint16_t  length;
+  uint32_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) EXT_OTA_READ_CHUNK_COMMAND;
+
+/*
+ * OTA Bond command (EXT_OTA_COMMAND with CMD = EXT_OTA_CMD_BOND)
+ *
+ * Once the command is acknowledged, the bootloader also receives on the other UART link.
+ * The host stripes the DATA packets over both links, in increasing offset order on each
+ * link. The payload of each DATA packet starts with the offset of the chunk (4B) followed
+ * by the chunk, as in the pull mode. The other packets stay on the session link.
+ */
+
+/*
+ * OTA Multidrop command format
+ *
+ * ________________________________________________
+ * |     | Packet |     |     |  Chunk  |     |     |
+ * | SOF | Type   | Len | CMD |  Length | CRC | EOF |
+ * |_____|________|_____|_____|_________|_____|_____|
+ *   1B      1B     2B    1B      2B       4B    1B
+ *
+ * Sent before the header. The image is broadcast in chunks of Chunk length (even, from
+ * EXT_OTA_DATA_MIN_SIZE), each at an offset multiple of it, the last one may be shorter.
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   packet_type;
+  uint16_t  data_len;
+  uint8_t   cmd;
+  uint16_t  chunk_len;
+  uint32_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) EXT_OTA_MULTIDROP_COMMAND;
+
+/*
+ * OTA Missing command (EXT_OTA_COMMAND with CMD = EXT_OTA_CMD_MISSING)
+ *
+ * Polls a node for the chunks of the broadcast image it has not received yet,
+ * it is answered with the Missing response instead of the ACK.
+ */
+
+/*
+ * OTA Relay command format
+ *
+ * _______________________________________________
+ * |     | Packet |     |     |      |     |     |
+ * | SOF | Type   | Len | CMD | Hops | CRC | EOF |
+ * |_____|________|_____|_____|______|_____|_____|
+ *   1B      1B     2B    1B     1B     4B    1B
+ *
+ * Sent before the header. Hops: boards further down the daisy chain, from 1.
+ * Once the header is received, the bootloader runs a session with the next board over USART3
+ * as its host: START, RELAY (Hops - 1, when more boards follow), HEADER, then the image read
+ * back from its slot in DATA packets of EXT_OTA_RELAY_CHUNK bytes as soon as they are written,
+ * and END. The END is acknowledged once the next board has acknowledged its own END, so
+ * the ACK covers the rest of the chain. Each board allows it EXT_OTA_INTER_FRAME_TIMEOUT per hop.
+ * The image must arrive in order: not with the pull, FEC, bond or multidrop modes.
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   packet_type;
+  uint16_t  data_len;
+  uint8_t   cmd;
+  uint8_t   hops;
+  uint32_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) EXT_OTA_RELAY_COMMAND;
+
 /*
  * OTA Header format
  *
@@ -172,6 +618,20 @@ typedef struct
   uint8_t     *data;
 }__attribute__((packed)) EXT_OTA_DATA;
 
+/*
+ * OTA Parity format
+ *
+ * ______________________________________________________
+ * |     | Packet |     |       |          |     |     |
+ * | SOF | Type   | Len | Count |  Parity  | CRC | EOF |
+ * |_____|________|_____|_______|__________|_____|_____|
+ *   1B      1B     2B     2B     Chunk B    4B    1B
+ *
+ * Sent after the DATA packets of each FEC group.
+ * Count:  DATA packets in the group, the last group of the image may be shorter
+ * Parity: XOR of the payloads of the group, each padded with zeros to the chunk length
+ */
+
 /*
  * OTA Response format
  *
@@ -191,9 +651,303 @@ typedef struct
   uint8_t   eof;
 }__attribute__((packed)) EXT_OTA_RESP;
 
+/*
+ * OTA NACK response format
+ *
+ * ________________________________________________________
+ * |     | Packet |     |        |  Expected  |     |     |
+ * | SOF | Type   | Len | Status |  Sequence  | CRC | EOF |
+ * |_____|________|_____|________|____________|_____|_____|
+ *   1B      1B     2B      1B         1B        4B    1B
+ *
+ * Expected sequence: number of packets accepted so far in the session (modulo 256),
+ * the host resends from this packet. CRC covers Status and Expected sequence.
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   packet_type;
+  uint16_t  data_len;
+  uint8_t   status;
+  uint8_t   seq;
+  uint32_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) EXT_OTA_NACK_RESP;
+
+/*
+ * OTA Adaptive response format
+ *
+ * ___________________________________________________________________
+ * |     | Packet |     |        |  Expected  |  Advised  |     |     |
+ * | SOF | Type   | Len | Status |  Sequence  |  Payload  | CRC | EOF |
+ * |_____|________|_____|________|____________|___________|_____|_____|
+ *   1B      1B     2B      1B         1B          2B        4B    1B
+ *
+ * Replaces the full-format ACK and NACK once the payload size has been negotiated.
+ * Advised payload: DATA payload length the host should use for the next packets.
+ * CRC covers Status, Expected sequence and Advised payload.
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   packet_type;
+  uint16_t  data_len;
+  uint8_t   status;
+  uint8_t   seq;
+  uint16_t  payload_len;
+  uint32_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) EXT_OTA_ADAPTIVE_RESP;
+
+/*
+ * OTA Bond response format
+ *
+ * _________________________________________________________________
+ * |     | Packet |     |        |        |  Expected  |     |     |
+ * | SOF | Type   | Len | Status | Links  |  Offset    | CRC | EOF |
+ * |_____|________|_____|________|________|____________|_____|_____|
+ *   1B      1B     2B      1B       1B         4B        4B    1B
+ *
+ * Replaces the other responses once the links are bonded, it is sent on the link
+ * the packet has been received on.
+ * Links:           bit n set while link n (0: USART1, 1: USART3) is part of the bond
+ * Expected offset: bytes of the image written in order so far, the host resends from it
+ * CRC covers Status, Links and Expected offset.
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   packet_type;
+  uint16_t  data_len;
+  uint8_t   status;
+  uint8_t   links;
+  uint32_t  offset;
+  uint32_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) EXT_OTA_BOND_RESP;
+
+/*
+ * OTA Missing response format
+ *
+ * _____________________________________________________________________
+ * |     | Packet |     |        |      |         |        |     |     |
+ * | SOF | Type   | Len | Status | Node | Missing | Bitmap | CRC | EOF |
+ * |_____|________|_____|________|______|_________|________|_____|_____|
+ *   1B      1B     2B      1B      1B      2B       26B     4B    1B
+ *
+ * Node:    address of the node answering
+ * Missing: number of chunks still missing
+ * Bitmap:  bit n (LSB first) set while chunk n is missing
+ * CRC covers Status, Node, Missing and Bitmap.
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   packet_type;
+  uint16_t  data_len;
+  uint8_t   status;
+  uint8_t   node;
+  uint16_t  missing;
+  uint8_t   bitmap[EXT_OTA_MD_BITMAP_SIZE];
+  uint32_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) EXT_OTA_MISSING_RESP;
+
+/*
+ * OTA Compact response format
+ *
+ * ____________________________
+ * |        |          |       |
+ * | Status | Sequence | Check |
+ * |________|__________|_______|
+ *     1B        1B        1B
+ *
+ * Sequence: number of packets accepted so far in the session (modulo 256)
+ * Check:    ~(Status ^ Sequence)
+ */
+typedef struct
+{
+  uint8_t   status;
+  uint8_t   seq;
+  uint8_t   check;
+}__attribute__((packed)) EXT_OTA_COMPACT_RESP;
+
+/*
+ * Payload of a packet inside the receive ring.
+ * A payload that wraps the end of the ring is split in two pieces.
+ */
+typedef struct
+{
+  uint8_t*  ptr[2];
+  uint16_t  len[2];
+  uint32_t  offset;       // Offset of the payload in the firmware image
+}EXT_OTA_SLICE;
+
+// Chunk requested from the host in the pull mode
+typedef struct
+{
+  uint32_t  offset;
+  uint16_t  len;          // 0 when the slot is free
+  uint32_t  order;        // Order in which the request has been sent
+}EXT_OTA_PULL_REQ;
+
+// Job of the Flash queue
+typedef enum
+{
+	EXT_OTA_FLASH_JOB_ERASE,
+	EXT_OTA_FLASH_JOB_PROGRAM,
+}EXT_OTA_FLASH_JOB_TYPE;
+
+// Erase of pages or program of a payload, advanced a page or a halfword per end of operation
+typedef struct
+{
+  uint8_t         type;         // EXT_OTA_FLASH_JOB_TYPE
+  uint8_t         ack;          // The ACK of the packet is held until the job is done
+  uint16_t        count;        // Pages to erase, or halfwords to program
+  uint16_t        done;         // Pages or halfwords done
+  uint16_t        programmed;   // Halfwords physically programmed, the 0xFFFF ones skipped
+  uint32_t        address;      // Flash address of the first page or halfword
+  EXT_OTA_SLICE   data;         // Payload in the receive ring, kept there until the job is done
+  uint32_t        ring_pos;     // Ring position of the frame holding the payload
+  uint32_t        seq;          // Packet count carried by the held ACK
+  uint32_t        start;        // Cycle counter when queued
+  uint32_t        cycles;       // Cycles from queued to done
+}EXT_OTA_FLASH_JOB;
+
+// View on a packet received in place in the receive ring
+typedef struct
+{
+  uint8_t         packet_type;
+  uint16_t        data_len;
+  uint16_t        frame_len;  // Bytes of the frame held in the receive ring
+  EXT_OTA_SLICE   payload;
+  uint8_t*        ctrl;       // Linear copy of a CMD/HEADER frame, NULL for DATA
+#if EXT_OTA_MULTIDROP_ENABLE
+  uint8_t         address;    // Destination of the frame, EXT_OTA_NODE_ADDRESS when not addressed
+#endif
+}EXT_OTA_PACKET_VIEW;
+
+/*
+ * SPI link
+ *
+ * The host MCU is the SPI master (mode 0, MSB first, up to PCLK2 / 8) and holds NSS low while it clocks.
+ * - It starts a frame only while READY is high. READY falls when the receive ring can not take
+ *   another full frame and while the Flash is erased.
+ * - Responses are clocked out on MISO while ATTN is high, the master sends 0x00 dummy bytes
+ *   meanwhile. The dummy bytes are skipped by both framings.
+ * - MISO carries no meaning while ATTN is low.
+ */
+
+/*
+ * CAN link
+ *
+ * Frames of either framing are carried ISO-TP style (ISO 15765-2, normal addressing) in classic
+ * CAN frames, the high nibble of the first byte (PCI) gives the kind of CAN frame:
+ * ________________________________________________________________
+ * |      |                      |                                |
+ * | PCI  | Bytes 1..7           |                                |
+ * |______|______________________|________________________________|
+ * | 0x0L | L bytes (1 to 7)     | Single frame                   |
+ * | 0x1L | LL, 6 bytes          | First frame of 12-bit length   |
+ * | 0x2N | 7 bytes              | Consecutive frame N (mod 16)   |
+ * | 0x3S | BS, STmin            | Flow control: S 0 CTS, 2 OVFLW |
+ * |______|______________________|________________________________|
+ *
+ * - The segmented messages are delivered into the receive ring one after the other.
+ * - The node answers a first frame and each block of EXT_OTA_CAN_BLOCK_SIZE consecutive frames
+ *   with a flow control, held back until the ring can take the next block, as RTS would be.
+ * - Responses longer than 7 bytes are sent as a first frame, the node then follows the block
+ *   size and STmin of the flow control of the host.
+ */
+
+// Largest frame sent on a link
+#if EXT_OTA_MULTIDROP_ENABLE
+#define EXT_OTA_TX_FRAME_MAX    sizeof(EXT_OTA_MISSING_RESP)
+#else
+#define EXT_OTA_TX_FRAME_MAX    sizeof(EXT_OTA_READ_CHUNK_COMMAND)
+#endif
+
+// Transport of a link
+typedef enum
+{
+	EXT_OTA_LINK_UART = 0,				// RX/TX DMA on a USART
+	EXT_OTA_LINK_USB,					// CDC-ACM bulk endpoints, fed by the CDC interface callbacks
+	EXT_OTA_LINK_SPI,					// SPI1 slave with RX/TX DMA, READY and ATTN lines
+	EXT_OTA_LINK_CAN,					// bxCAN with ISO-TP segmentation, served from its interrupts
+	EXT_OTA_LINK_LOOPBACK,				// Fed by a host-side test harness
+}EXT_OTA_LINK_TYPE;
+
+// Transport link of an OTA session: receive ring, response queue and link properties
+typedef struct
+{
+  const char*           name;
+  EXT_OTA_LINK_TYPE     type;
+  const struct EXT_OTA_LINK_OPS* ops;   // Transport backend, see ext_ota_link.h
+  UART_HandleTypeDef*   huart;          // NULL for the other link types
+  uint8_t               flow_control;   // RTS/CTS wired to the host
+  uint8_t               autobaud;       // RX pin captured by TIM1 for the autobaud
+  uint8_t               multidrop;      // RS-485 bus shared with other nodes, DE driven around the responses
+  // Receive ring, filled by the RX DMA and parsed in place
+  uint8_t               rx_ring[EXT_OTA_RX_RING_SIZE];
+  volatile uint32_t     rx_head;        // Total number of bytes written into the ring
+  volatile uint32_t     rx_tail;        // Total number of bytes consumed from the ring
+#if EXT_OTA_FLASH_ASYNC_ENABLE
+  volatile uint32_t     rx_keep;        // Oldest byte still read by a Flash job, rx_tail when none
+#endif
+  volatile uint16_t     rx_dma_len;     // Length of the region the RX DMA or OUT endpoint is armed on, 0 when stopped
+  volatile uint8_t      rx_error;       // A reception error (overrun, framing, noise) has been detected
+#if EXT_OTA_TX_DMA_ENABLE
+  // Response queue drained by the TX DMA, sized for the largest frame sent (READ_CHUNK, or Missing response)
+  uint8_t               tx_queue[EXT_OTA_TX_QUEUE_DEPTH][EXT_OTA_TX_FRAME_MAX];
+  uint8_t               tx_len[EXT_OTA_TX_QUEUE_DEPTH];
+  volatile uint8_t      tx_head;
+  volatile uint8_t      tx_tail;
+  volatile uint8_t      tx_busy;
+#endif
+#if EXT_OTA_BOND_ENABLE
+  // DATA packet held in the ring until the bonded links reach its offset
+  EXT_OTA_PACKET_VIEW   bond_packet;
+  uint16_t              bond_len;       // 0 when no packet is held
+  uint32_t              bond_seen;      // Tick of the last byte received
+  uint32_t              bond_packets;   // DATA packets accepted on the link
+  uint32_t              bond_bytes;     // Image bytes written from the link
+#endif
+}EXT_OTA_LINK;
+
 // Function prototypes
 EXT_OTA_EX EXT_OTA_Update(void);
 void EXT_OTA_Load_New_App(void);
 uint32_t CalcCRC(uint8_t * pData, uint32_t DataLength);
+uint32_t CalcCRC_Update(uint32_t Checksum, uint8_t * pData, uint32_t DataLength);
+uint8_t EXT_OTA_Owns_Uart(UART_HandleTypeDef* huart);
+#if EXT_OTA_LINK_LOOPBACK_ENABLE
+uint16_t EXT_OTA_Loopback_Rx(const uint8_t* data, uint16_t len);
+void EXT_OTA_Loopback_Tx(const uint8_t* frame, uint16_t len);
+#endif
+#if EXT_OTA_LINK_USB_ENABLE
+/*
+ * USB CDC-ACM glue, called from usbd_cdc_if.c (or from a simulated endpoint on the host):
+ *   CDC_Init_FS()           -> nothing, the OUT endpoint is armed when the link is listened to
+ *   CDC_Receive_FS(Buf,Len) -> EXT_OTA_Usb_Rx_Done(Buf, *Len)
+ *   CDC_TransmitCplt_FS()   -> EXT_OTA_Usb_Tx_Done()
+ * and the weak hooks below are provided on top of USBD_CDC_SetRxBuffer()/USBD_CDC_ReceivePacket()
+ * and CDC_Transmit_FS().
+ */
+void EXT_OTA_Usb_Rx_Done(uint8_t* buf, uint32_t len);
+void EXT_OTA_Usb_Tx_Done(void);
+void EXT_OTA_Usb_Rx_Arm(uint8_t* buf);
+HAL_StatusTypeDef EXT_OTA_Usb_Tx(uint8_t* frame, uint16_t len);
+#endif
+#if EXT_OTA_LINK_CAN_ENABLE
+void EXT_OTA_Can_Rx_IRQHandler(void);
+void EXT_OTA_Can_Tx_IRQHandler(void);
+void EXT_OTA_Can_Tick(void);
+#endif
+#if EXT_OTA_FLASH_ASYNC_ENABLE
+void EXT_OTA_Flash_IRQHandler(void);
+#endif
+#if EXT_OTA_RAM_EXEC_ENABLE
+uint8_t EXT_OTA_Rx_Dma_IRQHandler(DMA_HandleTypeDef* hdma);
+#endif
 
 #endif
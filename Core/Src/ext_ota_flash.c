@@ -0,0 +1,586 @@
+/*
+ * ext_ota_flash.c
+ *
+ *  Flash backend of the OTA session: the slot and configuration writes go through a page write-back cache,
+ *  which programs the Flash from the CPU, from RAM or with the DMA
+ */
+
+#include "ext_ota_flash.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Page write-back cache in front of the slot writes: no page cached, and the slot of the cached page
+#define EXT_OTA_CACHE_NONE				0xFFFFFFFFu
+#define EXT_OTA_CACHE_SLOT_ADDRESS		((cache_slot == 0) ? EXT_APP_SLOT0_FLASH_ADD : EXT_APP_SLOT1_FLASH_ADD)
+
+// Page write-back cache: the page and its slot, and the bytes written since it was loaded
+static uint16_t ota_page_cache[FLASH_PAGE_SIZE / 2u];
+static uint32_t cache_page = EXT_OTA_CACHE_NONE;
+static uint8_t cache_slot;
+static uint32_t cache_lo = FLASH_PAGE_SIZE;
+static uint32_t cache_hi;
+#if EXT_OTA_FLASH_DMA_ENABLE
+// Cleared for good once the Flash has rejected a DMA transfer
+static uint8_t flash_dma_usable = 1u;
+// Benchmark of the DMA and CPU backends over the session
+static uint32_t ota_dma_halfwords;
+static uint32_t ota_dma_cycles;
+static uint32_t ota_cpu_halfwords;
+static uint32_t ota_cpu_cycles;
+#endif
+
+/********************************* Private Functions Prototypes *****************************************/
+
+static HAL_StatusTypeDef EXT_OTA_Cache_Write(uint32_t offset, const uint8_t* data, uint16_t len);
+static HAL_StatusTypeDef EXT_OTA_Flash_Program_Buffer(uint32_t address, const uint16_t* data, uint16_t count);
+#if EXT_OTA_RAM_EXEC_ENABLE
+static HAL_StatusTypeDef EXT_OTA_Ram_Flash_End(void);
+#endif
+#if EXT_OTA_FLASH_DMA_ENABLE
+static HAL_StatusTypeDef EXT_OTA_Dma_Transfer(uint32_t address, const uint16_t* data, uint16_t count);
+#endif
+
+/******************************** Private Functions Code ***********************************************/
+
+/*
+ * @brief Copy bytes into the page write-back cache. Reaching another page writes the cached one to the Flash.
+ * @param offset: offset of the first byte in the slot
+ * @param data: bytes to write
+ * @param len: number of bytes
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Cache_Write(uint32_t offset, const uint8_t* data, uint16_t len)
+{
+	uint32_t page;
+	uint32_t idx;
+	uint32_t n;
+
+	while(len != 0u)
+	{
+		page = offset - (offset % FLASH_PAGE_SIZE);
+		if(page != cache_page)
+		{
+			if(EXT_OTA_Cache_Flush() != HAL_OK)
+			{
+				return HAL_ERROR;
+			}
+			// The bytes not written keep what the Flash holds
+			memcpy(ota_page_cache, (const uint8_t*)(EXT_OTA_CACHE_SLOT_ADDRESS + page), FLASH_PAGE_SIZE);
+			cache_page = page;
+		}
+		idx = offset - page;
+		n = FLASH_PAGE_SIZE - idx;
+		if(n > len)
+		{
+			n = len;
+		}
+		memcpy((uint8_t*)ota_page_cache + idx, data, n);
+		if(idx < cache_lo)
+		{
+			cache_lo = idx;
+		}
+		if(idx + n > cache_hi)
+		{
+			cache_hi = idx + n;
+		}
+		offset += n;
+		data += n;
+		len -= n;
+	}
+	return HAL_OK;
+}
+
+/*
+ * @brief Program halfwords of the Flash, unlocked, from a buffer in RAM
+ * @param address: Flash address of the first halfword
+ * @param data: halfwords
+ * @param count: number of halfwords
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Flash_Program_Buffer(uint32_t address, const uint16_t* data, uint16_t count)
+{
+	HAL_StatusTypeDef ret = HAL_OK;
+#if EXT_OTA_FLASH_DMA_ENABLE
+	uint32_t cycles = DWT->CYCCNT;
+	uint8_t fallback = 0u;
+
+	// The DMA backend is checked against the buffer. When the Flash rejects its writes,
+	// it is dropped and the CPU programs the halfwords left.
+	if(flash_dma_usable)
+	{
+		ret = EXT_OTA_Dma_Transfer(address, data, count);
+		for(uint16_t i = 0; i < count && ret == HAL_OK; ++i)
+		{
+			if(((const volatile uint16_t*)address)[i] != data[i])
+			{
+				ret = HAL_ERROR;
+			}
+		}
+		if(ret == HAL_OK)
+		{
+			ota_dma_cycles += DWT->CYCCNT - cycles;
+			ota_dma_halfwords += count;
+			ota_flash_programmed += count * 2u;
+			return HAL_OK;
+		}
+		printf("Flash DMA rejected, the CPU programs the Flash\r\n");
+		flash_dma_usable = 0u;
+		fallback = 1u;
+		cycles = DWT->CYCCNT;
+	}
+#endif
+
+	for(uint16_t i = 0; i < count; ++i, address += 2u)
+	{
+#if EXT_OTA_FLASH_DMA_ENABLE
+		// The halfwords the DMA has written are left as they are
+		if(fallback && *(const volatile uint16_t*)address == data[i])
+		{
+			continue;
+		}
+#endif
+		ret = EXT_OTA_FLASH_PROGRAM(address, data[i]);
+		if(ret != HAL_OK)
+		{
+			break;
+		}
+		ota_flash_programmed += 2u;
+	}
+#if EXT_OTA_FLASH_DMA_ENABLE
+	ota_cpu_cycles += DWT->CYCCNT - cycles;
+	ota_cpu_halfwords += count;
+#endif
+	return ret;
+}
+
+#if EXT_OTA_RAM_EXEC_ENABLE
+/*
+ * @brief Wait in RAM for the end of a Flash operation. No tick timeout: HAL_GetTick() runs from the Flash.
+ * @param none
+ * @retval HAL_StatusTypeDef
+ */
+EXT_OTA_RAMFUNC static HAL_StatusTypeDef EXT_OTA_Ram_Flash_End(void)
+{
+	while(READ_BIT(FLASH->SR, FLASH_SR_BSY) != 0u)
+	{
+	}
+	if(READ_BIT(FLASH->SR, FLASH_SR_PGERR | FLASH_SR_WRPRTERR) != 0u)
+	{
+		WRITE_REG(FLASH->SR, FLASH_SR_PGERR | FLASH_SR_WRPRTERR | FLASH_SR_EOP);
+		return HAL_ERROR;
+	}
+	WRITE_REG(FLASH->SR, FLASH_SR_EOP);
+	return HAL_OK;
+}
+#endif
+
+#if EXT_OTA_FLASH_DMA_ENABLE
+/*
+ * @brief Program halfwords of the Flash with a memory-to-memory transfer of DMA1 Channel 1, PG set.
+ *        The end of transfer hands the last halfword to the Flash, the end of its program follows.
+ * @param address: Flash address of the first halfword
+ * @param data: halfwords in RAM
+ * @param count: halfwords to program
+ * @retval HAL_StatusTypeDef: HAL_ERROR when the DMA or the Flash has reported an error
+ */
+EXT_OTA_RAMFUNC static HAL_StatusTypeDef EXT_OTA_Dma_Transfer(uint32_t address, const uint16_t* data, uint16_t count)
+{
+	uint32_t error;
+
+	CLEAR_BIT(DMA1_Channel1->CCR, DMA_CCR_EN);
+	WRITE_REG(DMA1->IFCR, DMA_IFCR_CGIF1);
+	WRITE_REG(FLASH->SR, FLASH_SR_PGERR | FLASH_SR_WRPRTERR | FLASH_SR_EOP);
+	// Memory to memory: read from CMAR, written to CPAR
+	WRITE_REG(DMA1_Channel1->CPAR, address);
+	WRITE_REG(DMA1_Channel1->CMAR, (uint32_t)data);
+	WRITE_REG(DMA1_Channel1->CNDTR, count);
+	SET_BIT(FLASH->CR, FLASH_CR_PG);
+	WRITE_REG(DMA1_Channel1->CCR, DMA_CCR_MEM2MEM | DMA_CCR_DIR | DMA_CCR_PINC | DMA_CCR_MINC |
+								  DMA_CCR_PSIZE_0 | DMA_CCR_MSIZE_0 | DMA_CCR_EN);
+
+	while(READ_BIT(DMA1->ISR, DMA_ISR_TCIF1 | DMA_ISR_TEIF1) == 0u)
+	{
+	}
+	while(READ_BIT(FLASH->SR, FLASH_SR_BSY) != 0u)
+	{
+	}
+	CLEAR_BIT(DMA1_Channel1->CCR, DMA_CCR_EN);
+	CLEAR_BIT(FLASH->CR, FLASH_CR_PG);
+
+	error = READ_BIT(DMA1->ISR, DMA_ISR_TEIF1) | READ_BIT(FLASH->SR, FLASH_SR_PGERR | FLASH_SR_WRPRTERR);
+	if(READ_BIT(FLASH->SR, FLASH_SR_EOP) == 0u)
+	{
+		error = 1u;
+	}
+	WRITE_REG(FLASH->SR, FLASH_SR_PGERR | FLASH_SR_WRPRTERR | FLASH_SR_EOP);
+	WRITE_REG(DMA1->IFCR, DMA_IFCR_CGIF1);
+	return (error != 0u) ? HAL_ERROR : HAL_OK;
+}
+#endif
+
+/******************************** General Function Code *****************************/
+/*
+ * @brief Start the Flash backends for a new session: empty cache, queue and statistics
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Flash_Open(void)
+{
+	EXT_OTA_Cache_Discard();
+#if EXT_OTA_FLASH_DMA_ENABLE
+	ota_dma_halfwords		= 0u;
+	ota_dma_cycles			= 0u;
+	ota_cpu_halfwords		= 0u;
+	ota_cpu_cycles			= 0u;
+#endif
+	EXT_OTA_Flash_Queue_Open();
+	EXT_OTA_Cut_Open();
+}
+
+/*
+ * @brief End the session on the Flash: no job left running, nor bytes in the cache
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Flash_Close(void)
+{
+	EXT_OTA_Flash_Queue_Close();
+	(void)EXT_OTA_Cache_Flush();
+}
+
+/*
+ * @brief Print the Flash statistics of the session
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Flash_Report(void)
+{
+	printf("Flash: %lu of %lu bytes programmed\r\n", ota_flash_programmed, ota_fw_total_size);
+	EXT_OTA_Flash_Queue_Report();
+#if EXT_OTA_FLASH_DMA_ENABLE
+	// Programming time of a KB by each backend
+	printf("Flash DMA: %lu halfwords, %lu us/KB - CPU: %lu halfwords, %lu us/KB%s\r\n",
+		   ota_dma_halfwords, (ota_dma_halfwords != 0u) ? (uint32_t)((uint64_t)ota_dma_cycles * 512u / ota_dma_halfwords / (SystemCoreClock / 1000000u)) : 0u,
+		   ota_cpu_halfwords, (ota_cpu_halfwords != 0u) ? (uint32_t)((uint64_t)ota_cpu_cycles * 512u / ota_cpu_halfwords / (SystemCoreClock / 1000000u)) : 0u,
+		   flash_dma_usable ? "" : " (DMA rejected)");
+#endif
+	EXT_OTA_Cut_Report();
+}
+
+/*
+ * @brief Write an in-order DATA payload at the write position: already in the Flash when it was
+ *        programmed while it arrived, queued with the Flash job queue, or written through the cache
+ * @param payload: payload in the receive ring, its offset is set to the write position
+ * @param is_first_block: true - if this is the first block
+ * @retval HAL_StatusTypeDef
+ */
+HAL_StatusTypeDef EXT_OTA_Flash_Write(EXT_OTA_SLICE* payload, uint8_t is_first_block)
+{
+	uint16_t len = payload->len[0] + payload->len[1];
+
+	if(EXT_OTA_Cut_Done(len))
+	{
+		ota_fw_received_size += len;
+		return HAL_OK;
+	}
+	payload->offset = ota_fw_received_size;
+#if EXT_OTA_FLASH_ASYNC_ENABLE
+	// Queued, the next frames are received while the Flash is busy
+	return EXT_OTA_Flash_Data(payload, is_first_block);
+#else
+	return EXT_OTA_Slot_Data_Write(payload, slot_num_to_write_fw, is_first_block);
+#endif
+}
+
+/*
+ * @brief Write data application to the actual flash memory, through the page write-back cache
+ * @param data: slice of data to be written, at its offset in the slot
+ * @param slot_num: slot to write to
+ * @param is_first_block: true - if this is the first block
+ */
+HAL_StatusTypeDef EXT_OTA_Slot_Data_Write(const EXT_OTA_SLICE* data, uint8_t slot_num, uint8_t is_first_block)
+{
+	HAL_StatusTypeDef ret = HAL_OK;
+	// Data write sequence
+	do
+	{
+		// Validate the input condition
+		if(slot_num >= EXT_SLOT_NO)
+		{
+			ret = HAL_ERROR;
+			break;
+		}
+		// The queued jobs are done before the Flash is written directly
+		EXT_OTA_Flash_Wait();
+		// Erase the flash in the first time
+		if(is_first_block)
+		{
+			printf("Erasing flash memory");
+
+			FLASH_EraseInitTypeDef EraseInitStruct;
+			uint32_t sector_error;
+
+			// The cached page is of the previous image
+			EXT_OTA_Cache_Discard();
+			// Unlock flash memory
+			ret = HAL_FLASH_Unlock();
+			if(ret != HAL_OK)
+			{
+				printf("Unable to unlock Flash memory, update stopped!");
+				break;
+			}
+
+			EraseInitStruct.TypeErase 	= FLASH_TYPEERASE_PAGES;
+			// Select the slot to erase
+			EraseInitStruct.PageAddress = (slot_num == 0) ? EXT_APP_SLOT0_FLASH_ADD : EXT_APP_SLOT1_FLASH_ADD;
+			EraseInitStruct.NbPages 	= DATA_FLASH_SIZE;	// 13 KB
+			// The CPU stalls on the Flash during the erase, the links that can not hold the sender off by themselves do it now
+			if(ota_link->ops->hold != NULL)
+			{
+				ota_link->ops->hold(ota_link, 1u);
+			}
+			ret = EXT_OTA_FLASH_ERASE(&EraseInitStruct, &sector_error);
+			if(ota_link->ops->hold != NULL)
+			{
+				ota_link->ops->hold(ota_link, 0u);
+			}
+			// Lock the Flash memory
+			HAL_FLASH_Lock();
+			if(ret != HAL_OK)
+			{
+				printf("Unable to erase Flash memory, updating stopped");
+				break;
+			}
+		}
+
+		// Merged into the cached page, a halfword may straddle two payloads or the two pieces of the slice
+		if(slot_num != cache_slot)
+		{
+			ret = EXT_OTA_Cache_Flush();
+			cache_slot = slot_num;
+		}
+		for(uint8_t piece = 0; piece < 2u && ret == HAL_OK; ++piece)
+		{
+			ret = EXT_OTA_Cache_Write(data->offset + ((piece != 0u) ? data->len[0] : 0u), data->ptr[piece], data->len[piece]);
+		}
+		if(ret != HAL_OK)
+		{
+			printf("Error: Unable to write to Flash, update stopped!");
+			break;
+		}
+		ota_fw_received_size += data->len[0] + data->len[1];
+	}
+	while(0);
+
+	return ret;
+}
+
+/*
+ * @brief Write the bytes of the cached page to the Flash, in runs of the halfwords that differ from it.
+ *        The page leaves the cache.
+ * @param none
+ * @retval HAL_StatusTypeDef
+ */
+HAL_StatusTypeDef EXT_OTA_Cache_Flush(void)
+{
+	HAL_StatusTypeDef ret = HAL_OK;
+	uint32_t address = EXT_OTA_CACHE_SLOT_ADDRESS + cache_page;
+	const volatile uint16_t* flash = (const volatile uint16_t*)address;
+	uint32_t first = cache_lo / 2u;
+	uint32_t end = (cache_hi + 1u) / 2u;
+	uint32_t run;
+
+	if(cache_page != EXT_OTA_CACHE_NONE && first < end)
+	{
+		ret = HAL_FLASH_Unlock();
+		while(first < end && ret == HAL_OK)
+		{
+			// Halfwords sent again, and the 0xFFFF ones of the erased slot, are already in the Flash
+			if(flash[first] == ota_page_cache[first])
+			{
+				first++;
+				continue;
+			}
+			for(run = 1u; first + run < end && flash[first + run] != ota_page_cache[first + run]; ++run)
+			{
+			}
+			ret = EXT_OTA_Flash_Program_Buffer(address + first * 2u, &ota_page_cache[first], (uint16_t)run);
+			first += run;
+		}
+		HAL_FLASH_Lock();
+	}
+	EXT_OTA_Cache_Discard();
+	return ret;
+}
+
+/*
+ * @brief Drop the cached page without writing it
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Cache_Discard(void)
+{
+	cache_page 	= EXT_OTA_CACHE_NONE;
+	cache_lo 	= FLASH_PAGE_SIZE;
+	cache_hi 	= 0u;
+}
+
+/*
+ * @brief Check if a payload has to be written through the cache by the paths that program the Flash
+ *        directly: odd, or at an odd offset, it shares a halfword with the payload before or after it
+ * @param offset: offset of the payload in the slot
+ * @param len: length of the payload
+ * @retval uint8_t: 1 - through the cache, 0 - whole halfwords
+ */
+uint8_t EXT_OTA_Cache_Needed(uint32_t offset, uint16_t len)
+{
+	return (((offset | len) & 1u) != 0u) ? 1u : 0u;
+}
+
+/*
+ * @brief Read bytes of the slot being written, the ones still in the cache included
+ * @param dst: destination
+ * @param offset: offset of the first byte in the slot
+ * @param len: number of bytes
+ * @retval none
+ */
+void EXT_OTA_Cache_Read(uint8_t* dst, uint32_t offset, uint16_t len)
+{
+	uint32_t lo = cache_page + cache_lo;
+	uint32_t hi = cache_page + cache_hi;
+
+	memcpy(dst, (const uint8_t*)(EXT_OTA_CACHE_SLOT_ADDRESS + offset), len);
+	if(cache_page == EXT_OTA_CACHE_NONE || lo >= hi)
+	{
+		return;
+	}
+	if(lo < offset)
+	{
+		lo = offset;
+	}
+	if(hi > offset + len)
+	{
+		hi = offset + len;
+	}
+	if(lo < hi)
+	{
+		memcpy(dst + (lo - offset), (const uint8_t*)ota_page_cache + (lo - cache_page), hi - lo);
+	}
+}
+
+#if EXT_OTA_RAM_EXEC_ENABLE
+/*
+ * @brief Erase Flash pages from RAM as HAL_FLASHEx_Erase() does, the interrupts executed from RAM
+ *        are served meanwhile
+ * @param erase: pages to erase
+ * @param page_error: address of the page that failed, 0xFFFFFFFF when all are erased
+ * @retval HAL_StatusTypeDef
+ */
+EXT_OTA_RAMFUNC HAL_StatusTypeDef EXT_OTA_Ram_Erase(FLASH_EraseInitTypeDef* erase, uint32_t* page_error)
+{
+	HAL_StatusTypeDef ret = HAL_OK;
+	uint32_t address = erase->PageAddress;
+
+	*page_error = 0xFFFFFFFFu;
+	for(uint32_t i = 0; i < erase->NbPages; ++i, address += FLASH_PAGE_SIZE)
+	{
+		SET_BIT(FLASH->CR, FLASH_CR_PER);
+		WRITE_REG(FLASH->AR, address);
+		SET_BIT(FLASH->CR, FLASH_CR_STRT);
+		ret = EXT_OTA_Ram_Flash_End();
+		CLEAR_BIT(FLASH->CR, FLASH_CR_PER);
+		if(ret != HAL_OK)
+		{
+			*page_error = address;
+			break;
+		}
+	}
+	return ret;
+}
+
+/*
+ * @brief Program a halfword of the Flash from RAM
+ * @param address: Flash address
+ * @param data: halfword
+ * @retval HAL_StatusTypeDef
+ */
+EXT_OTA_RAMFUNC HAL_StatusTypeDef EXT_OTA_Ram_Program(uint32_t address, uint16_t data)
+{
+	HAL_StatusTypeDef ret;
+
+	SET_BIT(FLASH->CR, FLASH_CR_PG);
+	*(__IO uint16_t*)address = data;
+	ret = EXT_OTA_Ram_Flash_End();
+	CLEAR_BIT(FLASH->CR, FLASH_CR_PG);
+	return ret;
+}
+#endif
+
+/*
+ * @brief Write configuration information into Flash memory
+ * @param cfg: current configuration
+ * @retval HAL_StatusTypeDef
+ */
+HAL_StatusTypeDef EXT_OTA_Write_Config(EXT_GNRL_CONFIG* cfg)
+{
+	HAL_StatusTypeDef ret;
+
+	do
+	{
+		// Check the input condition
+		if(cfg == NULL)
+		{
+			ret = HAL_ERROR;
+			break;
+		}
+		// The queued jobs are done before the Flash is written directly
+		EXT_OTA_Flash_Wait();
+		// Erase the Flash memory of the application
+		ret = HAL_FLASH_Unlock();
+		if(ret != HAL_OK)
+			break;
+
+		printf("Erasing config flash memory");
+
+		FLASH_EraseInitTypeDef EraseInitStruct;
+		uint32_t sector_error;
+
+		EraseInitStruct.TypeErase 	= FLASH_TYPEERASE_PAGES;
+		EraseInitStruct.PageAddress = EXT_CONFIG_FLASH_ADD;
+		EraseInitStruct.NbPages 	= CONFIG_FLASH_SIZE;	// 6 KB
+		ret = EXT_OTA_FLASH_ERASE(&EraseInitStruct, &sector_error);
+		if(ret != HAL_OK)
+		{
+			printf("Unable to erase Flash memory, updating stopped");
+			break;
+		}
+		// Program the new application into the Flash memory
+		uint8_t* data = (uint8_t*)cfg;
+		for(uint32_t i = 0; i < sizeof(EXT_GNRL_CONFIG) / 2; ++i)
+		{
+			uint16_t halfword_data = data[i * 2] | (data[i * 2 + 1] << 8);
+			ret = EXT_OTA_FLASH_PROGRAM((EXT_CONFIG_FLASH_ADD + (i * 2)), halfword_data);
+			if(ret != HAL_OK)
+			{
+				printf("Error: Unable to write to Flash, update stopped!");
+				break;
+			}
+		}
+		if(ret != HAL_OK)
+		{
+			break;
+		}
+
+		// Lock the Flash memory
+		ret = HAL_FLASH_Lock();
+		if(ret != HAL_OK)
+		{
+			printf("Error: Unable to lock Flash, update stopped!");
+			break;
+		}
+	}
+	while(0);
+
+	return ret;
+}
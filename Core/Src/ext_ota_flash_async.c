@@ -0,0 +1,390 @@
+/*
+ * ext_ota_flash_async.c
+ *
+ *  Flash job queue of the OTA session: the page erases and payload programs are queued by the main loop
+ *  and carried out by the FLASH interrupt while the next frames are received
+ */
+
+#include "ext_ota_flash.h"
+
+#include <stdio.h>
+
+#if EXT_OTA_FLASH_ASYNC_ENABLE
+
+// Flash jobs: queued by the main loop, completed by the FLASH interrupt, retired by the main loop
+static EXT_OTA_FLASH_JOB flash_jobs[EXT_OTA_FLASH_QUEUE_DEPTH];
+static uint32_t flash_job_head;
+static volatile uint32_t flash_job_run;
+static uint32_t flash_job_tail;
+// A page erase or halfword program is in flight, and whether one has failed
+static volatile uint8_t flash_busy;
+static volatile uint8_t flash_error;
+// The last DATA packet has queued a program job, its ACK can be held
+static uint8_t flash_ack_job;
+// Flash queue statistics of the session
+static uint32_t ota_flash_jobs;
+static uint32_t ota_flash_depth_max;
+static uint32_t ota_flash_cycles;
+static uint32_t ota_flash_cycles_max;
+
+/********************************* Private Functions Prototypes *****************************************/
+
+static void EXT_OTA_Flash_Step(void);
+static HAL_StatusTypeDef EXT_OTA_Flash_Queue(uint8_t type, uint32_t address, uint16_t count, const EXT_OTA_SLICE* data);
+
+/******************************** Private Functions Code ***********************************************/
+
+/*
+ * @brief Start the next page erase or halfword program of the oldest job, or stop the queue.
+ *        Called from the FLASH interrupt, or with the interrupts masked.
+ * @param none
+ * @retval none
+ */
+EXT_OTA_RAMFUNC static void EXT_OTA_Flash_Step(void)
+{
+	EXT_OTA_FLASH_JOB* job;
+	uint16_t halfword;
+	uint16_t idx;
+
+	CLEAR_BIT(FLASH->CR, FLASH_CR_PG | FLASH_CR_PER);
+	for(;;)
+	{
+		job = &flash_jobs[flash_job_run % EXT_OTA_FLASH_QUEUE_DEPTH];
+		if(flash_error || flash_job_run == flash_job_head)
+		{
+			CLEAR_BIT(FLASH->CR, FLASH_CR_EOPIE | FLASH_CR_ERRIE);
+			flash_busy = 0u;
+			return;
+		}
+		if(job->type == EXT_OTA_FLASH_JOB_ERASE)
+		{
+			SET_BIT(FLASH->CR, FLASH_CR_PER);
+			WRITE_REG(FLASH->AR, job->address + (uint32_t)job->done * FLASH_PAGE_SIZE);
+			SET_BIT(FLASH->CR, FLASH_CR_STRT);
+			return;
+		}
+		// A halfword may straddle the two pieces of the slice
+		idx = job->done * 2u;
+		halfword = EXT_OTA_Slice_Byte(&job->data, idx) | (EXT_OTA_Slice_Byte(&job->data, idx + 1u) << 8);
+		if(halfword != 0xFFFFu)
+		{
+			SET_BIT(FLASH->CR, FLASH_CR_PG);
+			*(__IO uint16_t*)(job->address + idx) = halfword;
+			job->programmed++;
+			return;
+		}
+		// The slot has been erased for the image, its 0xFFFF halfwords are already there
+		if(++job->done == job->count)
+		{
+			job->cycles = DWT->CYCCNT - job->start;
+			flash_job_run++;
+		}
+	}
+}
+
+/*
+ * @brief Queue a Flash job, and start the queue if it is idle. Waits for a free job when the
+ *        queue is full, the ACKs of the jobs done meanwhile are sent.
+ * @param type: EXT_OTA_FLASH_JOB_TYPE
+ * @param address: Flash address of the first page or halfword
+ * @param count: pages to erase, or halfwords to program
+ * @param data: payload in the receive ring of a program job, NULL for an erase
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Flash_Queue(uint8_t type, uint32_t address, uint16_t count, const EXT_OTA_SLICE* data)
+{
+	EXT_OTA_FLASH_JOB* job;
+	uint32_t depth;
+
+	do
+	{
+		if(EXT_OTA_Flash_Poll() != HAL_OK)
+		{
+			return HAL_ERROR;
+		}
+	}
+	while(flash_job_head - flash_job_tail == EXT_OTA_FLASH_QUEUE_DEPTH);
+
+	if(HAL_FLASH_Unlock() != HAL_OK)
+	{
+		printf("Unable to unlock Flash memory, update stopped!");
+		return HAL_ERROR;
+	}
+
+	job = &flash_jobs[flash_job_head % EXT_OTA_FLASH_QUEUE_DEPTH];
+	job->type 		= type;
+	job->ack 		= 0u;
+	job->count 		= count;
+	job->done 		= 0u;
+	job->programmed	= 0u;
+	job->address 	= address;
+	// The frame is released once the payload has been consumed, its bytes stay until the job is done
+	job->ring_pos 	= ota_link->rx_tail;
+	job->start 		= DWT->CYCCNT;
+	if(data != NULL)
+	{
+		job->data = *data;
+	}
+
+	__disable_irq();
+	flash_job_head++;
+	depth = flash_job_head - flash_job_run;
+	if(flash_busy == 0u)
+	{
+		flash_busy = 1u;
+		SET_BIT(FLASH->CR, FLASH_CR_EOPIE | FLASH_CR_ERRIE);
+		EXT_OTA_Flash_Step();
+	}
+	__enable_irq();
+
+	if(depth > ota_flash_depth_max)
+	{
+		ota_flash_depth_max = depth;
+	}
+	return HAL_OK;
+}
+
+/******************************** General Function Code *****************************/
+/*
+ * @brief Start the Flash job queue of a new session, with the FLASH interrupt
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Flash_Queue_Open(void)
+{
+	flash_job_head			= 0u;
+	flash_job_run			= 0u;
+	flash_job_tail			= 0u;
+	flash_error				= 0u;
+	flash_ack_job			= 0u;
+	ota_flash_jobs			= 0u;
+	ota_flash_depth_max		= 0u;
+	ota_flash_cycles		= 0u;
+	ota_flash_cycles_max	= 0u;
+	HAL_NVIC_SetPriority(FLASH_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(FLASH_IRQn);
+}
+
+/*
+ * @brief Stop the Flash job queue at the end of the session, once no job is running
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Flash_Queue_Close(void)
+{
+	EXT_OTA_Flash_Wait();
+	HAL_NVIC_DisableIRQ(FLASH_IRQn);
+}
+
+/*
+ * @brief Print the Flash queue statistics of the session
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Flash_Queue_Report(void)
+{
+	printf("Flash queue: %lu jobs, %lu queued at most, %lu us each, %lu us at most\r\n", ota_flash_jobs,
+		   ota_flash_depth_max, (ota_flash_jobs != 0u) ? (ota_flash_cycles / ota_flash_jobs / (SystemCoreClock / 1000000u)) : 0u,
+		   ota_flash_cycles_max / (SystemCoreClock / 1000000u));
+}
+
+/*
+ * @brief Check if Flash jobs are queued or running
+ * @param none
+ * @retval uint8_t: 1 - pending jobs, 0 - idle queue
+ */
+uint8_t EXT_OTA_Flash_Pending(void)
+{
+	return (flash_job_run != flash_job_head) ? 1u : 0u;
+}
+
+/*
+ * @brief Queue the writing of an in-order payload at its offset in the slot, after the erase of
+ *        the slot for the first block. The image counts it as written right away.
+ *        A payload that is odd, or starts at an odd offset, is written through the page cache.
+ * @param data: payload in the receive ring, with its offset in the image
+ * @param is_first_block: true - if this is the first block
+ * @retval HAL_StatusTypeDef
+ */
+HAL_StatusTypeDef EXT_OTA_Flash_Data(const EXT_OTA_SLICE* data, uint8_t is_first_block)
+{
+	uint32_t slot_address = (slot_num_to_write_fw == 0) ? EXT_APP_SLOT0_FLASH_ADD : EXT_APP_SLOT1_FLASH_ADD;
+	uint16_t len = data->len[0] + data->len[1];
+	HAL_StatusTypeDef ret = HAL_OK;
+
+	flash_ack_job = 0u;
+	if(slot_num_to_write_fw >= EXT_SLOT_NO)
+	{
+		return HAL_ERROR;
+	}
+	// The cache keeps the byte sharing its halfword with the next payload. The queue is done first,
+	// its held ACKs go out before this one.
+	if(EXT_OTA_Cache_Needed(data->offset, len))
+	{
+		if(EXT_OTA_Flash_Sync() != HAL_OK)
+		{
+			return HAL_ERROR;
+		}
+		return EXT_OTA_Slot_Data_Write(data, slot_num_to_write_fw, is_first_block);
+	}
+	// Bytes cached by a direct write go to the Flash first
+	if(EXT_OTA_Cache_Flush() != HAL_OK)
+	{
+		return HAL_ERROR;
+	}
+	if(is_first_block)
+	{
+		printf("Erasing flash memory");
+		ret = EXT_OTA_Flash_Queue(EXT_OTA_FLASH_JOB_ERASE, slot_address, DATA_FLASH_SIZE, NULL);
+#if EXT_OTA_RAM_EXEC_ENABLE
+		// The main loop would stall on the Flash, it waits in RAM while the interrupts receive
+		EXT_OTA_Flash_Wait();
+#endif
+	}
+	if(ret == HAL_OK && len != 0u)
+	{
+		ret = EXT_OTA_Flash_Queue(EXT_OTA_FLASH_JOB_PROGRAM, slot_address + data->offset, len / 2u, data);
+		flash_ack_job = (ret == HAL_OK) ? 1u : 0u;
+	}
+	if(ret == HAL_OK)
+	{
+		ota_fw_received_size += len;
+	}
+	return ret;
+}
+
+/*
+ * @brief Get the oldest byte of the session ring still needed: the frame of the first program job
+ *        not retired yet, or the first unconsumed byte
+ * @param none
+ * @retval uint32_t: ring position
+ */
+EXT_OTA_RAMFUNC uint32_t EXT_OTA_Flash_Keep(void)
+{
+	for(uint32_t i = flash_job_tail; i != flash_job_head; ++i)
+	{
+		if(flash_jobs[i % EXT_OTA_FLASH_QUEUE_DEPTH].type == EXT_OTA_FLASH_JOB_PROGRAM)
+		{
+			return flash_jobs[i % EXT_OTA_FLASH_QUEUE_DEPTH].ring_pos;
+		}
+	}
+	return ota_link->rx_tail;
+}
+
+/*
+ * @brief Retire the jobs the FLASH interrupt has completed: give their frames back to the ring
+ *        and send the ACKs held for them
+ * @param none
+ * @retval HAL_StatusTypeDef: HAL_ERROR once a job has failed
+ */
+HAL_StatusTypeDef EXT_OTA_Flash_Poll(void)
+{
+	EXT_OTA_FLASH_JOB* job;
+	uint32_t count;
+
+	while(flash_job_tail != flash_job_run)
+	{
+		job = &flash_jobs[flash_job_tail % EXT_OTA_FLASH_QUEUE_DEPTH];
+		ota_flash_jobs++;
+		ota_flash_cycles += job->cycles;
+		ota_flash_programmed += job->programmed * 2u;
+		if(job->cycles > ota_flash_cycles_max)
+		{
+			ota_flash_cycles_max = job->cycles;
+		}
+		flash_job_tail++;
+
+		__disable_irq();
+		ota_link->rx_keep = EXT_OTA_Flash_Keep();
+		EXT_OTA_Rx_Arm(ota_link);
+		__enable_irq();
+
+		if(job->ack)
+		{
+			// The ACK carries the packet count of the packet it completes
+			count = ota_packet_count;
+			ota_packet_count = job->seq;
+			printf("Sending ACK\r\n");
+			EXT_OTA_Send_Resp(EXT_OTA_ACK);
+			ota_packet_count = count;
+		}
+	}
+	return flash_error ? HAL_ERROR : HAL_OK;
+}
+
+/*
+ * @brief Wait until the Flash queue is idle: all the jobs done, or one failed. The Flash is locked.
+ * @param none
+ * @retval none
+ */
+EXT_OTA_RAMFUNC void EXT_OTA_Flash_Wait(void)
+{
+	while(flash_busy)
+	{
+	}
+	HAL_FLASH_Lock();
+}
+
+/*
+ * @brief Complete the queued jobs and send their ACKs, before a response of another packet
+ * @param none
+ * @retval HAL_StatusTypeDef: HAL_ERROR when a job has failed
+ */
+HAL_StatusTypeDef EXT_OTA_Flash_Sync(void)
+{
+	EXT_OTA_Flash_Wait();
+	flash_ack_job = 0u;
+	return EXT_OTA_Flash_Poll();
+}
+
+/*
+ * @brief Hold the ACK of the DATA packet just accepted until its program job is done
+ * @param none
+ * @retval uint8_t: 1 - held, 0 - no job, the ACK is sent now
+ */
+uint8_t EXT_OTA_Flash_Hold_Ack(void)
+{
+	EXT_OTA_FLASH_JOB* job = &flash_jobs[(flash_job_head - 1u) % EXT_OTA_FLASH_QUEUE_DEPTH];
+
+	if(flash_ack_job == 0u || flash_job_tail == flash_job_head)
+	{
+		return 0u;
+	}
+	flash_ack_job = 0u;
+	job->seq = ota_packet_count;
+	job->ack = 1u;
+	return 1u;
+}
+
+/*
+ * @brief FLASH interrupt: a page erase or halfword program has ended, start the next one
+ * @param none
+ * @retval none
+ */
+EXT_OTA_RAMFUNC void EXT_OTA_Flash_IRQHandler(void)
+{
+	EXT_OTA_FLASH_JOB* job = &flash_jobs[flash_job_run % EXT_OTA_FLASH_QUEUE_DEPTH];
+
+	if(READ_BIT(FLASH->SR, FLASH_SR_PGERR | FLASH_SR_WRPRTERR) != 0u)
+	{
+		// The queue stops, the session is given up
+		WRITE_REG(FLASH->SR, FLASH_SR_PGERR | FLASH_SR_WRPRTERR | FLASH_SR_EOP);
+		flash_error = 1u;
+	}
+	else if(READ_BIT(FLASH->SR, FLASH_SR_EOP) != 0u)
+	{
+		WRITE_REG(FLASH->SR, FLASH_SR_EOP);
+		if(++job->done == job->count)
+		{
+			job->cycles = DWT->CYCCNT - job->start;
+			flash_job_run++;
+		}
+	}
+	else
+	{
+		return;
+	}
+	EXT_OTA_Flash_Step();
+}
+
+#endif
@@ -0,0 +1,247 @@
+/*
+ * ext_ota_flash_cut.c
+ *
+ *  Cut-through programming of the OTA session: the payload of an in-order DATA frame is programmed while
+ *  it arrives, the pages of a damaged frame are erased again and the host sends from their start
+ */
+
+#include "ext_ota_flash.h"
+
+#include <stdio.h>
+
+#if EXT_OTA_CUT_THROUGH_ENABLE
+
+// Payload bytes of the frame being received already added to the CRC, and already in the Flash
+static uint16_t cut_len;
+static uint16_t cut_done;
+static uint32_t cut_crc;
+// End (slot offset) of the bytes programmed from damaged frames, their pages are erased again
+static uint32_t cut_dirty_end;
+// Sequence number and slot offset of the last DATA packets, to send again from a page boundary
+static uint32_t cut_hist_seq[EXT_OTA_CUT_HISTORY];
+static uint32_t cut_hist_offset[EXT_OTA_CUT_HISTORY];
+// Cut-through statistics of the session
+static uint32_t ota_cut_bytes;
+static uint32_t ota_cut_rollbacks;
+
+/********************************* Private Functions Prototypes *****************************************/
+
+static uint8_t EXT_OTA_Cut_Active(uint8_t packet_type, uint16_t data_len);
+
+/******************************** Private Functions Code ***********************************************/
+
+/*
+ * @brief Check if a DATA packet is programmed while it arrives: in-order push mode, once the slot
+ *        has been erased by the first block. Odd payloads go through the page cache, which keeps
+ *        the byte that shares its halfword with the next payload.
+ * @param packet_type: packet type
+ * @param data_len: payload length
+ * @retval uint8_t: 1 - cut-through, 0 - buffered
+ */
+static uint8_t EXT_OTA_Cut_Active(uint8_t packet_type, uint16_t data_len)
+{
+	return (packet_type == EXT_OTA_PACKET_TYPE_DATA && ota_state == EXT_OTA_STATE_DATA &&
+			ota_fw_received_size != 0u && EXT_OTA_Cache_Needed(ota_fw_received_size, data_len) == 0u && EXT_OTA_Is_Push_Mode() &&
+			data_len <= ota_payload_max && ota_fw_received_size + data_len <= EXT_SLOT_MAX_SIZE) ? 1u : 0u;
+}
+
+/******************************** General Function Code *****************************/
+/*
+ * @brief Start cut-through programming for a new session: no damaged page, empty statistics
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Cut_Open(void)
+{
+	cut_dirty_end			= 0u;
+	ota_cut_bytes			= 0u;
+	ota_cut_rollbacks		= 0u;
+}
+
+/*
+ * @brief Print the cut-through statistics of the session
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Cut_Report(void)
+{
+	printf("Cut-through: %lu bytes programmed on arrival, %lu pages rolled back\r\n",
+		   ota_cut_bytes, ota_cut_rollbacks);
+}
+
+/*
+ * @brief Start a new frame, none of its payload is programmed yet
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Cut_Reset(void)
+{
+	cut_len = 0u;
+	cut_done = 0u;
+}
+
+/*
+ * @brief Program the payload of a DATA frame at the write position as it arrives in the ring,
+ *        and compute its CRC on the way. The payload stays in the ring for the CRC check.
+ * @param packet_type: packet type
+ * @param offset: offset of the payload in the ring
+ * @param data_len: payload length
+ * @retval HAL_StatusTypeDef: HAL_OK as well when the payload is left to the CRC check
+ */
+HAL_StatusTypeDef EXT_OTA_Cut_Receive(uint8_t packet_type, uint32_t offset, uint16_t data_len)
+{
+	uint32_t address = ((slot_num_to_write_fw == 0) ? EXT_APP_SLOT0_FLASH_ADD : EXT_APP_SLOT1_FLASH_ADD) + ota_fw_received_size;
+	HAL_StatusTypeDef ret;
+	EXT_OTA_SLICE piece;
+	uint32_t available;
+	uint16_t halfword;
+	uint16_t n;
+
+	if(EXT_OTA_Cut_Active(packet_type, data_len) == 0u)
+	{
+		return HAL_OK;
+	}
+	cut_crc = 0xFFFFFFFF;
+	// The bytes before the write position are in the Flash before it is written directly
+	ret = EXT_OTA_Cache_Flush();
+	if(ret == HAL_OK)
+	{
+		ret = HAL_FLASH_Unlock();
+	}
+	while(ret == HAL_OK && cut_len < data_len)
+	{
+		// Wait for the next halfword
+		ret = EXT_OTA_Rx_Wait(offset + cut_len + 2u, EXT_OTA_INTER_BYTE_TIMEOUT);
+		if(ret != HAL_OK)
+		{
+			break;
+		}
+		available = EXT_OTA_Rx_Available() - offset;
+		n = ((available < data_len) ? available : data_len) - cut_len;
+		n &= (uint16_t)~1u;
+		EXT_OTA_Rx_Slice(offset + cut_len, n, &piece);
+		cut_crc = CalcCRC_Update(cut_crc, piece.ptr[0], piece.len[0]);
+		cut_crc = CalcCRC_Update(cut_crc, piece.ptr[1], piece.len[1]);
+		cut_len += n;
+
+		// Whole halfwords, the payload length is even
+		for(uint16_t i = 0; i + 1u < n; i += 2u)
+		{
+			halfword = EXT_OTA_Slice_Byte(&piece, i) | (EXT_OTA_Slice_Byte(&piece, i + 1u) << 8);
+			// Halfwords sent again before a rolled back page are already in the Flash
+			if(*(volatile uint16_t*)(address + cut_done) != halfword)
+			{
+				ret = EXT_OTA_FLASH_PROGRAM(address + cut_done, halfword);
+				if(ret != HAL_OK)
+				{
+					printf("Error: Unable to write to Flash\r\n");
+					break;
+				}
+				ota_cut_bytes += 2u;
+				ota_flash_programmed += 2u;
+			}
+			cut_done += 2u;
+		}
+	}
+	HAL_FLASH_Lock();
+	return ret;
+}
+
+/*
+ * @brief Get the CRC of the payload computed while it was programmed
+ * @param data_len: payload length of the frame
+ * @param crc: CRC of the payload
+ * @retval uint8_t: 1 - computed, 0 - the payload is left to the CRC check
+ */
+uint8_t EXT_OTA_Cut_Crc(uint16_t data_len, uint32_t* crc)
+{
+	if(cut_len != 0u && cut_len == data_len)
+	{
+		*crc = cut_crc;
+		return 1u;
+	}
+	return 0u;
+}
+
+/*
+ * @brief The frame being received is damaged: the bytes of it already in the Flash are to be rolled back
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Cut_Drop(void)
+{
+	if(cut_done != 0u && ota_fw_received_size + cut_done > cut_dirty_end)
+	{
+		cut_dirty_end = ota_fw_received_size + cut_done;
+	}
+	EXT_OTA_Cut_Reset();
+}
+
+/*
+ * @brief Record an accepted DATA packet at the write position, and check if it is already in the Flash
+ * @param data_len: payload length
+ * @retval uint8_t: 1 - programmed while it arrived, 0 - to be written
+ */
+uint8_t EXT_OTA_Cut_Done(uint16_t data_len)
+{
+	// Kept to send the image again from the start of a page
+	cut_hist_seq[ota_packet_count % EXT_OTA_CUT_HISTORY] 	= ota_packet_count;
+	cut_hist_offset[ota_packet_count % EXT_OTA_CUT_HISTORY] = ota_fw_received_size;
+	return (cut_len != 0u && cut_len == data_len) ? 1u : 0u;
+}
+
+/*
+ * @brief Erase again the pages holding bytes of damaged frames, and go back to the last packet
+ *        that starts at or before the first of them. The bytes of that packet before the page
+ *        are already in the Flash and are skipped when it is received again.
+ * @param none
+ * @retval HAL_StatusTypeDef: HAL_ERROR when the packet is no longer known, HAL_OK when no page is damaged
+ */
+HAL_StatusTypeDef EXT_OTA_Cut_Rollback(void)
+{
+	uint32_t slot_address = (slot_num_to_write_fw == 0) ? EXT_APP_SLOT0_FLASH_ADD : EXT_APP_SLOT1_FLASH_ADD;
+	uint32_t page = ota_fw_received_size - (ota_fw_received_size % FLASH_PAGE_SIZE);
+	FLASH_EraseInitTypeDef EraseInitStruct;
+	uint32_t sector_error;
+	HAL_StatusTypeDef ret = HAL_OK;
+	uint32_t seq = ota_packet_count;
+	uint32_t offset = ota_fw_received_size;
+
+	if(cut_dirty_end == 0u)
+	{
+		return HAL_OK;
+	}
+	// The last packets before the write position, newest first
+	for(uint32_t i = 1u; i <= EXT_OTA_CUT_HISTORY && offset > page && i <= ota_packet_count; ++i)
+	{
+		if(cut_hist_seq[(ota_packet_count - i) % EXT_OTA_CUT_HISTORY] == ota_packet_count - i)
+		{
+			seq = ota_packet_count - i;
+			offset = cut_hist_offset[seq % EXT_OTA_CUT_HISTORY];
+		}
+	}
+	if(offset > page)
+	{
+		return HAL_ERROR;
+	}
+
+	EraseInitStruct.TypeErase 	= FLASH_TYPEERASE_PAGES;
+	EraseInitStruct.PageAddress = slot_address + page;
+	EraseInitStruct.NbPages 	= (cut_dirty_end - page + FLASH_PAGE_SIZE - 1u) / FLASH_PAGE_SIZE;
+	EXT_OTA_Cache_Discard();
+	HAL_FLASH_Unlock();
+	ret = HAL_FLASHEx_Erase(&EraseInitStruct, &sector_error);
+	HAL_FLASH_Lock();
+	if(ret != HAL_OK)
+	{
+		return ret;
+	}
+	printf("Rolled back to packet %lu, offset %lu\r\n", seq, offset);
+	ota_cut_rollbacks += EraseInitStruct.NbPages;
+	ota_fw_received_size = offset;
+	ota_packet_count = seq;
+	cut_dirty_end = 0u;
+	return HAL_OK;
+}
+
+#endif
@@ -0,0 +1,528 @@
+/*
+ * ext_ota_link_can.c
+ *
+ *  CAN link backend: bxCAN frames carrying the OTA frames ISO-TP style (see ext_ota_update.h),
+ *  served from the CAN interrupts
+ */
+
+#include "ext_ota_link.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if EXT_OTA_LINK_CAN_ENABLE
+
+// ISO-TP reception: bytes of the message still expected, next sequence number, consecutive frames left in the block
+static uint16_t can_rx_left;
+static uint8_t can_rx_sn;
+static uint8_t can_rx_block;
+// A flow control is owed to the host, sent once the ring can take the next block and a mailbox is free
+static uint8_t can_fc_pending;
+// ISO-TP transmission of the response at the tail of the queue: bytes sent, next sequence number,
+// consecutive frames left in the block and STmin granted by the host, tick of the last frame
+static uint16_t can_tx_pos;
+static uint8_t can_tx_sn;
+static uint8_t can_tx_block;
+static uint8_t can_tx_stmin;
+static uint8_t can_tx_wait_fc;
+static uint32_t can_tx_tick;
+// CAN statistics of the session
+static uint32_t ota_can_frames;
+static uint32_t ota_can_fc_held;
+static uint32_t ota_can_overruns;
+
+/********************************* Private Functions Prototypes *****************************************/
+
+static void EXT_OTA_Can_Start(EXT_OTA_LINK* link);
+static void EXT_OTA_Can_Stop(EXT_OTA_LINK* link);
+static void EXT_OTA_Can_Arm(EXT_OTA_LINK* link);
+static HAL_StatusTypeDef EXT_OTA_Can_Tx(EXT_OTA_LINK* link, uint8_t* frame, uint16_t len);
+static void EXT_OTA_Can_Tx_Abort(EXT_OTA_LINK* link);
+static void EXT_OTA_Can_Report(EXT_OTA_LINK* link);
+static void EXT_OTA_Can_Init(void);
+static HAL_StatusTypeDef EXT_OTA_Can_Send(const uint8_t* data, uint8_t len);
+static void EXT_OTA_Can_Flow(EXT_OTA_LINK* link);
+static void EXT_OTA_Can_Rx_Frame(EXT_OTA_LINK* link, const uint8_t* data, uint8_t dlc);
+static void EXT_OTA_Can_Tx_Pump(EXT_OTA_LINK* link);
+
+const EXT_OTA_LINK_OPS ota_link_can_ops =
+{
+	.start 		= EXT_OTA_Can_Start,
+	.stop 		= EXT_OTA_Can_Stop,
+	.arm 		= EXT_OTA_Can_Arm,
+	.tx 		= EXT_OTA_Can_Tx,
+	.tx_abort 	= EXT_OTA_Can_Tx_Abort,
+	.report 	= EXT_OTA_Can_Report,
+};
+
+/******************************** Private Functions Code ***********************************************/
+
+/*
+ * @brief Configure bxCAN the first time the link is listened to, and let the FIFO in
+ * @param link: OTA link
+ * @retval none
+ */
+static void EXT_OTA_Can_Start(EXT_OTA_LINK* link)
+{
+	UNUSED(link);
+	if(__HAL_RCC_CAN1_IS_CLK_DISABLED())
+	{
+		EXT_OTA_Can_Init();
+	}
+	can_rx_left 	= 0u;
+	can_fc_pending 	= 0u;
+	ota_can_frames 	= 0u;
+	ota_can_fc_held = 0u;
+	ota_can_overruns = 0u;
+	SET_BIT(CAN1->IER, CAN_IER_FMPIE0);
+}
+
+/*
+ * @brief Stop taking the frames, those received meanwhile wait in the FIFO, three at most
+ * @param link: OTA link
+ * @retval none
+ */
+static void EXT_OTA_Can_Stop(EXT_OTA_LINK* link)
+{
+	UNUSED(link);
+	CLEAR_BIT(CAN1->IER, CAN_IER_FMPIE0);
+	can_rx_left = 0u;
+	can_fc_pending = 0u;
+}
+
+/*
+ * @brief The receive interrupt fills the ring, the flow control held back for room is sent now
+ * @param link: OTA link
+ * @retval none
+ */
+static void EXT_OTA_Can_Arm(EXT_OTA_LINK* link)
+{
+	if(can_fc_pending)
+	{
+		EXT_OTA_Can_Flow(link);
+	}
+}
+
+/*
+ * @brief Start sending the response at the tail of the queue, segmented from the mailbox interrupt.
+ *        The first frame goes out right away when a mailbox is free.
+ * @param link: OTA link
+ * @param frame: response frame, read from the queue by the mailbox interrupt
+ * @param len: length of the frame
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Can_Tx(EXT_OTA_LINK* link, uint8_t* frame, uint16_t len)
+{
+	UNUSED(frame);
+	UNUSED(len);
+	can_tx_pos = 0u;
+	can_tx_wait_fc = 0u;
+	EXT_OTA_Can_Tx_Pump(link);
+	return HAL_OK;
+}
+
+/*
+ * @brief Abort the frames of the response still in the mailboxes
+ * @param link: OTA link
+ * @retval none
+ */
+static void EXT_OTA_Can_Tx_Abort(EXT_OTA_LINK* link)
+{
+	UNUSED(link);
+	SET_BIT(CAN1->TSR, CAN_TSR_ABRQ0 | CAN_TSR_ABRQ1 | CAN_TSR_ABRQ2);
+	can_tx_wait_fc = 0u;
+}
+
+/*
+ * @brief Print the CAN statistics of the session
+ * @param link: OTA link
+ * @retval none
+ */
+static void EXT_OTA_Can_Report(EXT_OTA_LINK* link)
+{
+	UNUSED(link);
+	printf("CAN: %lu bit/s, %lu frames, %lu flow controls held back, %lu overruns\r\n",
+		   EXT_OTA_CAN_BITRATE, ota_can_frames, ota_can_fc_held, ota_can_overruns);
+}
+
+/*
+ * @brief Configure bxCAN at EXT_OTA_CAN_BITRATE on PB8/PB9, with the acceptance filter set to the node ID
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Can_Init(void)
+{
+	GPIO_InitTypeDef GPIO_InitStruct = {0};
+	uint32_t tick_start;
+
+	__HAL_RCC_CAN1_CLK_ENABLE();
+	__HAL_RCC_GPIOB_CLK_ENABLE();
+	__HAL_RCC_AFIO_CLK_ENABLE();
+
+	/**CAN GPIO Configuration
+	PB8     ------> CAN_RX
+	PB9     ------> CAN_TX
+	*/
+	__HAL_AFIO_REMAP_CAN1_2();
+	GPIO_InitStruct.Pin 	= GPIO_PIN_8;
+	GPIO_InitStruct.Mode 	= GPIO_MODE_INPUT;
+	GPIO_InitStruct.Pull 	= GPIO_PULLUP;
+	HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+
+	GPIO_InitStruct.Pin 	= GPIO_PIN_9;
+	GPIO_InitStruct.Mode 	= GPIO_MODE_AF_PP;
+	GPIO_InitStruct.Pull 	= GPIO_NOPULL;
+	GPIO_InitStruct.Speed 	= GPIO_SPEED_FREQ_HIGH;
+	HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+
+	// Leave the sleep mode for the initialization mode
+	CLEAR_BIT(CAN1->MCR, CAN_MCR_SLEEP);
+	SET_BIT(CAN1->MCR, CAN_MCR_INRQ);
+	tick_start = HAL_GetTick();
+	while(READ_BIT(CAN1->MSR, CAN_MSR_INAK) == 0u && (HAL_GetTick() - tick_start) < 10u)
+	{
+	}
+
+	// Automatic bus-off recovery, mailboxes sent in the order they are requested
+	CAN1->MCR = CAN_MCR_INRQ | CAN_MCR_ABOM | CAN_MCR_TXFP;
+	// 18 quanta: sync, 13 before and 4 after the sample point (78 %), 1 quantum of resynchronization jump
+	CAN1->BTR = ((13u - 1u) << CAN_BTR_TS1_Pos) | ((4u - 1u) << CAN_BTR_TS2_Pos) |
+				((HAL_RCC_GetPCLK1Freq() / (EXT_OTA_CAN_BITRATE * 18u) - 1u) << CAN_BTR_BRP_Pos);
+
+	// Filter 0 in 16-bit identifier list mode, only the standard data frames to the node reach FIFO 0
+	SET_BIT(CAN1->FMR, CAN_FMR_FINIT);
+	CLEAR_BIT(CAN1->FA1R, 1u);
+	CLEAR_BIT(CAN1->FS1R, 1u);
+	SET_BIT(CAN1->FM1R, 1u);
+	CLEAR_BIT(CAN1->FFA1R, 1u);
+	CAN1->sFilterRegister[0].FR1 = ((EXT_OTA_CAN_RX_ID << 5) << 16) | (EXT_OTA_CAN_RX_ID << 5);
+	CAN1->sFilterRegister[0].FR2 = ((EXT_OTA_CAN_RX_ID << 5) << 16) | (EXT_OTA_CAN_RX_ID << 5);
+	SET_BIT(CAN1->FA1R, 1u);
+	CLEAR_BIT(CAN1->FMR, CAN_FMR_FINIT);
+
+	// Mailbox completions and FIFO overruns, the FIFO itself is enabled while the link is listened to
+	CAN1->IER = CAN_IER_TMEIE | CAN_IER_FOVIE0;
+	HAL_NVIC_SetPriority(USB_HP_CAN1_TX_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(USB_HP_CAN1_TX_IRQn);
+	HAL_NVIC_SetPriority(USB_LP_CAN1_RX0_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+
+	// Join the bus once 11 recessive bits have been seen
+	CLEAR_BIT(CAN1->MCR, CAN_MCR_INRQ);
+	tick_start = HAL_GetTick();
+	while(READ_BIT(CAN1->MSR, CAN_MSR_INAK) != 0u && (HAL_GetTick() - tick_start) < 10u)
+	{
+	}
+}
+
+/*
+ * @brief Queue a CAN frame with the node TX ID in a free mailbox
+ * @param data: frame data
+ * @param len: data length, up to 8
+ * @retval HAL_StatusTypeDef: HAL_BUSY when the three mailboxes are pending
+ */
+static HAL_StatusTypeDef EXT_OTA_Can_Send(const uint8_t* data, uint8_t len)
+{
+	uint8_t frame[8] = {0};
+	uint32_t mailbox;
+
+	if(READ_BIT(CAN1->TSR, CAN_TSR_TME) == 0u)
+	{
+		return HAL_BUSY;
+	}
+	mailbox = READ_BIT(CAN1->TSR, CAN_TSR_CODE) >> CAN_TSR_CODE_Pos;
+	memcpy(frame, data, len);
+	CAN1->sTxMailBox[mailbox].TIR 	= EXT_OTA_CAN_TX_ID << CAN_TI0R_STID_Pos;
+	CAN1->sTxMailBox[mailbox].TDTR 	= len;
+	CAN1->sTxMailBox[mailbox].TDLR 	= frame[0] | (frame[1] << 8) | (frame[2] << 16) | ((uint32_t)frame[3] << 24);
+	CAN1->sTxMailBox[mailbox].TDHR 	= frame[4] | (frame[5] << 8) | (frame[6] << 16) | ((uint32_t)frame[7] << 24);
+	SET_BIT(CAN1->sTxMailBox[mailbox].TIR, CAN_TI0R_TXRQ);
+	return HAL_OK;
+}
+
+/*
+ * @brief Let the host send the next block of the message once the ring can take it
+ * @param link: CAN link
+ * @retval none
+ */
+static void EXT_OTA_Can_Flow(EXT_OTA_LINK* link)
+{
+	uint8_t fc[3] = { 0x30, EXT_OTA_CAN_BLOCK_SIZE, EXT_OTA_CAN_STMIN };
+	uint32_t need = can_rx_left;
+
+	if(EXT_OTA_CAN_BLOCK_SIZE != 0u && need > EXT_OTA_CAN_BLOCK_SIZE * 7u)
+	{
+		need = EXT_OTA_CAN_BLOCK_SIZE * 7u;
+	}
+	if(EXT_OTA_RX_RING_SIZE - EXT_OTA_RX_USED(link) < need || EXT_OTA_Can_Send(fc, sizeof(fc)) != HAL_OK)
+	{
+		if(can_fc_pending == 0u)
+		{
+			can_fc_pending = 1u;
+			ota_can_fc_held++;
+		}
+		return;
+	}
+	can_fc_pending = 0u;
+	can_rx_block = EXT_OTA_CAN_BLOCK_SIZE;
+}
+
+/*
+ * @brief Take a received CAN frame: message bytes go into the ring, flow controls drive the response
+ * @param link: CAN link
+ * @param data: frame data
+ * @param dlc: data length
+ * @retval none
+ */
+static void EXT_OTA_Can_Rx_Frame(EXT_OTA_LINK* link, const uint8_t* data, uint8_t dlc)
+{
+	uint16_t len;
+	uint8_t pos;
+
+	if(dlc == 0u)
+	{
+		return;
+	}
+	switch(data[0] >> 4)
+	{
+	// Single frame, a message in progress is given up
+	case 0x0:
+		len = data[0] & 0x0Fu;
+		can_rx_left = 0u;
+		if(len == 0u || len > 7u || len >= dlc)
+		{
+			return;
+		}
+		if(EXT_OTA_RX_RING_SIZE - EXT_OTA_RX_USED(link) < len)
+		{
+			link->rx_error = 1u;
+			return;
+		}
+		pos = 1u;
+		break;
+
+	// First frame, the flow control goes out once the ring can take the first block
+	case 0x1:
+		len = ((data[0] & 0x0Fu) << 8) | data[1];
+		if(dlc < 8u || len < 8u)
+		{
+			return;
+		}
+		if(len > EXT_OTA_RX_RING_SIZE)
+		{
+			uint8_t fc[3] = { 0x32, 0u, 0u };
+			(void)EXT_OTA_Can_Send(fc, sizeof(fc));
+			return;
+		}
+		can_rx_left = len - 6u;
+		can_rx_sn = 1u;
+		len = 6u;
+		pos = 2u;
+		if(EXT_OTA_RX_RING_SIZE - EXT_OTA_RX_USED(link) < len)
+		{
+			can_rx_left = 0u;
+			link->rx_error = 1u;
+			return;
+		}
+		break;
+
+	// Consecutive frame, a lost frame gives the message up
+	case 0x2:
+		if(can_rx_left == 0u)
+		{
+			return;
+		}
+		// Sent ahead of the flow control, or out of sequence
+		if(can_fc_pending || (data[0] & 0x0Fu) != can_rx_sn)
+		{
+			can_rx_left = 0u;
+			link->rx_error = 1u;
+			return;
+		}
+		len = (can_rx_left < 7u) ? can_rx_left : 7u;
+		if(len >= dlc)
+		{
+			can_rx_left = 0u;
+			link->rx_error = 1u;
+			return;
+		}
+		can_rx_left -= len;
+		can_rx_sn = (can_rx_sn + 1u) & 0x0Fu;
+		pos = 1u;
+		break;
+
+	// Flow control of the response being sent
+	case 0x3:
+		if(can_tx_wait_fc && dlc >= 3u)
+		{
+			if((data[0] & 0x0Fu) == 0x0u)
+			{
+				can_tx_wait_fc = 0u;
+				can_tx_block = data[1];
+				// STmin above 127 ms is reserved, the 100 us steps are rounded up to a tick
+				can_tx_stmin = (data[2] <= 0x7Fu) ? data[2] : 1u;
+				EXT_OTA_Can_Tx_Pump(link);
+			}
+			else if((data[0] & 0x0Fu) == 0x2u)
+			{
+				// The host can not take the response, it is dropped
+				can_tx_pos = link->tx_len[link->tx_tail];
+				can_tx_wait_fc = 0u;
+				EXT_OTA_Can_Tx_Pump(link);
+			}
+		}
+		return;
+
+	default:
+		return;
+	}
+
+	for(uint8_t i = 0; i < len; ++i)
+	{
+		link->rx_ring[(link->rx_head + i) % EXT_OTA_RX_RING_SIZE] = data[pos + i];
+	}
+	link->rx_head += len;
+
+	if((data[0] >> 4) == 0x1u || (can_rx_left != 0u && can_rx_block != 0u && --can_rx_block == 0u))
+	{
+		EXT_OTA_Can_Flow(link);
+	}
+}
+
+/*
+ * @brief Send the next CAN frames of the response at the tail of the queue, as far as the
+ *        free mailboxes, the block size and STmin of the host allow
+ * @param link: CAN link
+ * @retval none
+ */
+static void EXT_OTA_Can_Tx_Pump(EXT_OTA_LINK* link)
+{
+	uint8_t frame[8];
+	uint8_t* resp;
+	uint16_t len;
+	uint16_t n;
+
+	// The flow control owed to the host goes first
+	if(can_fc_pending)
+	{
+		EXT_OTA_Can_Flow(link);
+	}
+	while(link->tx_busy && can_tx_wait_fc == 0u)
+	{
+		resp = link->tx_queue[link->tx_tail];
+		len = link->tx_len[link->tx_tail];
+		if(can_tx_pos >= len)
+		{
+			// The frames are in the mailboxes, the queue slot is free for the next response
+			EXT_OTA_Link_Tx_Done(link);
+			return;
+		}
+		if(can_tx_pos == 0u && len <= 7u)
+		{
+			frame[0] = (uint8_t)len;
+			memcpy(&frame[1], resp, len);
+			n = len;
+		}
+		else if(can_tx_pos == 0u)
+		{
+			frame[0] = 0x10u | (uint8_t)(len >> 8);
+			frame[1] = (uint8_t)len;
+			memcpy(&frame[2], resp, 6u);
+			n = 6u;
+		}
+		else
+		{
+			if(can_tx_stmin != 0u && (HAL_GetTick() - can_tx_tick) <= can_tx_stmin)
+			{
+				return;
+			}
+			n = ((uint16_t)(len - can_tx_pos) < 7u) ? (uint16_t)(len - can_tx_pos) : 7u;
+			frame[0] = 0x20u | can_tx_sn;
+			memcpy(&frame[1], &resp[can_tx_pos], n);
+		}
+		if(EXT_OTA_Can_Send(frame, (uint8_t)(n + ((can_tx_pos == 0u && len > 7u) ? 2u : 1u))) != HAL_OK)
+		{
+			return;
+		}
+		can_tx_tick = HAL_GetTick();
+		if(can_tx_pos == 0u)
+		{
+			can_tx_sn = 1u;
+			can_tx_stmin = 0u;
+			can_tx_wait_fc = (len > 7u) ? 1u : 0u;
+		}
+		else
+		{
+			can_tx_sn = (can_tx_sn + 1u) & 0x0Fu;
+			if(can_tx_block != 0u && --can_tx_block == 0u && can_tx_pos + n < len)
+			{
+				can_tx_wait_fc = 1u;
+			}
+		}
+		can_tx_pos += n;
+	}
+}
+
+/******************************** General Function Code *****************************/
+/*
+ * @brief bxCAN FIFO 0 interrupt (USB_LP_CAN1_RX0 vector), to be called from the vector
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Can_Rx_IRQHandler(void)
+{
+	EXT_OTA_LINK* link = EXT_OTA_Link_Of_Type(EXT_OTA_LINK_CAN);
+	uint8_t data[8];
+	uint32_t low;
+	uint32_t high;
+	uint8_t dlc;
+
+	// The FIFO is left alone while the link is not listened to
+	while(READ_BIT(CAN1->IER, CAN_IER_FMPIE0) != 0u && READ_BIT(CAN1->RF0R, CAN_RF0R_FMP0) != 0u)
+	{
+		dlc 	= READ_BIT(CAN1->sFIFOMailBox[0].RDTR, CAN_RDT0R_DLC) >> CAN_RDT0R_DLC_Pos;
+		low 	= CAN1->sFIFOMailBox[0].RDLR;
+		high 	= CAN1->sFIFOMailBox[0].RDHR;
+		SET_BIT(CAN1->RF0R, CAN_RF0R_RFOM0);
+		for(uint8_t i = 0; i < 4u; ++i)
+		{
+			data[i] 		= (uint8_t)(low >> (8u * i));
+			data[4u + i] 	= (uint8_t)(high >> (8u * i));
+		}
+		ota_can_frames++;
+		EXT_OTA_Can_Rx_Frame(link, data, (dlc > 8u) ? 8u : dlc);
+	}
+	if(READ_BIT(CAN1->RF0R, CAN_RF0R_FOVR0) != 0u)
+	{
+		// Frames have been lost while the CPU was stalled
+		CAN1->RF0R = CAN_RF0R_FOVR0;
+		link->rx_error = 1u;
+		ota_can_overruns++;
+	}
+}
+
+/*
+ * @brief bxCAN mailbox interrupt (USB_HP_CAN1_TX vector), to be called from the vector
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Can_Tx_IRQHandler(void)
+{
+	CAN1->TSR = CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2;
+	EXT_OTA_Can_Tx_Pump(EXT_OTA_Link_Of_Type(EXT_OTA_LINK_CAN));
+}
+
+/*
+ * @brief SysTick hook: the next consecutive frame held by STmin is sent from the mailbox interrupt,
+ *        which does not preempt itself
+ * @param none
+ * @retval none
+ */
+EXT_OTA_RAMFUNC void EXT_OTA_Can_Tick(void)
+{
+	if(can_tx_stmin != 0u && __HAL_RCC_CAN1_IS_CLK_ENABLED())
+	{
+		NVIC_SetPendingIRQ(USB_HP_CAN1_TX_IRQn);
+	}
+}
+#endif
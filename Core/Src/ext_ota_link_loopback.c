@@ -0,0 +1,73 @@
+/*
+ * ext_ota_link_loopback.c
+ *
+ *  Loopback link backend: the receive ring is fed and the responses are taken by a host-side test harness
+ */
+
+#include "ext_ota_link.h"
+
+#if EXT_OTA_LINK_LOOPBACK_ENABLE
+
+/********************************* Private Functions Prototypes *****************************************/
+
+static HAL_StatusTypeDef EXT_OTA_Loopback_Send(EXT_OTA_LINK* link, uint8_t* frame, uint16_t len);
+
+// The ring is filled by EXT_OTA_Loopback_Rx(), there is nothing to arm
+const EXT_OTA_LINK_OPS ota_link_loopback_ops =
+{
+	.tx 		= EXT_OTA_Loopback_Send,
+};
+
+/******************************** Private Functions Code ***********************************************/
+
+/*
+ * @brief Hand a response frame to the host-side transport, which takes it on the spot
+ * @param link: OTA link
+ * @param frame: response frame
+ * @param len: length of the frame
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Loopback_Send(EXT_OTA_LINK* link, uint8_t* frame, uint16_t len)
+{
+	EXT_OTA_Loopback_Tx(frame, len);
+#if EXT_OTA_TX_DMA_ENABLE
+	EXT_OTA_Link_Tx_Done(link);
+#else
+	UNUSED(link);
+#endif
+	return HAL_OK;
+}
+
+/******************************** General Function Code *****************************/
+/*
+ * @brief Feed bytes received by the host-side transport into the loopback link
+ * @param data: received bytes
+ * @param len: number of bytes
+ * @retval uint16_t: number of bytes taken, the rest does not fit in the ring
+ */
+uint16_t EXT_OTA_Loopback_Rx(const uint8_t* data, uint16_t len)
+{
+	EXT_OTA_LINK* link = EXT_OTA_Link_Of_Type(EXT_OTA_LINK_LOOPBACK);
+	uint16_t i;
+
+	for(i = 0; i < len && EXT_OTA_RX_USED(link) < EXT_OTA_RX_RING_SIZE; ++i)
+	{
+		link->rx_ring[link->rx_head % EXT_OTA_RX_RING_SIZE] = data[i];
+		link->rx_head++;
+	}
+	return i;
+}
+
+/*
+ * @brief Response frames sent on the loopback link, to be provided by the host-side transport
+ * @param frame: response frame
+ * @param len: length of the frame
+ * @retval none
+ */
+__weak void EXT_OTA_Loopback_Tx(const uint8_t* frame, uint16_t len)
+{
+	UNUSED(frame);
+	UNUSED(len);
+}
+
+#endif
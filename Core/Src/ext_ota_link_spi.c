@@ -0,0 +1,300 @@
+/*
+ * ext_ota_link_spi.c
+ *
+ *  SPI link backend: SPI1 slave with RX/TX DMA, READY tells the master the ring can take a frame,
+ *  ATTN that a response waits to be clocked out
+ */
+
+#include "ext_ota_link.h"
+
+#if EXT_OTA_LINK_SPI_ENABLE
+
+// SPI1 RX/TX DMA of the SPI link
+DMA_HandleTypeDef hdma_spi1_rx;
+DMA_HandleTypeDef hdma_spi1_tx;
+// Free ring space needed to raise READY: the largest frame in either framing
+#define EXT_OTA_SPI_READY_SPACE		(EXT_OTA_COBS_MAX_SIZE(EXT_OTA_PACKET_MAX_SIZE + EXT_OTA_PAYLOAD_PREFIX_MAX) + 1u)
+
+/********************************* Private Functions Prototypes *****************************************/
+
+static void EXT_OTA_Spi_Start(EXT_OTA_LINK* link);
+static void EXT_OTA_Spi_Stop(EXT_OTA_LINK* link);
+static void EXT_OTA_Spi_Arm(EXT_OTA_LINK* link);
+static uint32_t EXT_OTA_Spi_Rx_Pending(EXT_OTA_LINK* link);
+static HAL_StatusTypeDef EXT_OTA_Spi_Tx(EXT_OTA_LINK* link, uint8_t* frame, uint16_t len);
+static void EXT_OTA_Spi_Tx_Abort(EXT_OTA_LINK* link);
+static void EXT_OTA_Spi_Hold(EXT_OTA_LINK* link, uint8_t on);
+static void EXT_OTA_Spi_Init(void);
+static void EXT_OTA_Spi_Ready(EXT_OTA_LINK* link);
+static void EXT_OTA_Spi_Rx_Cplt(DMA_HandleTypeDef* hdma);
+static void EXT_OTA_Spi_Tx_Cplt(DMA_HandleTypeDef* hdma);
+static void EXT_OTA_Spi_Error(DMA_HandleTypeDef* hdma);
+
+const EXT_OTA_LINK_OPS ota_link_spi_ops =
+{
+	.start 		= EXT_OTA_Spi_Start,
+	.stop 		= EXT_OTA_Spi_Stop,
+	.arm 		= EXT_OTA_Spi_Arm,
+	.rx_pending = EXT_OTA_Spi_Rx_Pending,
+	.tx 		= EXT_OTA_Spi_Tx,
+	.tx_abort 	= EXT_OTA_Spi_Tx_Abort,
+	.hold 		= EXT_OTA_Spi_Hold,
+};
+
+/******************************** Private Functions Code ***********************************************/
+
+/*
+ * @brief Configure SPI1 the first time the link is listened to
+ * @param link: OTA link
+ * @retval none
+ */
+static void EXT_OTA_Spi_Start(EXT_OTA_LINK* link)
+{
+	UNUSED(link);
+	if(READ_BIT(SPI1->CR1, SPI_CR1_SPE) == 0u)
+	{
+		EXT_OTA_Spi_Init();
+	}
+}
+
+/*
+ * @brief Stop the RX DMA and lower READY
+ * @param link: OTA link
+ * @retval none
+ */
+static void EXT_OTA_Spi_Stop(EXT_OTA_LINK* link)
+{
+	UNUSED(link);
+	HAL_DMA_Abort(&hdma_spi1_rx);
+	HAL_GPIO_WritePin(EXT_OTA_SPI_READY_PORT, EXT_OTA_SPI_READY_PIN, GPIO_PIN_RESET);
+}
+
+/*
+ * @brief Arm the RX DMA on the next free contiguous region of the ring, as the UART does,
+ *        READY holds the master off instead of RTS. Must be called with the DMA interrupt masked.
+ * @param link: OTA link
+ * @retval none
+ */
+static void EXT_OTA_Spi_Arm(EXT_OTA_LINK* link)
+{
+	uint32_t idx = link->rx_head % EXT_OTA_RX_RING_SIZE;
+	uint32_t free_len = EXT_OTA_RX_RING_SIZE - EXT_OTA_RX_USED(link);
+	uint32_t len = EXT_OTA_RX_RING_SIZE - idx;
+
+	if(link->rx_dma_len == 0u && free_len != 0u)
+	{
+		if(len > free_len)
+		{
+			len = free_len;
+		}
+		// Bytes have been lost while the DMA was stopped
+		if(READ_BIT(SPI1->SR, SPI_SR_OVR) != 0u)
+		{
+			(void)SPI1->DR;
+			(void)SPI1->SR;
+			link->rx_error = 1u;
+		}
+		if(HAL_DMA_Start_IT(&hdma_spi1_rx, (uint32_t)&SPI1->DR, (uint32_t)&link->rx_ring[idx], len) == HAL_OK)
+		{
+			link->rx_dma_len = (uint16_t)len;
+		}
+	}
+	EXT_OTA_Spi_Ready(link);
+}
+
+/*
+ * @brief Get the number of bytes the RX DMA has written in the armed region
+ * @param link: OTA link
+ * @retval uint32_t
+ */
+static uint32_t EXT_OTA_Spi_Rx_Pending(EXT_OTA_LINK* link)
+{
+	return link->rx_dma_len - __HAL_DMA_GET_COUNTER(&hdma_spi1_rx);
+}
+
+/*
+ * @brief Load a response frame in the TX DMA, it is clocked out by the master once it sees ATTN
+ * @param link: OTA link
+ * @param frame: response frame
+ * @param len: length of the frame
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Spi_Tx(EXT_OTA_LINK* link, uint8_t* frame, uint16_t len)
+{
+	HAL_StatusTypeDef ret;
+
+	UNUSED(link);
+	ret = HAL_DMA_Start_IT(&hdma_spi1_tx, (uint32_t)frame, (uint32_t)&SPI1->DR, len);
+	if(ret == HAL_OK)
+	{
+		HAL_GPIO_WritePin(EXT_OTA_SPI_ATTN_PORT, EXT_OTA_SPI_ATTN_PIN, GPIO_PIN_SET);
+	}
+	return ret;
+}
+
+/*
+ * @brief Abort the response waiting for the master and lower ATTN
+ * @param link: OTA link
+ * @retval none
+ */
+static void EXT_OTA_Spi_Tx_Abort(EXT_OTA_LINK* link)
+{
+	UNUSED(link);
+	HAL_DMA_Abort(&hdma_spi1_tx);
+	HAL_GPIO_WritePin(EXT_OTA_SPI_ATTN_PORT, EXT_OTA_SPI_ATTN_PIN, GPIO_PIN_RESET);
+}
+
+/*
+ * @brief The CPU stalls on the Flash and can not lower READY in time, READY is lowered before
+ * @param link: OTA link
+ * @param on: 1 - hold the master off, 0 - let it go on
+ * @retval none
+ */
+static void EXT_OTA_Spi_Hold(EXT_OTA_LINK* link, uint8_t on)
+{
+	if(on)
+	{
+		HAL_GPIO_WritePin(EXT_OTA_SPI_READY_PORT, EXT_OTA_SPI_READY_PIN, GPIO_PIN_RESET);
+	}
+	else
+	{
+		EXT_OTA_Spi_Ready(link);
+	}
+}
+
+/*
+ * @brief Configure SPI1 as a slave with RX/TX DMA, and the READY and ATTN lines
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Spi_Init(void)
+{
+	GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+	__HAL_RCC_SPI1_CLK_ENABLE();
+	__HAL_RCC_GPIOA_CLK_ENABLE();
+	__HAL_RCC_GPIOB_CLK_ENABLE();
+
+	/**SPI1 GPIO Configuration
+	PA4     ------> SPI1_NSS
+	PA5     ------> SPI1_SCK
+	PA6     ------> SPI1_MISO
+	PA7     ------> SPI1_MOSI
+	*/
+	GPIO_InitStruct.Pin 	= GPIO_PIN_4 | GPIO_PIN_5 | GPIO_PIN_7;
+	GPIO_InitStruct.Mode 	= GPIO_MODE_INPUT;
+	GPIO_InitStruct.Pull 	= GPIO_NOPULL;
+	HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+	GPIO_InitStruct.Pin 	= GPIO_PIN_6;
+	GPIO_InitStruct.Mode 	= GPIO_MODE_AF_PP;
+	GPIO_InitStruct.Speed 	= GPIO_SPEED_FREQ_HIGH;
+	HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+	// READY and ATTN start low
+	HAL_GPIO_WritePin(EXT_OTA_SPI_READY_PORT, EXT_OTA_SPI_READY_PIN, GPIO_PIN_RESET);
+	HAL_GPIO_WritePin(EXT_OTA_SPI_ATTN_PORT, EXT_OTA_SPI_ATTN_PIN, GPIO_PIN_RESET);
+	GPIO_InitStruct.Pin 	= EXT_OTA_SPI_READY_PIN;
+	GPIO_InitStruct.Mode 	= GPIO_MODE_OUTPUT_PP;
+	GPIO_InitStruct.Speed 	= GPIO_SPEED_FREQ_LOW;
+	HAL_GPIO_Init(EXT_OTA_SPI_READY_PORT, &GPIO_InitStruct);
+	GPIO_InitStruct.Pin 	= EXT_OTA_SPI_ATTN_PIN;
+	HAL_GPIO_Init(EXT_OTA_SPI_ATTN_PORT, &GPIO_InitStruct);
+
+	// SPI1_RX on DMA1 Channel 2
+	hdma_spi1_rx.Instance 					= DMA1_Channel2;
+	hdma_spi1_rx.Init.Direction 			= DMA_PERIPH_TO_MEMORY;
+	hdma_spi1_rx.Init.PeriphInc 			= DMA_PINC_DISABLE;
+	hdma_spi1_rx.Init.MemInc 				= DMA_MINC_ENABLE;
+	hdma_spi1_rx.Init.PeriphDataAlignment 	= DMA_PDATAALIGN_BYTE;
+	hdma_spi1_rx.Init.MemDataAlignment 		= DMA_MDATAALIGN_BYTE;
+	hdma_spi1_rx.Init.Mode 					= DMA_NORMAL;
+	hdma_spi1_rx.Init.Priority 				= DMA_PRIORITY_HIGH;
+	HAL_DMA_Init(&hdma_spi1_rx);
+	hdma_spi1_rx.XferCpltCallback 			= EXT_OTA_Spi_Rx_Cplt;
+	hdma_spi1_rx.XferErrorCallback 			= EXT_OTA_Spi_Error;
+
+	// SPI1_TX on DMA1 Channel 3
+	hdma_spi1_tx.Instance 					= DMA1_Channel3;
+	hdma_spi1_tx.Init.Direction 			= DMA_MEMORY_TO_PERIPH;
+	hdma_spi1_tx.Init.PeriphInc 			= DMA_PINC_DISABLE;
+	hdma_spi1_tx.Init.MemInc 				= DMA_MINC_ENABLE;
+	hdma_spi1_tx.Init.PeriphDataAlignment 	= DMA_PDATAALIGN_BYTE;
+	hdma_spi1_tx.Init.MemDataAlignment 		= DMA_MDATAALIGN_BYTE;
+	hdma_spi1_tx.Init.Mode 					= DMA_NORMAL;
+	hdma_spi1_tx.Init.Priority 				= DMA_PRIORITY_LOW;
+	HAL_DMA_Init(&hdma_spi1_tx);
+	hdma_spi1_tx.XferCpltCallback 			= EXT_OTA_Spi_Tx_Cplt;
+	hdma_spi1_tx.XferErrorCallback 			= EXT_OTA_Spi_Tx_Cplt;
+
+	// Slave, mode 0, 8-bit, MSB first, hardware NSS
+	SPI1->CR1 = 0u;
+	SPI1->CR2 = SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+	SET_BIT(SPI1->CR1, SPI_CR1_SPE);
+}
+
+/*
+ * @brief Drive READY from the free space of the ring, including the bytes the DMA is writing
+ * @param link: SPI link
+ * @retval none
+ */
+static void EXT_OTA_Spi_Ready(EXT_OTA_LINK* link)
+{
+	uint32_t used = EXT_OTA_RX_USED(link);
+
+	if(link->rx_dma_len != 0u)
+	{
+		used += link->rx_dma_len - __HAL_DMA_GET_COUNTER(&hdma_spi1_rx);
+	}
+	HAL_GPIO_WritePin(EXT_OTA_SPI_READY_PORT, EXT_OTA_SPI_READY_PIN,
+					  (link->rx_dma_len != 0u && EXT_OTA_RX_RING_SIZE - used >= EXT_OTA_SPI_READY_SPACE) ?
+					  GPIO_PIN_SET : GPIO_PIN_RESET);
+}
+
+/*
+ * @brief SPI1 RX DMA complete, the armed region of the ring is full
+ * @param hdma: DMA handle
+ * @retval none
+ */
+static void EXT_OTA_Spi_Rx_Cplt(DMA_HandleTypeDef* hdma)
+{
+	EXT_OTA_LINK* link = EXT_OTA_Link_Of_Type(EXT_OTA_LINK_SPI);
+
+	UNUSED(hdma);
+	link->rx_head += link->rx_dma_len;
+	link->rx_dma_len = 0u;
+	EXT_OTA_Spi_Arm(link);
+}
+
+/*
+ * @brief SPI1 TX DMA complete, the response has been handed to the SPI
+ * @param hdma: DMA handle
+ * @retval none
+ */
+static void EXT_OTA_Spi_Tx_Cplt(DMA_HandleTypeDef* hdma)
+{
+	EXT_OTA_LINK* link = EXT_OTA_Link_Of_Type(EXT_OTA_LINK_SPI);
+
+	UNUSED(hdma);
+	EXT_OTA_Link_Tx_Done(link);
+	if(link->tx_busy == 0u)
+	{
+		HAL_GPIO_WritePin(EXT_OTA_SPI_ATTN_PORT, EXT_OTA_SPI_ATTN_PIN, GPIO_PIN_RESET);
+	}
+}
+
+/*
+ * @brief SPI1 RX DMA error, the reception goes on after the bytes already received
+ * @param hdma: DMA handle
+ * @retval none
+ */
+static void EXT_OTA_Spi_Error(DMA_HandleTypeDef* hdma)
+{
+	EXT_OTA_LINK* link = EXT_OTA_Link_Of_Type(EXT_OTA_LINK_SPI);
+
+	link->rx_head += link->rx_dma_len - __HAL_DMA_GET_COUNTER(hdma);
+	link->rx_dma_len = 0u;
+	link->rx_error = 1u;
+	EXT_OTA_Spi_Arm(link);
+}
+#endif
@@ -0,0 +1,260 @@
+/*
+ * ext_ota_link_uart.c
+ *
+ *  UART link backend: the receive ring is filled by the RX DMA, the responses are sent by the TX DMA
+ */
+
+#include "ext_ota_link.h"
+
+/********************************* Private Functions Prototypes *****************************************/
+
+static void EXT_OTA_Uart_Stop(EXT_OTA_LINK* link);
+static void EXT_OTA_Uart_Arm(EXT_OTA_LINK* link);
+static uint32_t EXT_OTA_Uart_Rx_Pending(EXT_OTA_LINK* link);
+static HAL_StatusTypeDef EXT_OTA_Uart_Tx(EXT_OTA_LINK* link, uint8_t* frame, uint16_t len);
+#if EXT_OTA_TX_DMA_ENABLE
+static void EXT_OTA_Uart_Tx_Abort(EXT_OTA_LINK* link);
+#endif
+
+// Served from RAM along with the receive path
+const EXT_OTA_LINK_OPS ota_link_uart_ops EXT_OTA_RAMDATA =
+{
+	.stop 		= EXT_OTA_Uart_Stop,
+	.arm 		= EXT_OTA_Uart_Arm,
+	.rx_pending = EXT_OTA_Uart_Rx_Pending,
+	.tx 		= EXT_OTA_Uart_Tx,
+#if EXT_OTA_TX_DMA_ENABLE
+	.tx_abort 	= EXT_OTA_Uart_Tx_Abort,
+#endif
+};
+
+/******************************** Private Functions Code ***********************************************/
+
+/*
+ * @brief Stop the RX DMA of a UART link
+ * @param link: OTA link
+ * @retval none
+ */
+static void EXT_OTA_Uart_Stop(EXT_OTA_LINK* link)
+{
+	HAL_UART_AbortReceive(link->huart);
+}
+
+/*
+ * @brief Arm the RX DMA on the next free contiguous region of the ring.
+ *        When the ring is full the DMA stays stopped, RXNE is left set and RTS holds the host off.
+ *        Must be called with the UART and DMA interrupts masked.
+ * @param link: OTA link
+ * @retval none
+ */
+EXT_OTA_RAMFUNC static void EXT_OTA_Uart_Arm(EXT_OTA_LINK* link)
+{
+	uint32_t idx = link->rx_head % EXT_OTA_RX_RING_SIZE;
+	uint32_t free_len = EXT_OTA_RX_RING_SIZE - EXT_OTA_RX_USED(link);
+	uint32_t len = EXT_OTA_RX_RING_SIZE - idx;
+
+	if(link->rx_dma_len != 0u || free_len == 0u)
+	{
+		return;
+	}
+	if(len > free_len)
+	{
+		len = free_len;
+	}
+	// Bytes have been lost while the DMA was stopped
+	if(__HAL_UART_GET_FLAG(link->huart, UART_FLAG_ORE) != RESET)
+	{
+		link->rx_error = 1u;
+	}
+	if(HAL_UART_Receive_DMA(link->huart, &link->rx_ring[idx], (uint16_t)len) == HAL_OK)
+	{
+		link->rx_dma_len = (uint16_t)len;
+#if EXT_OTA_RAM_EXEC_ENABLE
+		// Only the end of the region is of interest, and is served from RAM
+		__HAL_DMA_DISABLE_IT(link->huart->hdmarx, DMA_IT_HT);
+#endif
+	}
+}
+
+/*
+ * @brief Get the number of bytes the RX DMA has written in the armed region
+ * @param link: OTA link
+ * @retval uint32_t
+ */
+EXT_OTA_RAMFUNC static uint32_t EXT_OTA_Uart_Rx_Pending(EXT_OTA_LINK* link)
+{
+	return link->rx_dma_len - __HAL_DMA_GET_COUNTER(link->huart->hdmarx);
+}
+
+/*
+ * @brief Send a response frame on a UART link, driving the RS-485 bus around it
+ * @param link: OTA link
+ * @param frame: response frame
+ * @param len: length of the frame
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Uart_Tx(EXT_OTA_LINK* link, uint8_t* frame, uint16_t len)
+{
+	HAL_StatusTypeDef ret;
+
+#if EXT_OTA_MULTIDROP_ENABLE
+	// Drive the bus for the response
+	if(link->multidrop)
+	{
+		HAL_GPIO_WritePin(EXT_OTA_RS485_DE_PORT, EXT_OTA_RS485_DE_PIN, GPIO_PIN_SET);
+	}
+#endif
+#if EXT_OTA_TX_DMA_ENABLE
+	ret = HAL_UART_Transmit_DMA(link->huart, frame, len);
+#else
+	ret = HAL_UART_Transmit(link->huart, frame, len, 100);
+#if EXT_OTA_MULTIDROP_ENABLE
+	// The transmission is complete, the bus is released right after the stop bit
+	if(link->multidrop)
+	{
+		HAL_GPIO_WritePin(EXT_OTA_RS485_DE_PORT, EXT_OTA_RS485_DE_PIN, GPIO_PIN_RESET);
+	}
+#endif
+#endif
+	return ret;
+}
+
+#if EXT_OTA_TX_DMA_ENABLE
+/*
+ * @brief Abort the response on the wire and release the RS-485 bus
+ * @param link: OTA link
+ * @retval none
+ */
+static void EXT_OTA_Uart_Tx_Abort(EXT_OTA_LINK* link)
+{
+	HAL_UART_AbortTransmit(link->huart);
+#if EXT_OTA_MULTIDROP_ENABLE
+	if(link->multidrop)
+	{
+		HAL_GPIO_WritePin(EXT_OTA_RS485_DE_PORT, EXT_OTA_RS485_DE_PIN, GPIO_PIN_RESET);
+	}
+#endif
+}
+#endif
+
+/*
+ * @brief UART RX complete callback, the armed region of the ring is full
+ * @param huart: UART handle
+ * @retval none
+ */
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+	EXT_OTA_LINK* link = EXT_OTA_Link_Find(huart);
+
+	if(link != NULL)
+	{
+		link->rx_head += link->rx_dma_len;
+		link->rx_dma_len = 0u;
+		EXT_OTA_Uart_Arm(link);
+	}
+}
+
+#if EXT_OTA_RAM_EXEC_ENABLE
+/*
+ * @brief RX DMA interrupt of a UART link, executed from RAM: the full region of the ring is taken
+ *        and the channel moves on to the next free region, without the HAL which runs from the Flash.
+ *        The UART and its DMA stay busy receiving for the HAL. A full ring and errors are left to the HAL.
+ * @param hdma: RX DMA handle of the UART
+ * @retval uint8_t: 1 - served, 0 - to be passed to HAL_DMA_IRQHandler()
+ */
+EXT_OTA_RAMFUNC uint8_t EXT_OTA_Rx_Dma_IRQHandler(DMA_HandleTypeDef* hdma)
+{
+	uint32_t flags = hdma->DmaBaseAddress->ISR >> hdma->ChannelIndex;
+	EXT_OTA_LINK* link = NULL;
+	uint32_t idx;
+	uint32_t free_len;
+	uint32_t len;
+
+	if((flags & DMA_ISR_TCIF1) == 0u || (flags & DMA_ISR_TEIF1) != 0u)
+	{
+		return 0u;
+	}
+	for(uint8_t i = 0; i < EXT_OTA_LINK_COUNT; ++i)
+	{
+		if(ota_links[i].huart != NULL && ota_links[i].huart->hdmarx == hdma)
+		{
+			link = &ota_links[i];
+			break;
+		}
+	}
+	if(link == NULL || link->rx_dma_len == 0u)
+	{
+		return 0u;
+	}
+	idx = (link->rx_head + link->rx_dma_len) % EXT_OTA_RX_RING_SIZE;
+	free_len = EXT_OTA_RX_RING_SIZE - EXT_OTA_RX_USED(link) - link->rx_dma_len;
+	len = EXT_OTA_RX_RING_SIZE - idx;
+	if(len > free_len)
+	{
+		len = free_len;
+	}
+	if(len == 0u)
+	{
+		return 0u;
+	}
+
+	hdma->DmaBaseAddress->IFCR = DMA_ISR_GIF1 << hdma->ChannelIndex;
+	CLEAR_BIT(hdma->Instance->CCR, DMA_CCR_EN);
+	link->rx_head += link->rx_dma_len;
+	link->rx_dma_len = (uint16_t)len;
+	hdma->Instance->CMAR = (uint32_t)&link->rx_ring[idx];
+	hdma->Instance->CNDTR = len;
+	SET_BIT(hdma->Instance->CCR, DMA_CCR_EN);
+	return 1u;
+}
+#endif
+
+/*
+ * @brief UART error callback, the RX DMA has been aborted on a reception error
+ * @param huart: UART handle
+ * @retval none
+ */
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	EXT_OTA_LINK* link = EXT_OTA_Link_Find(huart);
+
+	if(link != NULL && link->rx_dma_len != 0u && huart->RxState == HAL_UART_STATE_READY)
+	{
+		link->rx_head += link->rx_dma_len - __HAL_DMA_GET_COUNTER(huart->hdmarx);
+		link->rx_dma_len = 0u;
+		link->rx_error = 1u;
+		EXT_OTA_Uart_Arm(link);
+	}
+}
+
+#if EXT_OTA_TX_DMA_ENABLE
+/*
+ * @brief UART TX complete callback, release the sent response and start the next one
+ * @param huart: UART handle
+ * @retval none
+ */
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+	EXT_OTA_LINK* link = EXT_OTA_Link_Find(huart);
+
+	if(link == NULL)
+	{
+		return;
+	}
+#if EXT_OTA_RELAY_ENABLE
+	// The relay sends its frames outside the response queue of the link
+	if(EXT_OTA_Relay_Tx_Cplt(link))
+	{
+		return;
+	}
+#endif
+	EXT_OTA_Link_Tx_Done(link);
+#if EXT_OTA_MULTIDROP_ENABLE
+	// The UART reports the end of the stop bit, the bus is released for the host and the other nodes
+	if(link->multidrop && link->tx_busy == 0u)
+	{
+		HAL_GPIO_WritePin(EXT_OTA_RS485_DE_PORT, EXT_OTA_RS485_DE_PIN, GPIO_PIN_RESET);
+	}
+#endif
+}
+#endif
@@ -0,0 +1,134 @@
+/*
+ * ext_ota_link_usb.c
+ *
+ *  USB CDC-ACM link backend: the OUT endpoint lands the packets in the receive ring, the responses
+ *  are sent on the IN endpoint
+ */
+
+#include "ext_ota_link.h"
+
+#if EXT_OTA_LINK_USB_ENABLE
+
+// OUT packet landing area used when the free space of the ring wraps within a packet
+static uint8_t usb_rx_bounce[EXT_OTA_USB_PACKET_SIZE];
+// Where the OUT endpoint is armed, in the ring or in the bounce buffer
+static uint8_t* usb_rx_buf;
+
+/********************************* Private Functions Prototypes *****************************************/
+
+static void EXT_OTA_Usb_Arm(EXT_OTA_LINK* link);
+static HAL_StatusTypeDef EXT_OTA_Usb_Send(EXT_OTA_LINK* link, uint8_t* frame, uint16_t len);
+
+const EXT_OTA_LINK_OPS ota_link_usb_ops =
+{
+	.arm 		= EXT_OTA_Usb_Arm,
+	.tx 		= EXT_OTA_Usb_Send,
+};
+
+/******************************** Private Functions Code ***********************************************/
+
+/*
+ * @brief Arm the OUT endpoint straight on the ring, on the bounce buffer only where the free space wraps.
+ *        The endpoint NAKs the host while the ring can not take a full packet.
+ * @param link: OTA link
+ * @retval none
+ */
+static void EXT_OTA_Usb_Arm(EXT_OTA_LINK* link)
+{
+	uint32_t idx = link->rx_head % EXT_OTA_RX_RING_SIZE;
+
+	if(link->rx_dma_len == 0u && EXT_OTA_RX_RING_SIZE - EXT_OTA_RX_USED(link) >= EXT_OTA_USB_PACKET_SIZE)
+	{
+		usb_rx_buf = (EXT_OTA_RX_RING_SIZE - idx >= EXT_OTA_USB_PACKET_SIZE) ? &link->rx_ring[idx] : usb_rx_bounce;
+		link->rx_dma_len = EXT_OTA_USB_PACKET_SIZE;
+		EXT_OTA_Usb_Rx_Arm(usb_rx_buf);
+	}
+}
+
+/*
+ * @brief Start the IN transfer of a response frame
+ * @param link: OTA link
+ * @param frame: response frame
+ * @param len: length of the frame
+ * @retval HAL_StatusTypeDef: HAL_BUSY while the previous transfer is in progress
+ */
+static HAL_StatusTypeDef EXT_OTA_Usb_Send(EXT_OTA_LINK* link, uint8_t* frame, uint16_t len)
+{
+	UNUSED(link);
+	return EXT_OTA_Usb_Tx(frame, len);
+}
+
+/******************************** General Function Code *****************************/
+/*
+ * @brief An OUT packet has been received on the CDC data endpoint, in the buffer it was armed on
+ * @param buf: packet buffer
+ * @param len: packet length, at most EXT_OTA_USB_PACKET_SIZE
+ * @retval none
+ */
+void EXT_OTA_Usb_Rx_Done(uint8_t* buf, uint32_t len)
+{
+	EXT_OTA_LINK* link = EXT_OTA_Link_Of_Type(EXT_OTA_LINK_USB);
+
+	// Late packet of a stopped link
+	if(link->rx_dma_len == 0u || buf != usb_rx_buf)
+	{
+		return;
+	}
+	if(len > EXT_OTA_USB_PACKET_SIZE)
+	{
+		len = EXT_OTA_USB_PACKET_SIZE;
+	}
+	// Only the packet that lands across the end of the ring is copied
+	if(buf == usb_rx_bounce)
+	{
+		for(uint32_t i = 0; i < len; ++i)
+		{
+			link->rx_ring[(link->rx_head + i) % EXT_OTA_RX_RING_SIZE] = buf[i];
+		}
+	}
+	link->rx_head += len;
+	link->rx_dma_len = 0u;
+	EXT_OTA_Usb_Arm(link);
+}
+
+/*
+ * @brief An IN transfer of the CDC data endpoint has completed
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Usb_Tx_Done(void)
+{
+	EXT_OTA_LINK* link = EXT_OTA_Link_Of_Type(EXT_OTA_LINK_USB);
+
+	if(link->tx_busy)
+	{
+		EXT_OTA_Link_Tx_Done(link);
+	}
+}
+
+/*
+ * @brief Arm the CDC data OUT endpoint on a buffer of EXT_OTA_USB_PACKET_SIZE bytes,
+ *        to be provided by the CDC interface
+ * @param buf: packet buffer
+ * @retval none
+ */
+__weak void EXT_OTA_Usb_Rx_Arm(uint8_t* buf)
+{
+	UNUSED(buf);
+}
+
+/*
+ * @brief Start an IN transfer on the CDC data endpoint, to be provided by the CDC interface.
+ *        The frame stays valid until EXT_OTA_Usb_Tx_Done() is called.
+ * @param frame: response frame
+ * @param len: length of the frame
+ * @retval HAL_StatusTypeDef: HAL_BUSY while the previous transfer is in progress
+ */
+__weak HAL_StatusTypeDef EXT_OTA_Usb_Tx(uint8_t* frame, uint16_t len)
+{
+	UNUSED(frame);
+	UNUSED(len);
+	return HAL_ERROR;
+}
+
+#endif
@@ -0,0 +1,444 @@
+/*
+ * ext_ota_mode_bond.c
+ *
+ *  Bond session mode: the DATA packets carry their offset and are striped over the session link
+ *  and a second UART link, the link that goes silent is dropped from the bond
+ */
+
+#include "ext_ota_mode.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if EXT_OTA_BOND_ENABLE
+
+// DATA packets carry their offset and are striped over the bonded links, and bonding requested by the host
+static uint8_t ota_bonded;
+static uint8_t ota_pending_bond;
+// Bonded links, the first one carries the control packets, NULL once a link has been dropped
+static EXT_OTA_LINK* ota_bond_links[EXT_OTA_BOND_LINKS];
+// Links dropped from the bond
+static uint32_t ota_bond_failovers;
+
+/********************************* Private Functions Prototypes *****************************************/
+
+static void EXT_OTA_Bond_Open(void);
+static uint8_t EXT_OTA_Bond_Packet(EXT_OTA_PACKET_VIEW* packet, EXT_OTA_EX* ret);
+static uint16_t EXT_OTA_Bond_Receive(uint16_t max_len, uint32_t timeout);
+static HAL_StatusTypeDef EXT_OTA_Bond_Data(EXT_OTA_SLICE* payload, uint16_t len, uint8_t is_first_block);
+static uint8_t EXT_OTA_Bond_Ack_Due(void);
+static uint8_t EXT_OTA_Bond_Respond(uint8_t resp_type);
+static HAL_StatusTypeDef EXT_OTA_Bond_Recover(uint8_t* retries);
+static void EXT_OTA_Bond_Start(void);
+static void EXT_OTA_Bond_Report(void);
+static uint8_t EXT_OTA_Bond_Owns(UART_HandleTypeDef* huart);
+static void EXT_OTA_Bond_Close(void);
+static EXT_OTA_LINK* EXT_OTA_Bond_Partner(void);
+static uint8_t EXT_OTA_Bond_Mask(void);
+
+const EXT_OTA_MODE_OPS ota_mode_bond_ops =
+{
+	.offset		= 1u,
+	.no_stream	= 1u,
+	.open		= EXT_OTA_Bond_Open,
+	.packet		= EXT_OTA_Bond_Packet,
+	.receive	= EXT_OTA_Bond_Receive,
+	.data		= EXT_OTA_Bond_Data,
+	.ack_due	= EXT_OTA_Bond_Ack_Due,
+	.respond	= EXT_OTA_Bond_Respond,
+	.recover	= EXT_OTA_Bond_Recover,
+	.activate	= EXT_OTA_Bond_Start,
+	.report		= EXT_OTA_Bond_Report,
+	.owns		= EXT_OTA_Bond_Owns,
+	.close		= EXT_OTA_Bond_Close,
+};
+
+/******************************** Private Functions Code ***********************************************/
+
+/*
+ * @brief Reset the bond for a new session
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Bond_Open(void)
+{
+	ota_bonded				= 0u;
+	ota_pending_bond		= 0u;
+	ota_bond_failovers		= 0u;
+	ota_bond_links[0]		= NULL;
+	ota_bond_links[1]		= NULL;
+}
+
+/*
+ * @brief Take the BOND command, the host stripes the DATA packets over the session link
+ *        and a second UART link
+ * @param packet: view on the received packet
+ * @param ret: result of the packet
+ * @retval uint8_t: 1 - BOND command, 0 - not for the bond
+ */
+static uint8_t EXT_OTA_Bond_Packet(EXT_OTA_PACKET_VIEW* packet, EXT_OTA_EX* ret)
+{
+	EXT_OTA_COMMAND* cmd = (EXT_OTA_COMMAND*)packet->ctrl;
+
+	if(packet->packet_type != EXT_OTA_PACKET_TYPE_CMD || cmd->cmd != EXT_OTA_CMD_BOND)
+	{
+		return 0u;
+	}
+	if(cmd->data_len == 1u && EXT_OTA_Bond_Partner() != NULL && EXT_OTA_Mode_Free(&ota_mode_bond_ops)
+#if EXT_OTA_FLOW_CONTROL_ENABLE
+	   && ota_pending_stream == 0u
+#endif
+	   )
+	{
+		printf("Received OTA BOND command\r\n");
+		ota_mode = &ota_mode_bond_ops;
+		// The session link carries the control packets
+		ota_bond_links[0] = ota_link;
+		ota_bond_links[1] = NULL;
+		ota_pending_bond = 1u;
+		*ret = EXT_OTA_EX_OK;
+	}
+	return 1u;
+}
+
+/*
+ * @brief Receive the next packet from the bonded links, in offset order.
+ *        Each link delivers its DATA packets in increasing offset order, so the packet at the
+ *        expected offset is at the head of one of them. A packet further ahead stays held in
+ *        the ring of its link, which then fills up and holds the host off on that link only.
+ *        On return ota_link is the link the packet has been received on. The control packets
+ *        before the bond are received on the session link.
+ * @param max_len: maximum length of the packet
+ * @param timeout: time allowed without any packet in ms
+ * @retval uint16_t: length of the packet, 0 on error or timeout
+ */
+static uint16_t EXT_OTA_Bond_Receive(uint16_t max_len, uint32_t timeout)
+{
+	uint32_t tick_start = HAL_GetTick();
+	EXT_OTA_LINK* link;
+	uint8_t live;
+	uint8_t held;
+	uint16_t len;
+
+	if(ota_bonded == 0u || ota_state != EXT_OTA_STATE_DATA)
+	{
+		ota_link = ota_bond_links[0];
+		return EXT_OTA_Receive_Chunk(&rcv_packet, max_len, timeout);
+	}
+	while(1)
+	{
+		live = 0u;
+		held = 0u;
+		for(uint8_t i = 0; i < EXT_OTA_BOND_LINKS; ++i)
+		{
+			link = ota_bond_links[i];
+			if(link == NULL)
+			{
+				continue;
+			}
+			ota_link = link;
+			live++;
+			if(link->bond_len == 0u)
+			{
+				if(EXT_OTA_Rx_Available() == 0u)
+				{
+					continue;
+				}
+				link->bond_seen = HAL_GetTick();
+				link->bond_len = EXT_OTA_Receive_Chunk(&link->bond_packet, max_len, EXT_OTA_INTER_BYTE_TIMEOUT);
+				if(link->bond_len == 0u)
+				{
+					// A damaged frame breaks the offset order of its link
+					rx_status = HAL_ERROR;
+					return 0u;
+				}
+			}
+			// Control packets are not ordered, DATA packets wait for their offset
+			if(link->bond_packet.packet_type != EXT_OTA_PACKET_TYPE_DATA ||
+			   link->bond_packet.data_len < EXT_OTA_PAYLOAD_PREFIX_MAX ||
+			   EXT_OTA_Slice_Offset(&link->bond_packet.payload) <= ota_fw_received_size)
+			{
+				rcv_packet = link->bond_packet;
+				len = link->bond_len;
+				link->bond_len = 0u;
+				return len;
+			}
+			held++;
+		}
+		// Every link is ahead of the expected offset, the packet at that offset has been lost
+		if(held != 0u && held == live)
+		{
+			rx_status = HAL_ERROR;
+			return 0u;
+		}
+		if((HAL_GetTick() - tick_start) > timeout)
+		{
+			rx_status = HAL_TIMEOUT;
+			return 0u;
+		}
+	}
+}
+
+/*
+ * @brief Write a chunk received on a bonded link. The chunk starts at the expected offset,
+ *        or before it when the host sends it again after a NACK.
+ * @param payload: payload of the DATA packet in the receive ring, offset then chunk
+ * @param len: length of the payload
+ * @param is_first_block: true - if this is the first block
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Bond_Data(EXT_OTA_SLICE* payload, uint16_t len, uint8_t is_first_block)
+{
+	HAL_StatusTypeDef ret;
+	uint32_t offset;
+	uint32_t written = ota_fw_received_size;
+
+	if(len <= EXT_OTA_PAYLOAD_PREFIX_MAX)
+	{
+		return HAL_ERROR;
+	}
+	offset = EXT_OTA_Slice_Offset(payload);
+	len -= EXT_OTA_PAYLOAD_PREFIX_MAX;
+	if(offset > written)
+	{
+		return HAL_ERROR;
+	}
+	ota_link->bond_packets++;
+	// Already written from the other link or before the NACK
+	if(offset + len <= written)
+	{
+		return HAL_OK;
+	}
+
+	EXT_OTA_Slice_Skip(payload, (uint16_t)(EXT_OTA_PAYLOAD_PREFIX_MAX + written - offset));
+	payload->offset = written;
+	ret = EXT_OTA_Slot_Data_Write(payload, slot_num_to_write_fw, is_first_block);
+	ota_link->bond_bytes += ota_fw_received_size - written;
+	return ret;
+}
+
+/*
+ * @brief Each bonded link acknowledges its own DATA packets
+ * @param none
+ * @retval uint8_t: 1 - the packet must be acknowledged
+ */
+static uint8_t EXT_OTA_Bond_Ack_Due(void)
+{
+	if(ota_state != EXT_OTA_STATE_DATA)
+	{
+		return 1u;
+	}
+	return ((ota_link->bond_packets % ota_ack_interval) == 0u) ? 1u : 0u;
+}
+
+/*
+ * @brief Tell the host which links are still bonded and where the image stands
+ * @param resp_type: EXT_OTA_ACK or EXT_OTA_NACK
+ * @retval uint8_t: 1 - sent, 0 - the links are not bonded yet
+ */
+static uint8_t EXT_OTA_Bond_Respond(uint8_t resp_type)
+{
+	if(ota_bonded == 0u)
+	{
+		return 0u;
+	}
+	EXT_OTA_BOND_RESP rsp =
+	{
+		.sof 			= EXT_OTA_SOF,
+		.packet_type 	= EXT_OTA_PACKET_TYPE_RESPONSE,
+		.data_len 		= 6,
+		.status 		= resp_type,
+		.links 			= EXT_OTA_Bond_Mask(),
+		.offset 		= ota_fw_received_size,
+		.eof			= EXT_OTA_EOF
+	};
+	rsp.crc = CalcCRC((uint8_t*)&rsp.status, 6);
+	EXT_OTA_Transmit_Resp((uint8_t*)&rsp, sizeof(EXT_OTA_BOND_RESP));
+	return 1u;
+}
+
+/*
+ * @brief Recover the bonded links after a lost packet. A link that has been silent while
+ *        its partner kept receiving is dropped from the bond, the others are NACKed with
+ *        the expected offset and drained.
+ * @param retries: retries of the session
+ * @retval HAL_StatusTypeDef: HAL_ERROR after too many retries
+ */
+static HAL_StatusTypeDef EXT_OTA_Bond_Recover(uint8_t* retries)
+{
+	uint32_t now = HAL_GetTick();
+	uint8_t i;
+
+	if(++(*retries) > EXT_OTA_MAX_RETRIES)
+	{
+		return HAL_ERROR;
+	}
+	printf("Sending NACK, expecting offset %lu (retry %u)\r\n", ota_fw_received_size, *retries);
+	if(ota_bond_links[1] != NULL)
+	{
+		for(i = 0; i < EXT_OTA_BOND_LINKS; ++i)
+		{
+			EXT_OTA_LINK* link = ota_bond_links[i];
+			EXT_OTA_LINK* partner = ota_bond_links[1u - i];
+			// A link holding a packet ahead of the expected offset is still alive
+			if(link->bond_len == 0u && (now - link->bond_seen) > EXT_OTA_INTER_FRAME_TIMEOUT &&
+			   (partner->bond_len != 0u || (now - partner->bond_seen) <= EXT_OTA_INTER_FRAME_TIMEOUT))
+			{
+				printf("Link %s dropped from the bond\r\n", link->name);
+				ota_link = link;
+				EXT_OTA_Flush_Resp();
+				EXT_OTA_Rx_Stop(link);
+				// The remaining link carries the control packets from now on
+				ota_bond_links[0] = partner;
+				ota_bond_links[1] = NULL;
+				ota_bond_failovers++;
+				break;
+			}
+		}
+	}
+
+	// NACK all the links first so that the host stops sending on each of them
+	for(i = 0; i < EXT_OTA_BOND_LINKS; ++i)
+	{
+		if(ota_bond_links[i] != NULL)
+		{
+			ota_link = ota_bond_links[i];
+			ota_link->bond_len = 0u;
+			EXT_OTA_Send_Resp(EXT_OTA_NACK);
+		}
+	}
+	for(i = 0; i < EXT_OTA_BOND_LINKS; ++i)
+	{
+		if(ota_bond_links[i] != NULL)
+		{
+			ota_link = ota_bond_links[i];
+			EXT_OTA_Rx_Drain(EXT_OTA_RETRY_IDLE_TIME);
+			ota_link->bond_seen = HAL_GetTick();
+		}
+	}
+	return HAL_OK;
+}
+
+/*
+ * @brief Bond the partner link to the session link and start its reception.
+ *        The second link starts receiving once the ACK of the BOND command is out on the session link.
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Bond_Start(void)
+{
+	if(ota_pending_bond == 0u)
+	{
+		return;
+	}
+	ota_pending_bond = 0u;
+	ota_bond_links[1] = EXT_OTA_Bond_Partner();
+	for(uint8_t i = 0; i < EXT_OTA_BOND_LINKS; ++i)
+	{
+		ota_bond_links[i]->bond_len 	= 0u;
+		ota_bond_links[i]->bond_seen 	= HAL_GetTick();
+		ota_bond_links[i]->bond_packets = 0u;
+		ota_bond_links[i]->bond_bytes 	= 0u;
+	}
+	EXT_OTA_Rx_Start(ota_bond_links[1]);
+	ota_bonded = 1u;
+	printf("Links %s and %s bonded\r\n", ota_bond_links[0]->name, ota_bond_links[1]->name);
+}
+
+/*
+ * @brief Print the statistics of the bond
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Bond_Report(void)
+{
+	if(ota_bonded == 0u)
+	{
+		return;
+	}
+	for(uint8_t i = 0; i < EXT_OTA_LINK_COUNT; ++i)
+	{
+		if(ota_links[i].bond_packets != 0u)
+		{
+			printf("Bond: %s, %lu packets, %lu bytes\r\n", ota_links[i].name,
+				   ota_links[i].bond_packets, ota_links[i].bond_bytes);
+		}
+	}
+	printf("Bond: %lu links dropped\r\n", ota_bond_failovers);
+}
+
+/*
+ * @brief Check if a UART is one of the bonded links
+ * @param huart: UART handle
+ * @retval uint8_t: 1 - bonded link
+ */
+static uint8_t EXT_OTA_Bond_Owns(UART_HandleTypeDef* huart)
+{
+	for(uint8_t i = 0; i < EXT_OTA_BOND_LINKS; ++i)
+	{
+		if(ota_bond_links[i] != NULL && ota_bond_links[i]->huart == huart)
+		{
+			return 1u;
+		}
+	}
+	return 0u;
+}
+
+/*
+ * @brief Get the last response out on the bonded links and stop them, the core closes the current one
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Bond_Close(void)
+{
+	EXT_OTA_LINK* link = ota_link;
+
+	for(uint8_t i = 0; i < EXT_OTA_BOND_LINKS; ++i)
+	{
+		if(ota_bond_links[i] != NULL && ota_bond_links[i] != link)
+		{
+			ota_link = ota_bond_links[i];
+			EXT_OTA_Flush_Resp();
+			EXT_OTA_Rx_Stop(ota_link);
+		}
+	}
+	ota_link = link;
+}
+
+/*
+ * @brief Find the UART link that can be bonded to the session link
+ * @param none
+ * @retval EXT_OTA_LINK*: NULL if there is none
+ */
+static EXT_OTA_LINK* EXT_OTA_Bond_Partner(void)
+{
+	for(uint8_t i = 0; i < EXT_OTA_LINK_COUNT; ++i)
+	{
+		if(ota_links[i].huart != NULL && &ota_links[i] != ota_link)
+		{
+			return &ota_links[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * @brief Get the links part of the bond, as reported to the host
+ * @param none
+ * @retval uint8_t: bit n set for link n
+ */
+static uint8_t EXT_OTA_Bond_Mask(void)
+{
+	uint8_t mask = 0u;
+
+	for(uint8_t i = 0; i < EXT_OTA_BOND_LINKS; ++i)
+	{
+		if(ota_bond_links[i] != NULL)
+		{
+			mask |= (uint8_t)(1u << (ota_bond_links[i] - ota_links));
+		}
+	}
+	return mask;
+}
+
+#endif
@@ -0,0 +1,330 @@
+/*
+ * ext_ota_mode_fec.c
+ *
+ *  FEC session mode: the DATA packets are sent in groups followed by a parity packet, which rebuilds
+ *  the one packet of the group lost on the link
+ */
+
+#include "ext_ota_mode.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if EXT_OTA_FEC_ENABLE
+
+// DATA packets per FEC group (0 - FEC off) and payload length of the DATA packets
+static uint8_t ota_fec_group_size;
+static uint16_t ota_fec_chunk_len;
+// Current group: index of its first DATA packet in the image, sequence number of its first packet
+static uint32_t fec_group_base;
+static uint32_t fec_group_seq;
+static uint8_t fec_group_open;
+// Packets of the current group written to the Flash, one bit per packet
+static uint32_t fec_group_written;
+// XOR of the payloads written in the current group
+static uint8_t fec_parity[EXT_OTA_DATA_MAX_SIZE];
+// The current group can not be rebuilt and must be sent again
+static uint8_t fec_restart;
+// Packets rebuilt from the parity, and groups sent again
+static uint32_t ota_fec_rebuilt;
+static uint32_t ota_fec_resent;
+
+/********************************* Private Functions Prototypes *****************************************/
+
+static void EXT_OTA_Fec_Open(void);
+static uint8_t EXT_OTA_Fec_Packet(EXT_OTA_PACKET_VIEW* packet, EXT_OTA_EX* ret);
+static HAL_StatusTypeDef EXT_OTA_Fec_Data(EXT_OTA_SLICE* payload, uint16_t len, uint8_t is_first_block);
+static uint8_t EXT_OTA_Fec_Ack_Due(void);
+static uint8_t EXT_OTA_Fec_Resync(uint16_t len, uint8_t resend);
+static void EXT_OTA_Fec_Report(void);
+static uint32_t EXT_OTA_Fec_Position(void);
+static void EXT_OTA_Fec_Close_Group(uint32_t count);
+static HAL_StatusTypeDef EXT_OTA_Fec_Parity(const EXT_OTA_SLICE* payload, uint16_t len);
+static uint8_t EXT_OTA_Fec_Erasure(void);
+
+const EXT_OTA_MODE_OPS ota_mode_fec_ops =
+{
+	.open		= EXT_OTA_Fec_Open,
+	.packet		= EXT_OTA_Fec_Packet,
+	.data		= EXT_OTA_Fec_Data,
+	.ack_due	= EXT_OTA_Fec_Ack_Due,
+	.resync		= EXT_OTA_Fec_Resync,
+	.report		= EXT_OTA_Fec_Report,
+};
+
+/******************************** Private Functions Code ***********************************************/
+
+/*
+ * @brief Reset the FEC mode for a new session
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Fec_Open(void)
+{
+	ota_fec_group_size		= 0u;
+	fec_group_base			= 0u;
+	fec_group_open			= 0u;
+	fec_restart				= 0u;
+	ota_fec_rebuilt			= 0u;
+	ota_fec_resent			= 0u;
+}
+
+/*
+ * @brief Take the FEC command, the host protects the DATA packets with a parity packet per group,
+ *        and the parity packets of the groups
+ * @param packet: view on the received packet
+ * @param ret: result of the packet
+ * @retval uint8_t: 1 - FEC command or parity packet, 0 - not for the FEC mode
+ */
+static uint8_t EXT_OTA_Fec_Packet(EXT_OTA_PACKET_VIEW* packet, EXT_OTA_EX* ret)
+{
+	EXT_OTA_FEC_COMMAND* fec_cmd = (EXT_OTA_FEC_COMMAND*)packet->ctrl;
+
+	if(packet->packet_type == EXT_OTA_PACKET_TYPE_CMD && fec_cmd->cmd == EXT_OTA_CMD_FEC)
+	{
+		if(fec_cmd->data_len == 4u && EXT_OTA_Mode_Free(&ota_mode_fec_ops) &&
+		   fec_cmd->group_size >= 2u && fec_cmd->group_size <= EXT_OTA_FEC_GROUP_MAX &&
+		   fec_cmd->chunk_len != 0u && fec_cmd->chunk_len <= ota_payload_max &&
+		   (fec_cmd->chunk_len % 2u) == 0u)
+		{
+			printf("Received OTA FEC command. Group = %u, Chunk = %u\r\n", fec_cmd->group_size, fec_cmd->chunk_len);
+			ota_mode = &ota_mode_fec_ops;
+			ota_fec_group_size = fec_cmd->group_size;
+			ota_fec_chunk_len = fec_cmd->chunk_len;
+			*ret = EXT_OTA_EX_OK;
+		}
+		return 1u;
+	}
+	// Parity of a FEC group, rebuilds the DATA packet missing from the group
+	if(packet->packet_type == EXT_OTA_PACKET_TYPE_PARITY)
+	{
+		if(ota_mode == &ota_mode_fec_ops &&
+		   (ota_state == EXT_OTA_STATE_DATA || ota_state == EXT_OTA_STATE_END) &&
+		   EXT_OTA_Fec_Parity(&packet->payload, packet->data_len) == HAL_OK)
+		{
+			if(ota_fw_received_size >= ota_fw_total_size)
+			{
+				ota_state = EXT_OTA_STATE_END;
+			}
+			*ret = EXT_OTA_EX_OK;
+		}
+		return 1u;
+	}
+	return 0u;
+}
+
+/*
+ * @brief Write a DATA packet of a FEC group at the offset given by its position
+ * @param payload: payload of the packet in the receive ring
+ * @param len: length of the payload
+ * @param is_first_block: true - if this is the first block
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Fec_Data(EXT_OTA_SLICE* payload, uint16_t len, uint8_t is_first_block)
+{
+	HAL_StatusTypeDef ret;
+	uint32_t pos = EXT_OTA_Fec_Position();
+	uint32_t offset = (fec_group_base + pos) * ota_fec_chunk_len;
+
+	// The parity of the group has been lost, the group is sent again
+	if(pos >= ota_fec_group_size)
+	{
+		fec_restart = 1u;
+		return HAL_OK;
+	}
+	// Already written during an earlier pass over the group
+	if(fec_group_written & (1u << pos))
+	{
+		return HAL_OK;
+	}
+	if(offset + len > ota_fw_total_size ||
+	   (len != ota_fec_chunk_len && offset + len != ota_fw_total_size))
+	{
+		return HAL_ERROR;
+	}
+
+	for(uint16_t i = 0; i < len; ++i)
+	{
+		fec_parity[i] ^= EXT_OTA_Slice_Byte(payload, i);
+	}
+	payload->offset = offset;
+	ret = EXT_OTA_Slot_Data_Write(payload, slot_num_to_write_fw, is_first_block);
+	if(ret == HAL_OK)
+	{
+		fec_group_written |= (1u << pos);
+	}
+	return ret;
+}
+
+/*
+ * @brief The parity packet acknowledges the whole group
+ * @param none
+ * @retval uint8_t: 0 - the DATA packets are not acknowledged
+ */
+static uint8_t EXT_OTA_Fec_Ack_Due(void)
+{
+	return 0u;
+}
+
+/*
+ * @brief Account for the packet just received: a damaged DATA frame of a FEC group is left
+ *        to the parity, a group that can not be rebuilt is sent again from its first packet
+ * @param len: length of the packet, 0 on error or timeout
+ * @param resend: the packet must be sent again
+ * @retval uint8_t: the packets must be sent again
+ */
+static uint8_t EXT_OTA_Fec_Resync(uint16_t len, uint8_t resend)
+{
+	// No NACK for a damaged frame the parity can rebuild
+	if(len == 0u && rx_status == HAL_ERROR && EXT_OTA_Fec_Erasure() != 0u)
+	{
+		ota_packet_count++;
+		resend = 0u;
+	}
+	if(fec_restart)
+	{
+		fec_restart = 0u;
+		ota_packet_count = fec_group_seq;
+		ota_fec_resent++;
+		resend = 1u;
+	}
+	return resend;
+}
+
+/*
+ * @brief Print the statistics of the FEC mode
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Fec_Report(void)
+{
+	printf("FEC: %lu packets rebuilt, %lu groups sent again\r\n", ota_fec_rebuilt, ota_fec_resent);
+}
+
+/*
+ * @brief Get the position of the current packet in its FEC group, opening a new group if needed
+ * @param none
+ * @retval uint32_t: 0 to group size - 1 for DATA packets, group size for the parity
+ */
+static uint32_t EXT_OTA_Fec_Position(void)
+{
+	if(fec_group_open == 0u)
+	{
+		fec_group_open = 1u;
+		fec_group_seq = ota_packet_count;
+		fec_group_written = 0u;
+		memset(fec_parity, 0, sizeof(fec_parity));
+	}
+	return ota_packet_count - fec_group_seq;
+}
+
+/*
+ * @brief Close the current FEC group, the next DATA packet opens the following one
+ * @param count: DATA packets in the group
+ * @retval none
+ */
+static void EXT_OTA_Fec_Close_Group(uint32_t count)
+{
+	fec_group_base += count;
+	fec_group_open = 0u;
+}
+
+/*
+ * @brief Close a FEC group on its parity packet, rebuilding the one DATA packet missing
+ * @param payload: payload of the parity packet in the receive ring
+ * @param len: length of the payload
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Fec_Parity(const EXT_OTA_SLICE* payload, uint16_t len)
+{
+	HAL_StatusTypeDef ret = HAL_OK;
+	uint32_t pos = EXT_OTA_Fec_Position();
+	uint16_t count;
+	uint32_t missing = 0u;
+	uint8_t missing_count = 0u;
+
+	if(len != 2u + ota_fec_chunk_len)
+	{
+		return HAL_ERROR;
+	}
+	count = EXT_OTA_Slice_Byte(payload, 0u) | (EXT_OTA_Slice_Byte(payload, 1u) << 8);
+
+	// A frame has been lost without trace, positions can not be trusted
+	if(count == 0u || count > ota_fec_group_size || pos != count)
+	{
+		fec_restart = 1u;
+		return HAL_OK;
+	}
+	for(uint32_t i = 0; i < count; ++i)
+	{
+		if((fec_group_written & (1u << i)) == 0u)
+		{
+			missing = i;
+			missing_count++;
+		}
+	}
+	if(missing_count == 1u)
+	{
+		uint32_t offset = (fec_group_base + missing) * ota_fec_chunk_len;
+
+		// The parity can not rebuild more than one packet, nor the very first write of the image
+		if(offset >= ota_fw_total_size || ota_fw_received_size == 0u)
+		{
+			fec_restart = 1u;
+			return HAL_OK;
+		}
+		for(uint16_t i = 0; i < ota_fec_chunk_len; ++i)
+		{
+			fec_parity[i] ^= EXT_OTA_Slice_Byte(payload, 2u + i);
+		}
+		EXT_OTA_SLICE rebuilt =
+		{
+			.ptr 	= { fec_parity, NULL },
+			.len 	= { (uint16_t)((ota_fw_total_size - offset < ota_fec_chunk_len) ? (ota_fw_total_size - offset) : ota_fec_chunk_len), 0u },
+			.offset = offset,
+		};
+		ret = EXT_OTA_Slot_Data_Write(&rebuilt, slot_num_to_write_fw, 0u);
+		if(ret != HAL_OK)
+		{
+			return ret;
+		}
+		printf("Rebuilt packet %lu from the parity\r\n", fec_group_base + missing);
+		ota_fec_rebuilt++;
+	}
+	else if(missing_count > 1u)
+	{
+		fec_restart = 1u;
+		return HAL_OK;
+	}
+	EXT_OTA_Fec_Close_Group(count);
+
+	return ret;
+}
+
+/*
+ * @brief Account for a damaged frame received in place of a DATA packet of a FEC group
+ * @param none
+ * @retval uint8_t: 1 - left to the parity of the group, 0 - the frame must be sent again
+ */
+static uint8_t EXT_OTA_Fec_Erasure(void)
+{
+	uint32_t pos;
+
+	if(ota_fec_group_size == 0u || ota_state != EXT_OTA_STATE_DATA)
+	{
+		return 0u;
+	}
+	pos = EXT_OTA_Fec_Position();
+	if(pos == ota_fec_group_size && fec_group_written == ((1u << pos) - 1u))
+	{
+		// Only the parity is lost and the group is complete
+		EXT_OTA_Fec_Close_Group(pos);
+	}
+	else if(pos >= ota_fec_group_size)
+	{
+		fec_restart = 1u;
+	}
+	return 1u;
+}
+
+#endif
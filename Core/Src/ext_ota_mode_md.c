@@ -0,0 +1,235 @@
+/*
+ * ext_ota_mode_md.c
+ *
+ *  Multidrop broadcast session mode: the host broadcasts the image in chunks of a fixed length
+ *  to the nodes of the bus, then polls each node for the chunks it misses
+ */
+
+#include "ext_ota_mode.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if EXT_OTA_MULTIDROP_ENABLE
+
+// Chunk length of the broadcast image, 0 when the image is not broadcast
+static uint16_t ota_md_chunk_len;
+// Bit n set while chunk n of the broadcast image is missing
+static uint8_t ota_md_missing[EXT_OTA_MD_BITMAP_SIZE];
+// The packet being answered is a MISSING poll
+static uint8_t ota_md_poll;
+// Chunks received again, polls answered
+static uint32_t ota_md_duplicates;
+static uint32_t ota_md_polls;
+
+/********************************* Private Functions Prototypes *****************************************/
+
+static void EXT_OTA_Md_Open(void);
+static uint8_t EXT_OTA_Md_Packet(EXT_OTA_PACKET_VIEW* packet, EXT_OTA_EX* ret);
+static HAL_StatusTypeDef EXT_OTA_Md_Start(void);
+static HAL_StatusTypeDef EXT_OTA_Md_Data(EXT_OTA_SLICE* payload, uint16_t len, uint8_t is_first_block);
+static uint8_t EXT_OTA_Md_Respond(uint8_t resp_type);
+static void EXT_OTA_Md_Report(void);
+static uint16_t EXT_OTA_Md_Missing_Count(void);
+
+const EXT_OTA_MODE_OPS ota_mode_md_ops =
+{
+	.offset		= 1u,
+	.open		= EXT_OTA_Md_Open,
+	.packet		= EXT_OTA_Md_Packet,
+	.header		= EXT_OTA_Md_Start,
+	.data		= EXT_OTA_Md_Data,
+	.respond	= EXT_OTA_Md_Respond,
+	.report		= EXT_OTA_Md_Report,
+};
+
+/******************************** Private Functions Code ***********************************************/
+
+/*
+ * @brief Reset the broadcast for a new session
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Md_Open(void)
+{
+	ota_md_chunk_len		= 0u;
+	ota_md_poll				= 0u;
+	ota_md_duplicates		= 0u;
+	ota_md_polls			= 0u;
+}
+
+/*
+ * @brief Take the MULTIDROP command, the host broadcasts the image to the nodes of the bus in chunks
+ *        of a fixed length, and the MISSING polls of this node
+ * @param packet: view on the received packet
+ * @param ret: result of the packet
+ * @retval uint8_t: 1 - MULTIDROP or MISSING command, 0 - not for the broadcast
+ */
+static uint8_t EXT_OTA_Md_Packet(EXT_OTA_PACKET_VIEW* packet, EXT_OTA_EX* ret)
+{
+	EXT_OTA_MULTIDROP_COMMAND* md_cmd = (EXT_OTA_MULTIDROP_COMMAND*)packet->ctrl;
+
+	if(packet->packet_type != EXT_OTA_PACKET_TYPE_CMD)
+	{
+		return 0u;
+	}
+	if(md_cmd->cmd == EXT_OTA_CMD_MULTIDROP)
+	{
+		if(md_cmd->data_len == 3u && ota_link->multidrop && EXT_OTA_Mode_Free(&ota_mode_md_ops) &&
+		   md_cmd->chunk_len >= EXT_OTA_DATA_MIN_SIZE && md_cmd->chunk_len <= ota_payload_max &&
+		   (md_cmd->chunk_len % 2u) == 0u)
+		{
+			printf("Received OTA MULTIDROP command. Chunk = %u\r\n", md_cmd->chunk_len);
+			ota_mode = &ota_mode_md_ops;
+			ota_md_chunk_len = md_cmd->chunk_len;
+			*ret = EXT_OTA_EX_OK;
+		}
+		return 1u;
+	}
+	// The host polls this node for the chunks it misses
+	if(md_cmd->cmd == EXT_OTA_CMD_MISSING)
+	{
+		if(md_cmd->data_len == 1u && ota_mode == &ota_mode_md_ops && packet->address != EXT_OTA_ADDR_BROADCAST &&
+		   (ota_state == EXT_OTA_STATE_DATA || ota_state == EXT_OTA_STATE_END))
+		{
+			ota_md_poll = 1u;
+			ota_md_polls++;
+			*ret = EXT_OTA_EX_OK;
+		}
+		return 1u;
+	}
+	return 0u;
+}
+
+/*
+ * @brief Get the slot ready for a broadcast image: all its chunks are missing, the slot is
+ *        marked as being written and erased
+ * @param none
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Md_Start(void)
+{
+	uint32_t chunks = (ota_fw_total_size + ota_md_chunk_len - 1u) / ota_md_chunk_len;
+	EXT_OTA_SLICE none = { 0 };
+	EXT_GNRL_CONFIG cfg;
+
+	if(ota_fw_total_size == 0u || chunks > EXT_OTA_MD_BITMAP_SIZE * 8u)
+	{
+		return HAL_ERROR;
+	}
+	memset(ota_md_missing, 0, sizeof(ota_md_missing));
+	for(uint32_t i = 0; i < chunks; ++i)
+	{
+		ota_md_missing[i / 8u] |= (uint8_t)(1u << (i % 8u));
+	}
+
+	memcpy(&cfg, cfg_flash, sizeof(EXT_GNRL_CONFIG));
+	cfg.slot_table[slot_num_to_write_fw].is_this_slot_valid = 1;
+	if(EXT_OTA_Write_Config(&cfg) != HAL_OK)
+	{
+		return HAL_ERROR;
+	}
+	return EXT_OTA_Slot_Data_Write(&none, slot_num_to_write_fw, 1u);
+}
+
+/*
+ * @brief Write a chunk of the broadcast image. A chunk already written, broadcast again
+ *        for another node, is skipped.
+ * @param payload: payload of the DATA packet in the receive ring, offset then chunk
+ * @param len: length of the payload
+ * @param is_first_block: not used, the slot is ready since the header
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Md_Data(EXT_OTA_SLICE* payload, uint16_t len, uint8_t is_first_block)
+{
+	HAL_StatusTypeDef ret;
+	uint32_t offset;
+	uint32_t chunk;
+
+	UNUSED(is_first_block);
+	if(len <= EXT_OTA_PAYLOAD_PREFIX_MAX)
+	{
+		return HAL_ERROR;
+	}
+	offset = EXT_OTA_Slice_Offset(payload);
+	len -= EXT_OTA_PAYLOAD_PREFIX_MAX;
+	chunk = offset / ota_md_chunk_len;
+	if((offset % ota_md_chunk_len) != 0u || offset >= ota_fw_total_size ||
+	   len != ((ota_fw_total_size - offset < ota_md_chunk_len) ? (ota_fw_total_size - offset) : ota_md_chunk_len))
+	{
+		return HAL_ERROR;
+	}
+	if((ota_md_missing[chunk / 8u] & (1u << (chunk % 8u))) == 0u)
+	{
+		ota_md_duplicates++;
+		return HAL_OK;
+	}
+
+	EXT_OTA_Slice_Skip(payload, EXT_OTA_PAYLOAD_PREFIX_MAX);
+	payload->offset = offset;
+	ret = EXT_OTA_Slot_Data_Write(payload, slot_num_to_write_fw, 0u);
+	if(ret == HAL_OK)
+	{
+		ota_md_missing[chunk / 8u] &= (uint8_t)~(1u << (chunk % 8u));
+	}
+	return ret;
+}
+
+/*
+ * @brief Tell the host which chunks to broadcast again, in answer to a MISSING poll
+ * @param resp_type: EXT_OTA_ACK or EXT_OTA_NACK
+ * @retval uint8_t: 1 - sent, 0 - the packet is not a poll
+ */
+static uint8_t EXT_OTA_Md_Respond(uint8_t resp_type)
+{
+	if(ota_md_poll == 0u)
+	{
+		return 0u;
+	}
+	EXT_OTA_MISSING_RESP rsp =
+	{
+		.sof 			= EXT_OTA_SOF,
+		.packet_type 	= EXT_OTA_PACKET_TYPE_RESPONSE,
+		.data_len 		= 4 + EXT_OTA_MD_BITMAP_SIZE,
+		.status 		= resp_type,
+		.node 			= EXT_OTA_NODE_ADDRESS,
+		.missing 		= EXT_OTA_Md_Missing_Count(),
+		.eof			= EXT_OTA_EOF
+	};
+	memcpy(rsp.bitmap, ota_md_missing, EXT_OTA_MD_BITMAP_SIZE);
+	rsp.crc = CalcCRC((uint8_t*)&rsp.status, 4 + EXT_OTA_MD_BITMAP_SIZE);
+	ota_md_poll = 0u;
+	EXT_OTA_Transmit_Resp((uint8_t*)&rsp, sizeof(EXT_OTA_MISSING_RESP));
+	return 1u;
+}
+
+/*
+ * @brief Print the statistics of the broadcast
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Md_Report(void)
+{
+	printf("Broadcast: %lu polls, %lu chunks received again\r\n", ota_md_polls, ota_md_duplicates);
+}
+
+/*
+ * @brief Count the chunks of the broadcast image still missing
+ * @param none
+ * @retval uint16_t
+ */
+static uint16_t EXT_OTA_Md_Missing_Count(void)
+{
+	uint16_t count = 0u;
+
+	for(uint16_t i = 0; i < EXT_OTA_MD_BITMAP_SIZE * 8u; ++i)
+	{
+		if(ota_md_missing[i / 8u] & (1u << (i % 8u)))
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * ext_ota_mode_pull.c
+ *
+ *  Pull session mode: the bootloader requests the chunks of the image with READ_CHUNK commands,
+ *  a window of them in flight, and writes each chunk at its offset
+ */
+
+#include "ext_ota_mode.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// READ_CHUNK requests kept in flight in the pull mode (0 - not started yet), and the window requested by the host
+static uint8_t ota_pull_window;
+static uint8_t ota_pending_pull;
+// Requests in flight, offset of the next chunk to request and order of the last request sent
+static EXT_OTA_PULL_REQ pull_req[EXT_OTA_PULL_WINDOW_MAX];
+static uint32_t pull_next_offset;
+static uint32_t pull_order;
+// Requests sent, and requests sent again
+static uint32_t ota_pull_requests;
+static uint32_t ota_pull_reissued;
+
+/********************************* Private Functions Prototypes *****************************************/
+
+static void EXT_OTA_Pull_Open(void);
+static uint8_t EXT_OTA_Pull_Packet(EXT_OTA_PACKET_VIEW* packet, EXT_OTA_EX* ret);
+static uint16_t EXT_OTA_Pull_Receive(uint16_t max_len, uint32_t timeout);
+static HAL_StatusTypeDef EXT_OTA_Pull_Data(EXT_OTA_SLICE* payload, uint16_t len, uint8_t is_first_block);
+static uint8_t EXT_OTA_Pull_Ack_Due(void);
+static HAL_StatusTypeDef EXT_OTA_Pull_Recover(uint8_t* retries);
+static void EXT_OTA_Pull_Activate(void);
+static void EXT_OTA_Pull_Report(void);
+static void EXT_OTA_Pull_Send(EXT_OTA_PULL_REQ* req);
+static void EXT_OTA_Pull_Issue(void);
+static void EXT_OTA_Pull_Reissue(uint32_t order);
+
+const EXT_OTA_MODE_OPS ota_mode_pull_ops =
+{
+	.offset		= 1u,
+	.open		= EXT_OTA_Pull_Open,
+	.packet		= EXT_OTA_Pull_Packet,
+	.receive	= EXT_OTA_Pull_Receive,
+	.data		= EXT_OTA_Pull_Data,
+	.ack_due	= EXT_OTA_Pull_Ack_Due,
+	.recover	= EXT_OTA_Pull_Recover,
+	.activate	= EXT_OTA_Pull_Activate,
+	.report		= EXT_OTA_Pull_Report,
+};
+
+/******************************** Private Functions Code ***********************************************/
+
+/*
+ * @brief Reset the pull mode for a new session
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Pull_Open(void)
+{
+	ota_pull_window			= 0u;
+	ota_pending_pull		= 0u;
+	pull_next_offset		= 0u;
+	pull_order				= 0u;
+	ota_pull_requests		= 0u;
+	ota_pull_reissued		= 0u;
+	memset(pull_req, 0, sizeof(pull_req));
+}
+
+/*
+ * @brief Take the PULL command, the host lets the bootloader request the chunks of the image
+ * @param packet: view on the received packet
+ * @param ret: result of the packet
+ * @retval uint8_t: 1 - PULL command, 0 - not for the pull mode
+ */
+static uint8_t EXT_OTA_Pull_Packet(EXT_OTA_PACKET_VIEW* packet, EXT_OTA_EX* ret)
+{
+	EXT_OTA_PULL_COMMAND* pull_cmd = (EXT_OTA_PULL_COMMAND*)packet->ctrl;
+
+	if(packet->packet_type != EXT_OTA_PACKET_TYPE_CMD || pull_cmd->cmd != EXT_OTA_CMD_PULL)
+	{
+		return 0u;
+	}
+	if(pull_cmd->data_len == 2u && EXT_OTA_Mode_Free(&ota_mode_pull_ops) &&
+	   pull_cmd->window != 0u && pull_cmd->window <= EXT_OTA_PULL_WINDOW_MAX)
+	{
+		printf("Received OTA PULL command. Window = %u\r\n", pull_cmd->window);
+		ota_mode = &ota_mode_pull_ops;
+		ota_pending_pull = pull_cmd->window;
+		*ret = EXT_OTA_EX_OK;
+	}
+	return 1u;
+}
+
+/*
+ * @brief Receive the next packet, the bootloader first asks for the next chunks it has room for
+ * @param max_len: maximum length of the packet
+ * @param timeout: time allowed without any packet in ms
+ * @retval uint16_t: length of the packet, 0 on error or timeout
+ */
+static uint16_t EXT_OTA_Pull_Receive(uint16_t max_len, uint32_t timeout)
+{
+	if(ota_pull_window != 0u && ota_state == EXT_OTA_STATE_DATA)
+	{
+		EXT_OTA_Pull_Issue();
+	}
+	return EXT_OTA_Receive_Chunk(&rcv_packet, max_len, timeout);
+}
+
+/*
+ * @brief Write a chunk answered by the host in the pull mode
+ * @param payload: payload of the DATA packet in the receive ring, offset then chunk
+ * @param len: length of the payload
+ * @param is_first_block: true - if this is the first block
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Pull_Data(EXT_OTA_SLICE* payload, uint16_t len, uint8_t is_first_block)
+{
+	HAL_StatusTypeDef ret;
+	uint32_t offset;
+	uint8_t i;
+
+	if(len < EXT_OTA_PAYLOAD_PREFIX_MAX)
+	{
+		return HAL_ERROR;
+	}
+	offset = EXT_OTA_Slice_Offset(payload);
+	for(i = 0; i < ota_pull_window; ++i)
+	{
+		if(pull_req[i].len != 0u && pull_req[i].offset == offset)
+		{
+			break;
+		}
+	}
+	// Late answer to a request sent again, the chunk is already written
+	if(i == ota_pull_window)
+	{
+		return HAL_OK;
+	}
+	if(len - EXT_OTA_PAYLOAD_PREFIX_MAX != pull_req[i].len)
+	{
+		return HAL_ERROR;
+	}
+
+	EXT_OTA_Slice_Skip(payload, EXT_OTA_PAYLOAD_PREFIX_MAX);
+	payload->offset = offset;
+	ret = EXT_OTA_Slot_Data_Write(payload, slot_num_to_write_fw, is_first_block);
+	if(ret == HAL_OK)
+	{
+		pull_req[i].len = 0u;
+		EXT_OTA_Pull_Reissue(pull_req[i].order);
+	}
+	return ret;
+}
+
+/*
+ * @brief Pulled chunks are acknowledged by the next READ_CHUNK requests
+ * @param none
+ * @retval uint8_t: 1 - the packet must be acknowledged
+ */
+static uint8_t EXT_OTA_Pull_Ack_Due(void)
+{
+	return (ota_state != EXT_OTA_STATE_DATA) ? 1u : 0u;
+}
+
+/*
+ * @brief Pulled chunks are requested again rather than NACKed: a damaged one is sent again as soon
+ *        as a later chunk arrives, all of them when the link goes silent
+ * @param retries: retries of the session
+ * @retval HAL_StatusTypeDef: HAL_ERROR after too many retries
+ */
+static HAL_StatusTypeDef EXT_OTA_Pull_Recover(uint8_t* retries)
+{
+	if(rx_status != HAL_TIMEOUT)
+	{
+		return HAL_OK;
+	}
+	if(++(*retries) > EXT_OTA_MAX_RETRIES)
+	{
+		return HAL_ERROR;
+	}
+	EXT_OTA_Rx_Drain(EXT_OTA_RETRY_IDLE_TIME);
+	EXT_OTA_Pull_Reissue(0xFFFFFFFFu);
+	return HAL_OK;
+}
+
+/*
+ * @brief Requests start once the PULL command has been acknowledged
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Pull_Activate(void)
+{
+	if(ota_pending_pull != 0u)
+	{
+		ota_pull_window = ota_pending_pull;
+		ota_pending_pull = 0u;
+	}
+}
+
+/*
+ * @brief Print the statistics of the pull mode
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Pull_Report(void)
+{
+	printf("Pull: %lu requests, %lu sent again\r\n", ota_pull_requests, ota_pull_reissued);
+}
+
+/*
+ * @brief Send a READ_CHUNK command for a request of the pull mode
+ * @param req: request to send
+ * @retval none
+ */
+static void EXT_OTA_Pull_Send(EXT_OTA_PULL_REQ* req)
+{
+	EXT_OTA_READ_CHUNK_COMMAND rd =
+	{
+		.sof 			= EXT_OTA_SOF,
+		.packet_type 	= EXT_OTA_PACKET_TYPE_CMD,
+		.data_len 		= 7,
+		.cmd 			= EXT_OTA_CMD_READ_CHUNK,
+		.offset 		= req->offset,
+		.length 		= req->len,
+		.eof			= EXT_OTA_EOF
+	};
+	rd.crc = CalcCRC((uint8_t*)&rd.cmd, 7);
+	req->order = ++pull_order;
+	ota_pull_requests++;
+	EXT_OTA_Transmit_Resp((uint8_t*)&rd, sizeof(EXT_OTA_READ_CHUNK_COMMAND));
+}
+
+/*
+ * @brief Keep the window of READ_CHUNK requests full. The chunks in flight must fit
+ *        in the receive ring, so the requests follow the progress of the Flash.
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Pull_Issue(void)
+{
+	uint16_t chunk = (ota_payload_advice != 0u) ? ota_payload_advice : ota_payload_max;
+	uint32_t in_flight = 0u;
+	uint8_t i;
+
+	for(i = 0; i < ota_pull_window; ++i)
+	{
+		if(pull_req[i].len != 0u)
+		{
+			in_flight += EXT_OTA_COBS_MAX_SIZE(pull_req[i].len + EXT_OTA_PAYLOAD_PREFIX_MAX + EXT_OTA_DATA_OVERHEAD) + 1u;
+		}
+	}
+	for(i = 0; i < ota_pull_window && pull_next_offset < ota_fw_total_size; ++i)
+	{
+		if(pull_req[i].len != 0u)
+		{
+			continue;
+		}
+		uint16_t len = (ota_fw_total_size - pull_next_offset < chunk) ? (uint16_t)(ota_fw_total_size - pull_next_offset) : chunk;
+		uint32_t frame = EXT_OTA_COBS_MAX_SIZE(len + EXT_OTA_PAYLOAD_PREFIX_MAX + EXT_OTA_DATA_OVERHEAD) + 1u;
+		if(in_flight + frame > EXT_OTA_RX_RING_SIZE)
+		{
+			break;
+		}
+		pull_req[i].offset = pull_next_offset;
+		pull_req[i].len = len;
+		pull_next_offset += len;
+		in_flight += frame;
+		EXT_OTA_Pull_Send(&pull_req[i]);
+	}
+}
+
+/*
+ * @brief Send again the requests in flight sent before a given one.
+ *        The host answers in order, their chunks have been lost.
+ * @param order: order of the request answered, 0xFFFFFFFF to send all of them again
+ * @retval none
+ */
+static void EXT_OTA_Pull_Reissue(uint32_t order)
+{
+	uint32_t last = pull_order;
+
+	for(uint8_t i = 0; i < ota_pull_window; ++i)
+	{
+		if(pull_req[i].len != 0u && pull_req[i].order < order && pull_req[i].order <= last)
+		{
+			ota_pull_reissued++;
+			EXT_OTA_Pull_Send(&pull_req[i]);
+		}
+	}
+}
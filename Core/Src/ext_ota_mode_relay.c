@@ -0,0 +1,447 @@
+/*
+ * ext_ota_mode_relay.c
+ *
+ *  Relay session mode: the image written to the slot is sent on to the next board of the chain,
+ *  the END is acknowledged once the boards further down have acknowledged theirs
+ */
+
+#include "ext_ota_mode.h"
+#include "main.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if EXT_OTA_RELAY_ENABLE
+
+// Link to the next board of the chain, and the number of boards further down (0 - no relay)
+static EXT_OTA_LINK* relay_link;
+static uint8_t ota_relay_hops;
+static EXT_OTA_RELAY_STEP relay_step;
+// Frame sent down, waiting for its response while relay_frame_len is not 0
+static uint8_t relay_frame[EXT_OTA_RELAY_CHUNK + EXT_OTA_DATA_OVERHEAD];
+static uint16_t relay_frame_len;
+static uint16_t relay_chunk_len;
+// Image bytes acknowledged by the next board
+static uint32_t relay_offset;
+// Tick the frame has been sent at, or the NACK received at
+static uint32_t relay_tick;
+static uint8_t relay_nacked;
+static uint8_t relay_retries;
+static volatile uint8_t relay_tx_busy;
+// The relay is being served, it is not entered again from the receive wait
+static uint8_t relay_pumping;
+// Packets sent down, and sent again
+static uint32_t ota_relay_packets;
+static uint32_t ota_relay_resent;
+
+/********************************* Private Functions Prototypes *****************************************/
+
+static void EXT_OTA_Relay_Open(void);
+static uint8_t EXT_OTA_Relay_Packet(EXT_OTA_PACKET_VIEW* packet, EXT_OTA_EX* ret);
+static void EXT_OTA_Relay_Start(uint8_t hops);
+static uint8_t EXT_OTA_Relay_Resp(void);
+static void EXT_OTA_Relay_Send(void);
+static void EXT_OTA_Relay_Pump(void);
+static HAL_StatusTypeDef EXT_OTA_Relay_Finish(void);
+static void EXT_OTA_Relay_Report(void);
+static uint8_t EXT_OTA_Relay_Owns(UART_HandleTypeDef* huart);
+static void EXT_OTA_Relay_Close(void);
+static void EXT_OTA_Relay_Stop(void);
+
+const EXT_OTA_MODE_OPS ota_mode_relay_ops =
+{
+	.open	= EXT_OTA_Relay_Open,
+	.packet	= EXT_OTA_Relay_Packet,
+	.poll	= EXT_OTA_Relay_Pump,
+	.end	= EXT_OTA_Relay_Finish,
+	.report	= EXT_OTA_Relay_Report,
+	.owns	= EXT_OTA_Relay_Owns,
+	.close	= EXT_OTA_Relay_Close,
+};
+
+/******************************** Private Functions Code ***********************************************/
+
+/*
+ * @brief Reset the relay for a new session
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Relay_Open(void)
+{
+	relay_link				= EXT_OTA_Link_Find(&huart3);
+	ota_relay_hops			= 0u;
+	relay_step				= EXT_OTA_RELAY_OFF;
+}
+
+/*
+ * @brief Take the RELAY command, the host reaches the next boards of the chain through this one
+ * @param packet: view on the received packet
+ * @param ret: result of the packet
+ * @retval uint8_t: 1 - RELAY command, 0 - not for the relay
+ */
+static uint8_t EXT_OTA_Relay_Packet(EXT_OTA_PACKET_VIEW* packet, EXT_OTA_EX* ret)
+{
+	EXT_OTA_RELAY_COMMAND* relay_cmd = (EXT_OTA_RELAY_COMMAND*)packet->ctrl;
+
+	if(packet->packet_type != EXT_OTA_PACKET_TYPE_CMD || relay_cmd->cmd != EXT_OTA_CMD_RELAY)
+	{
+		return 0u;
+	}
+	if(relay_cmd->data_len == 2u && relay_cmd->hops != 0u && ota_link != relay_link &&
+	   EXT_OTA_Mode_Free(&ota_mode_relay_ops))
+	{
+		printf("Received OTA RELAY command. Hops = %u\r\n", relay_cmd->hops);
+		ota_mode = &ota_mode_relay_ops;
+		EXT_OTA_Relay_Start(relay_cmd->hops);
+		*ret = EXT_OTA_EX_OK;
+	}
+	return 1u;
+}
+
+/*
+ * @brief Start the session with the next board of the chain, it opens once the header is known
+ * @param hops: boards further down the chain, this one's neighbor included
+ * @retval none
+ */
+static void EXT_OTA_Relay_Start(uint8_t hops)
+{
+	ota_relay_hops 		= hops;
+	relay_step 			= EXT_OTA_RELAY_START;
+	relay_frame_len 	= 0u;
+	relay_offset 		= 0u;
+	relay_retries 		= 0u;
+	relay_tx_busy 		= 0u;
+	relay_pumping 		= 0u;
+	ota_relay_packets 	= 0u;
+	ota_relay_resent 	= 0u;
+	EXT_OTA_Rx_Start(relay_link);
+}
+
+/*
+ * @brief Take the next response of the next board out of the ring of the relay link.
+ *        Only complete frames are taken, the rest waits for the next call.
+ * @param none
+ * @retval uint8_t: EXT_OTA_ACK, EXT_OTA_NACK, or 0xFF when there is no response
+ */
+static uint8_t EXT_OTA_Relay_Resp(void)
+{
+	EXT_OTA_LINK* link = ota_link;
+	EXT_OTA_SLICE status;
+	uint8_t resp = 0xFFu;
+	uint32_t available;
+	uint32_t rec_crc;
+	uint16_t len;
+
+	ota_link = relay_link;
+	while((available = EXT_OTA_Rx_Available()) >= 4u)
+	{
+		len = EXT_OTA_Rx_Peek(2u) | (EXT_OTA_Rx_Peek(3u) << 8);
+		if(EXT_OTA_Rx_Peek(0u) != EXT_OTA_SOF || EXT_OTA_Rx_Peek(1u) != EXT_OTA_PACKET_TYPE_RESPONSE ||
+		   len == 0u || len > sizeof(EXT_OTA_BOND_RESP))
+		{
+			EXT_OTA_Rx_Release(1u);
+			continue;
+		}
+		if(available < 9u + len)
+		{
+			break;
+		}
+		rec_crc = 0u;
+		for(uint8_t i = 0; i < 4u; ++i)
+		{
+			rec_crc |= (uint32_t)EXT_OTA_Rx_Peek(4u + len + i) << (8u * i);
+		}
+		EXT_OTA_Rx_Slice(4u, len, &status);
+		if(EXT_OTA_Rx_Peek(8u + len) != EXT_OTA_EOF ||
+		   rec_crc != CalcCRC_Update(CalcCRC_Update(0xFFFFFFFF, status.ptr[0], status.len[0]), status.ptr[1], status.len[1]))
+		{
+			EXT_OTA_Rx_Release(1u);
+			continue;
+		}
+		resp = EXT_OTA_Slice_Byte(&status, 0u);
+		EXT_OTA_Rx_Release(9u + len);
+		break;
+	}
+	ota_link = link;
+	return resp;
+}
+
+/*
+ * @brief Build the frame of the current step and send it down.
+ *        The image is read back from the slot, only once it has been written.
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Relay_Send(void)
+{
+	uint16_t len = 0u;
+
+	switch(relay_step)
+	{
+	case EXT_OTA_RELAY_START:
+	case EXT_OTA_RELAY_END:
+	{
+		EXT_OTA_COMMAND* cmd = (EXT_OTA_COMMAND*)relay_frame;
+		cmd->packet_type 	= EXT_OTA_PACKET_TYPE_CMD;
+		cmd->data_len 		= 1u;
+		cmd->cmd 			= (relay_step == EXT_OTA_RELAY_START) ? EXT_OTA_CMD_START : EXT_OTA_CMD_END;
+		cmd->crc 			= CalcCRC(&cmd->cmd, 1u);
+		len = sizeof(EXT_OTA_COMMAND);
+	}
+		break;
+
+	case EXT_OTA_RELAY_CMD:
+	{
+		EXT_OTA_RELAY_COMMAND* cmd = (EXT_OTA_RELAY_COMMAND*)relay_frame;
+		cmd->packet_type 	= EXT_OTA_PACKET_TYPE_CMD;
+		cmd->data_len 		= 2u;
+		cmd->cmd 			= EXT_OTA_CMD_RELAY;
+		cmd->hops 			= ota_relay_hops - 1u;
+		cmd->crc 			= CalcCRC(&cmd->cmd, 2u);
+		len = sizeof(EXT_OTA_RELAY_COMMAND);
+	}
+		break;
+
+	case EXT_OTA_RELAY_HEADER:
+	{
+		EXT_OTA_HEADER* header = (EXT_OTA_HEADER*)relay_frame;
+		memset(&header->meta_data, 0, sizeof(meta_info));
+		header->packet_type 			= EXT_OTA_PACKET_TYPE_HEADER;
+		header->data_len 				= sizeof(meta_info);
+		header->meta_data.packet_size 	= ota_fw_total_size;
+		header->meta_data.packet_crc 	= ota_fw_crc;
+		header->crc 					= CalcCRC((uint8_t*)&header->meta_data, sizeof(meta_info));
+		len = sizeof(EXT_OTA_HEADER);
+	}
+		break;
+
+	case EXT_OTA_RELAY_DATA:
+	{
+		uint32_t left = ota_fw_total_size - relay_offset;
+		uint32_t crc;
+
+		relay_chunk_len = (left < EXT_OTA_RELAY_CHUNK) ? (uint16_t)left : EXT_OTA_RELAY_CHUNK;
+		// Wait for a full chunk, or the end of the image
+		if(ota_fw_received_size < relay_offset + relay_chunk_len
+		   // and for the queued jobs to have it in the Flash
+		   || EXT_OTA_Flash_Pending())
+		{
+			return;
+		}
+		relay_frame[1] = EXT_OTA_PACKET_TYPE_DATA;
+		relay_frame[2] = (uint8_t)relay_chunk_len;
+		relay_frame[3] = (uint8_t)(relay_chunk_len >> 8);
+		EXT_OTA_Cache_Read(&relay_frame[4], relay_offset, relay_chunk_len);
+		crc = CalcCRC(&relay_frame[4], relay_chunk_len);
+		memcpy(&relay_frame[4u + relay_chunk_len], &crc, 4u);
+		len = relay_chunk_len + EXT_OTA_DATA_OVERHEAD;
+	}
+		break;
+
+	default:
+		return;
+	}
+
+	relay_frame[0] = EXT_OTA_SOF;
+	relay_frame[len - 1u] = EXT_OTA_EOF;
+	relay_frame_len = len;
+	relay_tick = HAL_GetTick();
+	relay_nacked = 0u;
+	relay_tx_busy = 1u;
+	if(HAL_UART_Transmit_DMA(relay_link->huart, relay_frame, len) != HAL_OK)
+	{
+		// Sent again on the response timeout
+		relay_tx_busy = 0u;
+	}
+	ota_relay_packets++;
+}
+
+/*
+ * @brief Serve the session with the next board: take its response, then send the next
+ *        frame or the same one again. One frame is in flight at a time.
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Relay_Pump(void)
+{
+	uint32_t timeout = EXT_OTA_INTER_FRAME_TIMEOUT;
+	uint8_t resp;
+
+	// The session down starts once the header has been received
+	if(ota_relay_hops == 0u || relay_pumping || relay_step == EXT_OTA_RELAY_DONE || relay_step == EXT_OTA_RELAY_FAILED ||
+	   (ota_state != EXT_OTA_STATE_DATA && ota_state != EXT_OTA_STATE_END))
+	{
+		return;
+	}
+	relay_pumping = 1u;
+
+	if(relay_frame_len != 0u)
+	{
+		resp = EXT_OTA_Relay_Resp();
+		if(resp == EXT_OTA_ACK)
+		{
+			relay_frame_len = 0u;
+			relay_retries = 0u;
+			switch(relay_step)
+			{
+			case EXT_OTA_RELAY_START:
+				relay_step = (ota_relay_hops > 1u) ? EXT_OTA_RELAY_CMD : EXT_OTA_RELAY_HEADER;
+				break;
+			case EXT_OTA_RELAY_CMD:
+				relay_step = EXT_OTA_RELAY_HEADER;
+				break;
+			case EXT_OTA_RELAY_HEADER:
+				relay_step = EXT_OTA_RELAY_DATA;
+				break;
+			case EXT_OTA_RELAY_DATA:
+				relay_offset += relay_chunk_len;
+				if(relay_offset >= ota_fw_total_size)
+				{
+					relay_step = EXT_OTA_RELAY_END;
+				}
+				break;
+			default:
+				relay_step = EXT_OTA_RELAY_DONE;
+				break;
+			}
+		}
+		else
+		{
+			if(resp == EXT_OTA_NACK)
+			{
+				// The next board drains its link before it takes the frame again
+				relay_nacked = 1u;
+				relay_tick = HAL_GetTick();
+			}
+			// The END is acknowledged once the boards further down have acknowledged theirs
+			if(relay_step == EXT_OTA_RELAY_END)
+			{
+				timeout *= ota_relay_hops;
+			}
+			if(relay_tx_busy == 0u &&
+			   ((HAL_GetTick() - relay_tick) > timeout ||
+				(relay_nacked && (HAL_GetTick() - relay_tick) > 2u * EXT_OTA_RETRY_IDLE_TIME)))
+			{
+				if(++relay_retries > EXT_OTA_MAX_RETRIES)
+				{
+					relay_step = EXT_OTA_RELAY_FAILED;
+				}
+				else
+				{
+					relay_frame_len = 0u;
+					ota_relay_resent++;
+				}
+			}
+		}
+	}
+	if(relay_frame_len == 0u && relay_step != EXT_OTA_RELAY_DONE && relay_step != EXT_OTA_RELAY_FAILED)
+	{
+		EXT_OTA_Relay_Send();
+	}
+
+	relay_pumping = 0u;
+}
+
+/*
+ * @brief Serve the next board until it has acknowledged the END of its session.
+ *        The END is acknowledged for the whole chain, the image is kept only if it made it down.
+ * @param none
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Relay_Finish(void)
+{
+	while(relay_step != EXT_OTA_RELAY_DONE && relay_step != EXT_OTA_RELAY_FAILED)
+	{
+		EXT_OTA_Relay_Pump();
+	}
+	if(relay_step != EXT_OTA_RELAY_DONE)
+	{
+		printf("Error: relay to the next board failed!\r\n");
+		return HAL_ERROR;
+	}
+	return HAL_OK;
+}
+
+/*
+ * @brief Print the statistics of the relay
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Relay_Report(void)
+{
+	printf("Relay: %u hops, %lu packets sent down, %lu sent again\r\n",
+		   ota_relay_hops, ota_relay_packets, ota_relay_resent);
+}
+
+/*
+ * @brief Check if a UART is the link to the next board
+ * @param huart: UART handle
+ * @retval uint8_t: 1 - relay link in use
+ */
+static uint8_t EXT_OTA_Relay_Owns(UART_HandleTypeDef* huart)
+{
+	return (ota_relay_hops != 0u && relay_link->huart == huart) ? 1u : 0u;
+}
+
+/*
+ * @brief The session is over, so is the one with the next board
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Relay_Close(void)
+{
+	if(ota_relay_hops != 0u)
+	{
+		EXT_OTA_Relay_Stop();
+	}
+}
+
+/*
+ * @brief Close the session with the next board, which is aborted if it is not complete
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Relay_Stop(void)
+{
+	uint32_t tick_start = HAL_GetTick();
+
+	while(relay_tx_busy && (HAL_GetTick() - tick_start) < 100u)
+	{
+	}
+	if(relay_step != EXT_OTA_RELAY_DONE)
+	{
+		EXT_OTA_COMMAND abort_cmd =
+		{
+			.sof 			= EXT_OTA_SOF,
+			.packet_type 	= EXT_OTA_PACKET_TYPE_CMD,
+			.data_len 		= 1,
+			.cmd 			= EXT_OTA_CMD_ABORT,
+			.eof			= EXT_OTA_EOF
+		};
+		abort_cmd.crc = CalcCRC(&abort_cmd.cmd, 1);
+		HAL_UART_AbortTransmit(relay_link->huart);
+		relay_tx_busy = 0u;
+		HAL_UART_Transmit(relay_link->huart, (uint8_t*)&abort_cmd, sizeof(EXT_OTA_COMMAND), 100);
+	}
+	EXT_OTA_Rx_Stop(relay_link);
+	ota_relay_hops = 0u;
+	relay_step = EXT_OTA_RELAY_OFF;
+}
+
+/******************************** General Function Code *****************************/
+/*
+ * @brief TX complete on a UART link: the relay sends its frames outside the response queue of the link
+ * @param link: OTA link
+ * @retval uint8_t: 1 - the frame of the relay has been sent, 0 - the completion is for the response queue
+ */
+uint8_t EXT_OTA_Relay_Tx_Cplt(EXT_OTA_LINK* link)
+{
+	if(link == relay_link && relay_tx_busy)
+	{
+		relay_tx_busy = 0u;
+		return 1u;
+	}
+	return 0u;
+}
+
+#endif
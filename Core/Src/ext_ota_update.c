@@ -5,122 +5,822 @@
  *      Author: 84935
  */
 
-#include "ext_ota_update.h"
+#include "ext_ota_mode.h"
 #include "main.h"
 
 #include <stdio.h>
 #include <string.h>
 
-// Receive buffer
-static uint8_t rcv_buffer[EXT_OTA_PACKET_MAX_SIZE];
+// Links the OTA session can be opened on
+EXT_OTA_LINK ota_links[EXT_OTA_LINK_COUNT] =
+{
+	{ .name = "USART1", .type = EXT_OTA_LINK_UART, .ops = &ota_link_uart_ops, .huart = &huart1, .flow_control = EXT_OTA_FLOW_CONTROL_ENABLE, .autobaud = EXT_OTA_AUTOBAUD_ENABLE,
+	  .multidrop = EXT_OTA_MULTIDROP_ENABLE },
+#if EXT_OTA_LINK_USART3_ENABLE
+	{ .name = "USART3", .type = EXT_OTA_LINK_UART, .ops = &ota_link_uart_ops, .huart = &huart3 },
+#endif
+#if EXT_OTA_LINK_USB_ENABLE
+	{ .name = "USB", .type = EXT_OTA_LINK_USB, .ops = &ota_link_usb_ops, .huart = NULL },
+#endif
+#if EXT_OTA_LINK_SPI_ENABLE
+	{ .name = "SPI1", .type = EXT_OTA_LINK_SPI, .ops = &ota_link_spi_ops, .huart = NULL },
+#endif
+#if EXT_OTA_LINK_CAN_ENABLE
+	{ .name = "CAN", .type = EXT_OTA_LINK_CAN, .ops = &ota_link_can_ops, .huart = NULL },
+#endif
+#if EXT_OTA_LINK_LOOPBACK_ENABLE
+	{ .name = "LOOPBACK", .type = EXT_OTA_LINK_LOOPBACK, .ops = &ota_link_loopback_ops, .huart = NULL },
+#endif
+};
+// Link of the current session, and whether a session is open on it
+EXT_OTA_LINK* ota_link = &ota_links[0];
+static uint8_t ota_session_open;
+#if EXT_OTA_RAM_EXEC_ENABLE
+// Code executed from RAM, placed by the linker script
+extern uint8_t _sramfunc[];
+extern uint8_t _eramfunc[];
+#endif
+#if EXT_OTA_RAM_VECTORS_ENABLE
+// Vector table of the session: the 16 system exceptions and the interrupts, aligned on its size rounded up to a power of two
+#define EXT_OTA_VECTOR_COUNT	(16u + (uint32_t)USBWakeUp_IRQn + 1u)
+static uint32_t ota_ram_vectors[EXT_OTA_VECTOR_COUNT] __attribute__((aligned(256)));
+static uint32_t ota_flash_vtor;
+#endif
+// Status of the last reception, a damaged frame (HAL_ERROR) or a silent link (HAL_TIMEOUT)
+HAL_StatusTypeDef rx_status;
+// View on the last received packet
+EXT_OTA_PACKET_VIEW rcv_packet;
+// Linear copy of the last control frame (CMD/HEADER)
+static uint8_t ctrl_frame[sizeof(EXT_OTA_HEADER)];
 
 // OTA state
-static EXT_OTA_STATE ota_state = EXT_OTA_STATE_IDLE;
+EXT_OTA_STATE ota_state = EXT_OTA_STATE_IDLE;
 
 // Update firmware total size
-static uint32_t ota_fw_total_size;
+uint32_t ota_fw_total_size;
 // Update firmware image 's CRC32
-static uint32_t ota_fw_crc;
+uint32_t ota_fw_crc;
 // Firmware size that we have received
-static uint32_t ota_fw_received_size;
+uint32_t ota_fw_received_size;
 // Slot number to write to the received firmware
-static uint8_t slot_num_to_write_fw;
+uint8_t slot_num_to_write_fw;
+// Baud rate requested by the host, applied after the ACK has been sent
+static uint32_t ota_pending_baudrate;
+// Tick at which the OTA session started, used for the throughput report
+static uint32_t ota_start_tick;
+// Framing of the received packets, and the framing requested by the host
+static uint8_t ota_framing;
+static uint8_t ota_pending_framing;
+// Link statistics: bytes of the accepted frames, rejected frames and bytes skipped to resync
+static uint32_t ota_rx_frame_bytes;
+static uint32_t ota_rx_bad_frames;
+static uint32_t ota_rx_skipped_bytes;
+// CPU cycles spent sending responses, and number of responses sent
+static uint32_t ota_resp_cycles;
+static uint32_t ota_resp_sent;
+// Bytes of the slot physically programmed, the erased ones left out
+uint32_t ota_flash_programmed;
+// Number of packets accepted in the session
+uint32_t ota_packet_count;
+// Compact response mode requested by the host, applied after the ACK has been sent
+static uint8_t ota_pending_compact_resp;
+// Responses are sent in the compact format
+static uint8_t ota_compact_resp;
+// Only every Nth DATA packet is acknowledged
+uint8_t ota_ack_interval;
+// Largest DATA payload accepted, and payload size advised to the host (0 - no advice)
+uint16_t ota_payload_max;
+uint16_t ota_payload_advice;
+// Good DATA packets in a row, and changes of the advised payload size
+static uint8_t ota_adapt_good_run;
+static uint32_t ota_adapt_changes;
+// Session mode the host has selected, NULL for the in-order push of the image
+const EXT_OTA_MODE_OPS* ota_mode;
+// Session modes compiled in, offered the packets the core does not handle
+static const EXT_OTA_MODE_OPS* const ota_modes[] =
+{
+	&ota_mode_pull_ops,
+#if EXT_OTA_FEC_ENABLE
+	&ota_mode_fec_ops,
+#endif
+#if EXT_OTA_BOND_ENABLE
+	&ota_mode_bond_ops,
+#endif
+#if EXT_OTA_MULTIDROP_ENABLE
+	&ota_mode_md_ops,
+#endif
+#if EXT_OTA_RELAY_ENABLE
+	&ota_mode_relay_ops,
+#endif
+};
+#if EXT_OTA_MULTIDROP_ENABLE
+// Frames for the other nodes of the bus skipped, broadcast packets not used
+static uint32_t ota_md_foreign;
+static uint32_t ota_md_ignored;
+#endif
+#if EXT_OTA_FLOW_CONTROL_ENABLE
+// Streaming mode requested by the host, applied after the ACK has been sent
+uint8_t ota_pending_stream;
+// DATA packets are streamed under RTS/CTS flow control without per-packet ACK
+static uint8_t ota_streaming;
+#endif
+#if EXT_OTA_AUTOBAUD_ENABLE
+// Timer used to measure the bit time of the first SOF byte
+static TIM_HandleTypeDef htim_autobaud;
+// The SOF byte of the first frame has been consumed by the autobaud stage
+static uint8_t ota_autobaud_sof;
+// Standard baud rates the measured rate is snapped to
+static const uint32_t autobaud_rates[] =
+{
+	9600u, 19200u, 38400u, 57600u, 115200u, 230400u, 460800u, 921600u, 1000000u, 1500000u, 2000000u, 3000000u
+};
+#endif
 // Configuration
 EXT_GNRL_CONFIG *cfg_flash = (EXT_GNRL_CONFIG*) (EXT_CONFIG_FLASH_ADD);
+// CRC-32 (MPEG-2) lookup table, in RAM along with the receive path
+static const uint32_t crc_table[0x100] EXT_OTA_RAMDATA = {
+  0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9, 0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005, 0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61, 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD,
+  0x4C11DB70, 0x48D0C6C7, 0x4593E01E, 0x4152FDA9, 0x5F15ADAC, 0x5BD4B01B, 0x569796C2, 0x52568B75, 0x6A1936C8, 0x6ED82B7F, 0x639B0DA6, 0x675A1011, 0x791D4014, 0x7DDC5DA3, 0x709F7B7A, 0x745E66CD,
+  0x9823B6E0, 0x9CE2AB57, 0x91A18D8E, 0x95609039, 0x8B27C03C, 0x8FE6DD8B, 0x82A5FB52, 0x8664E6E5, 0xBE2B5B58, 0xBAEA46EF, 0xB7A96036, 0xB3687D81, 0xAD2F2D84, 0xA9EE3033, 0xA4AD16EA, 0xA06C0B5D,
+  0xD4326D90, 0xD0F37027, 0xDDB056FE, 0xD9714B49, 0xC7361B4C, 0xC3F706FB, 0xCEB42022, 0xCA753D95, 0xF23A8028, 0xF6FB9D9F, 0xFBB8BB46, 0xFF79A6F1, 0xE13EF6F4, 0xE5FFEB43, 0xE8BCCD9A, 0xEC7DD02D,
+  0x34867077, 0x30476DC0, 0x3D044B19, 0x39C556AE, 0x278206AB, 0x23431B1C, 0x2E003DC5, 0x2AC12072, 0x128E9DCF, 0x164F8078, 0x1B0CA6A1, 0x1FCDBB16, 0x018AEB13, 0x054BF6A4, 0x0808D07D, 0x0CC9CDCA,
+  0x7897AB07, 0x7C56B6B0, 0x71159069, 0x75D48DDE, 0x6B93DDDB, 0x6F52C06C, 0x6211E6B5, 0x66D0FB02, 0x5E9F46BF, 0x5A5E5B08, 0x571D7DD1, 0x53DC6066, 0x4D9B3063, 0x495A2DD4, 0x44190B0D, 0x40D816BA,
+  0xACA5C697, 0xA864DB20, 0xA527FDF9, 0xA1E6E04E, 0xBFA1B04B, 0xBB60ADFC, 0xB6238B25, 0xB2E29692, 0x8AAD2B2F, 0x8E6C3698, 0x832F1041, 0x87EE0DF6, 0x99A95DF3, 0x9D684044, 0x902B669D, 0x94EA7B2A,
+  0xE0B41DE7, 0xE4750050, 0xE9362689, 0xEDF73B3E, 0xF3B06B3B, 0xF771768C, 0xFA325055, 0xFEF34DE2, 0xC6BCF05F, 0xC27DEDE8, 0xCF3ECB31, 0xCBFFD686, 0xD5B88683, 0xD1799B34, 0xDC3ABDED, 0xD8FBA05A,
+  0x690CE0EE, 0x6DCDFD59, 0x608EDB80, 0x644FC637, 0x7A089632, 0x7EC98B85, 0x738AAD5C, 0x774BB0EB, 0x4F040D56, 0x4BC510E1, 0x46863638, 0x42472B8F, 0x5C007B8A, 0x58C1663D, 0x558240E4, 0x51435D53,
+  0x251D3B9E, 0x21DC2629, 0x2C9F00F0, 0x285E1D47, 0x36194D42, 0x32D850F5, 0x3F9B762C, 0x3B5A6B9B, 0x0315D626, 0x07D4CB91, 0x0A97ED48, 0x0E56F0FF, 0x1011A0FA, 0x14D0BD4D, 0x19939B94, 0x1D528623,
+  0xF12F560E, 0xF5EE4BB9, 0xF8AD6D60, 0xFC6C70D7, 0xE22B20D2, 0xE6EA3D65, 0xEBA91BBC, 0xEF68060B, 0xD727BBB6, 0xD3E6A601, 0xDEA580D8, 0xDA649D6F, 0xC423CD6A, 0xC0E2D0DD, 0xCDA1F604, 0xC960EBB3,
+  0xBD3E8D7E, 0xB9FF90C9, 0xB4BCB610, 0xB07DABA7, 0xAE3AFBA2, 0xAAFBE615, 0xA7B8C0CC, 0xA379DD7B, 0x9B3660C6, 0x9FF77D71, 0x92B45BA8, 0x9675461F, 0x8832161A, 0x8CF30BAD, 0x81B02D74, 0x857130C3,
+  0x5D8A9099, 0x594B8D2E, 0x5408ABF7, 0x50C9B640, 0x4E8EE645, 0x4A4FFBF2, 0x470CDD2B, 0x43CDC09C, 0x7B827D21, 0x7F436096, 0x7200464F, 0x76C15BF8, 0x68860BFD, 0x6C47164A, 0x61043093, 0x65C52D24,
+  0x119B4BE9, 0x155A565E, 0x18197087, 0x1CD86D30, 0x029F3D35, 0x065E2082, 0x0B1D065B, 0x0FDC1BEC, 0x3793A651, 0x3352BBE6, 0x3E119D3F, 0x3AD08088, 0x2497D08D, 0x2056CD3A, 0x2D15EBE3, 0x29D4F654,
+  0xC5A92679, 0xC1683BCE, 0xCC2B1D17, 0xC8EA00A0, 0xD6AD50A5, 0xD26C4D12, 0xDF2F6BCB, 0xDBEE767C, 0xE3A1CBC1, 0xE760D676, 0xEA23F0AF, 0xEEE2ED18, 0xF0A5BD1D, 0xF464A0AA, 0xF9278673, 0xFDE69BC4,
+  0x89B8FD09, 0x8D79E0BE, 0x803AC667, 0x84FBDBD0, 0x9ABC8BD5, 0x9E7D9662, 0x933EB0BB, 0x97FFAD0C, 0xAFB010B1, 0xAB710D06, 0xA6322BDF, 0xA2F33668, 0xBCB4666D, 0xB8757BDA, 0xB5365D03, 0xB1F740B4,
+};
 
 /********************************* Private Functions Prototypes *****************************************/
 
-static uint16_t EXT_OTA_Receive_Chunk(uint8_t* buffer, uint16_t max_len);
-static EXT_OTA_EX EXT_OTA_Process_Data(uint8_t* buffer, uint16_t len);
-static void EXT_OTA_Send_Resp(uint8_t resp_type);
-static HAL_StatusTypeDef EXT_OTA_Slot_Data_Write(uint8_t* data, uint8_t slot_num, uint16_t data_len, uint8_t is_first_block);
+static void EXT_OTA_Rx_Resync(uint32_t from);
+static uint8_t EXT_OTA_Header_Check(uint8_t packet_type, uint16_t data_len);
+static uint16_t EXT_OTA_Cobs_Decode(uint32_t enc_len);
+static HAL_StatusTypeDef EXT_OTA_Check_Frame(EXT_OTA_PACKET_VIEW* packet, uint32_t offset, uint16_t hdr_len, uint8_t addr_len);
+static uint16_t EXT_OTA_Receive_Frame(EXT_OTA_PACKET_VIEW* packet, uint16_t max_len, uint32_t timeout);
+static uint16_t EXT_OTA_Receive_Cobs(EXT_OTA_PACKET_VIEW* packet, uint16_t max_len, uint32_t timeout);
+static uint16_t EXT_OTA_Listen(void);
+static uint8_t EXT_OTA_Is_Offset_Mode(void);
+static uint8_t EXT_OTA_Mode_Packet(EXT_OTA_PACKET_VIEW* packet, EXT_OTA_EX* ret);
+static uint16_t EXT_OTA_Data_Len_Max(void);
+static EXT_OTA_EX EXT_OTA_Process_Data(EXT_OTA_PACKET_VIEW* packet);
+#if EXT_OTA_TX_DMA_ENABLE
+static void EXT_OTA_Start_Next_Resp(EXT_OTA_LINK* link);
+static void EXT_OTA_Drop_Resp(void);
+#endif
 static uint8_t EXT_OTA_Get_Available_Slot_Number(void);
-static HAL_StatusTypeDef EXT_OTA_Write_Config(EXT_GNRL_CONFIG* cfg);
 static HAL_StatusTypeDef EXT_OTA_App_Data_Write(uint8_t* data, uint32_t data_len);
+static uint8_t EXT_OTA_Is_Erased(uint32_t address, uint32_t len);
+static HAL_StatusTypeDef EXT_OTA_Set_Baudrate(uint32_t baudrate);
+static void EXT_OTA_Switch_Baudrate(uint32_t baudrate);
+#if EXT_OTA_AUTOBAUD_ENABLE
+static HAL_StatusTypeDef EXT_OTA_Autobaud(uint32_t timeout);
+static HAL_StatusTypeDef EXT_OTA_Autobaud_Init(void);
+#endif
+static HAL_StatusTypeDef EXT_OTA_Set_Flow_Control(uint32_t hw_flow_ctl);
+static uint8_t EXT_OTA_Is_Ack_Due(void);
+static void EXT_OTA_Adapt_Payload(uint8_t frame_ok);
 
 /******************************** Private Functions Code ***********************************************/
 
 /*
- * @brief Receive a chunk of data
- * @param buffer: buffer to store the received data
- * @param max_len: maximum length of data to be received
- * @retval uint16_t
+ * @brief Find the link served by a UART
+ * @param huart: UART handle
+ * @retval EXT_OTA_LINK*: NULL if the UART is not an OTA link
  */
-static uint16_t EXT_OTA_Receive_Chunk(uint8_t* buffer, uint16_t max_len)
+EXT_OTA_LINK* EXT_OTA_Link_Find(UART_HandleTypeDef* huart)
 {
-	HAL_StatusTypeDef ret;
+	for(uint8_t i = 0; i < EXT_OTA_LINK_COUNT; ++i)
+	{
+		if(ota_links[i].huart == huart)
+		{
+			return &ota_links[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * @brief Find the first link of a type
+ * @param type: link type
+ * @retval EXT_OTA_LINK*: NULL if there is none
+ */
+EXT_OTA_LINK* EXT_OTA_Link_Of_Type(EXT_OTA_LINK_TYPE type)
+{
+	for(uint8_t i = 0; i < EXT_OTA_LINK_COUNT; ++i)
+	{
+		if(ota_links[i].type == type)
+		{
+			return &ota_links[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * @brief Start the reception of a link into an empty receive ring
+ * @param link: OTA link
+ * @retval none
+ */
+void EXT_OTA_Rx_Start(EXT_OTA_LINK* link)
+{
+	link->rx_head 		= 0u;
+	link->rx_tail 		= 0u;
+#if EXT_OTA_FLASH_ASYNC_ENABLE
+	link->rx_keep 		= 0u;
+#endif
+	link->rx_dma_len 	= 0u;
+	link->rx_error 		= 0u;
+
+	if(link->ops->start != NULL)
+	{
+		link->ops->start(link);
+	}
+	__disable_irq();
+	EXT_OTA_Rx_Arm(link);
+	__enable_irq();
+}
+
+/*
+ * @brief Stop the reception of a link
+ * @param link: OTA link
+ * @retval none
+ */
+void EXT_OTA_Rx_Stop(EXT_OTA_LINK* link)
+{
+	if(link->ops->stop != NULL)
+	{
+		link->ops->stop(link);
+	}
+	link->rx_dma_len = 0u;
+}
+
+/*
+ * @brief Let the link fill the next free region of the ring.
+ *        Must be called with the link interrupts masked.
+ * @param link: OTA link
+ * @retval none
+ */
+EXT_OTA_RAMFUNC void EXT_OTA_Rx_Arm(EXT_OTA_LINK* link)
+{
+	if(link->ops->arm != NULL)
+	{
+		link->ops->arm(link);
+	}
+}
+
+/*
+ * @brief Get the number of received bytes not consumed yet
+ * @param none
+ * @retval uint32_t
+ */
+EXT_OTA_RAMFUNC uint32_t EXT_OTA_Rx_Available(void)
+{
+	uint32_t head;
+
+	__disable_irq();
+	head = ota_link->rx_head;
+	if(ota_link->rx_dma_len != 0u && ota_link->ops->rx_pending != NULL)
+	{
+		head += ota_link->ops->rx_pending(ota_link);
+	}
+	__enable_irq();
+
+	return head - ota_link->rx_tail;
+}
+
+/*
+ * @brief Wait until a number of bytes are available in the receive ring
+ * @param count: number of bytes
+ * @param timeout: time allowed without any new byte in ms
+ * @retval HAL_StatusTypeDef
+ */
+HAL_StatusTypeDef EXT_OTA_Rx_Wait(uint32_t count, uint32_t timeout)
+{
+	uint32_t tick_start = HAL_GetTick();
+	uint32_t available = EXT_OTA_Rx_Available();
+	uint32_t last = available;
+
+	while(available < count)
+	{
+		if(ota_link->rx_error)
+		{
+			return HAL_ERROR;
+		}
+		// The session mode is served while the host is waited for
+		if(ota_mode != NULL && ota_mode->poll != NULL)
+		{
+			ota_mode->poll();
+		}
+		// The ACKs of the payloads programmed meanwhile go out, an error is caught by the session
+		(void)EXT_OTA_Flash_Poll();
+		available = EXT_OTA_Rx_Available();
+		if(available != last)
+		{
+			last = available;
+			tick_start = HAL_GetTick();
+		}
+		else if((HAL_GetTick() - tick_start) > timeout)
+		{
+			return HAL_TIMEOUT;
+		}
+	}
+	return HAL_OK;
+}
+
+/*
+ * @brief Read a byte of the receive ring without consuming it
+ * @param offset: offset from the oldest unconsumed byte
+ * @retval uint8_t
+ */
+EXT_OTA_RAMFUNC uint8_t EXT_OTA_Rx_Peek(uint32_t offset)
+{
+	return ota_link->rx_ring[(ota_link->rx_tail + offset) % EXT_OTA_RX_RING_SIZE];
+}
+
+/*
+ * @brief Describe a region of the receive ring without copying it
+ * @param offset: offset from the oldest unconsumed byte
+ * @param len: length of the region
+ * @param slice: slice to fill
+ * @retval none
+ */
+EXT_OTA_RAMFUNC void EXT_OTA_Rx_Slice(uint32_t offset, uint16_t len, EXT_OTA_SLICE* slice)
+{
+	uint32_t idx = (ota_link->rx_tail + offset) % EXT_OTA_RX_RING_SIZE;
+	uint32_t first = EXT_OTA_RX_RING_SIZE - idx;
+
+	if(first > len)
+	{
+		first = len;
+	}
+	slice->ptr[0] = &ota_link->rx_ring[idx];
+	slice->len[0] = (uint16_t)first;
+	slice->ptr[1] = ota_link->rx_ring;
+	slice->len[1] = (uint16_t)(len - first);
+}
+
+/*
+ * @brief Give consumed bytes back to the receive ring
+ * @param count: number of bytes
+ * @retval none
+ */
+EXT_OTA_RAMFUNC void EXT_OTA_Rx_Release(uint32_t count)
+{
+	__disable_irq();
+	ota_link->rx_tail += count;
+#if EXT_OTA_FLASH_ASYNC_ENABLE
+	ota_link->rx_keep = EXT_OTA_Flash_Keep();
+#endif
+	EXT_OTA_Rx_Arm(ota_link);
+	__enable_irq();
+}
+
+/*
+ * @brief Drop bytes from the receive ring up to the next SOF candidate
+ * @param from: offset of the first byte that may be a SOF
+ * @retval none
+ */
+static void EXT_OTA_Rx_Resync(uint32_t from)
+{
+	uint32_t available = EXT_OTA_Rx_Available();
+	uint32_t skip = from;
+
+	while(skip < available && EXT_OTA_Rx_Peek(skip) != EXT_OTA_SOF)
+	{
+		++skip;
+	}
+	if(skip > available)
+	{
+		skip = available;
+	}
+	ota_rx_skipped_bytes += skip;
+	EXT_OTA_Rx_Release(skip);
+}
+
+/*
+ * @brief Discard the bytes received until the link has been idle for a while.
+ *        The host stops sending once it sees the NACK, frames already in flight are dropped.
+ * @param idle_time: time without any new byte in ms
+ * @retval none
+ */
+void EXT_OTA_Rx_Drain(uint32_t idle_time)
+{
+	uint32_t tick_start = HAL_GetTick();
+	uint32_t available;
+
+	// The NACK must be out before the host can react to it
+	EXT_OTA_Flush_Resp();
+	do
+	{
+		available = EXT_OTA_Rx_Available();
+		ota_rx_skipped_bytes += available;
+		EXT_OTA_Rx_Release(available);
+		ota_link->rx_error = 0u;
+	}
+	while(EXT_OTA_Rx_Wait(1u, idle_time) != HAL_TIMEOUT &&
+		  (HAL_GetTick() - tick_start) < EXT_OTA_INTER_FRAME_TIMEOUT);
+}
+
+/*
+ * @brief Calculate the CRC-8 header check of a frame
+ * @param packet_type: packet type byte as sent, with EXT_OTA_PACKET_HDR_CHECK
+ * @param data_len: data length of the frame
+ * @retval uint8_t
+ */
+static uint8_t EXT_OTA_Header_Check(uint8_t packet_type, uint16_t data_len)
+{
+	uint8_t hdr[3] = { packet_type, (uint8_t)data_len, (uint8_t)(data_len >> 8) };
+	uint8_t check = 0u;
+
+	for(uint8_t i = 0; i < sizeof(hdr); ++i)
+	{
+		check ^= hdr[i];
+		for(uint8_t bit = 0; bit < 8u; ++bit)
+		{
+			check = (check & 0x80u) ? (uint8_t)((check << 1) ^ 0x07u) : (uint8_t)(check << 1);
+		}
+	}
+	return check;
+}
+
+/*
+ * @brief Decode a COBS encoded frame in place at the start of the receive ring.
+ *        The decoded frame never overtakes the encoded bytes still to be read.
+ * @param enc_len: length of the encoded frame, without the delimiter
+ * @retval uint16_t: length of the decoded frame, 0 on a malformed frame
+ */
+static uint16_t EXT_OTA_Cobs_Decode(uint32_t enc_len)
+{
+	uint32_t rd = 0u;
+	uint32_t wr = 0u;
+
+	while(rd < enc_len)
+	{
+		uint8_t code = EXT_OTA_Rx_Peek(rd++);
+
+		if(code == EXT_OTA_COBS_DELIMITER || rd + code - 1u > enc_len)
+		{
+			return 0u;
+		}
+		for(uint8_t i = 1u; i < code; ++i)
+		{
+			ota_link->rx_ring[(ota_link->rx_tail + wr++) % EXT_OTA_RX_RING_SIZE] = EXT_OTA_Rx_Peek(rd++);
+		}
+		// A full block is not followed by a zero, neither is the last block
+		if(code != 0xFFu && rd < enc_len)
+		{
+			ota_link->rx_ring[(ota_link->rx_tail + wr++) % EXT_OTA_RX_RING_SIZE] = EXT_OTA_COBS_DELIMITER;
+		}
+	}
+	return (uint16_t)wr;
+}
+
+/*
+ * @brief Validate the CRC of a frame held in the receive ring and describe it
+ * @param packet: view on the packet, packet_type and data_len already set
+ * @param offset: offset of the packet type byte in the ring
+ * @param hdr_len: bytes between the packet type and the data, included
+ * @param addr_len: bytes at the end of the header covered by the CRC (node address)
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Check_Frame(EXT_OTA_PACKET_VIEW* packet, uint32_t offset, uint16_t hdr_len, uint8_t addr_len)
+{
+	uint16_t data_len = packet->data_len;
+	uint32_t cal_data_crc;
+	uint32_t rec_data_crc = 0u;
+
+	for(uint8_t i = 0; i < 4u; ++i)
+	{
+		rec_data_crc |= (uint32_t)EXT_OTA_Rx_Peek(offset + hdr_len + data_len + i) << (8u * i);
+	}
+
+	// Validate the CRC on the payload in place
+	EXT_OTA_Rx_Slice(offset + hdr_len - addr_len, data_len + addr_len, &packet->payload);
+	// The CRC of a payload programmed on arrival has been computed on the way
+	if(EXT_OTA_Cut_Crc(data_len, &cal_data_crc) == 0u)
+	{
+		cal_data_crc = CalcCRC_Update(0xFFFFFFFF, packet->payload.ptr[0], packet->payload.len[0]);
+		cal_data_crc = CalcCRC_Update(cal_data_crc, packet->payload.ptr[1], packet->payload.len[1]);
+	}
+	if(rec_data_crc != cal_data_crc)
+	{
+		printf("CRC mismatch [Cal CRC = 0x%08lX] [Rec CRC = 0x%08lX]\r\n", cal_data_crc, rec_data_crc);
+		return HAL_ERROR;
+	}
+	if(addr_len != 0u)
+	{
+		EXT_OTA_Slice_Skip(&packet->payload, addr_len);
+	}
+
+	// Control frames are small, give them a linear copy (without header check) for the packed struct casts
+	if(EXT_OTA_IS_CTRL_PACKET(packet->packet_type))
+	{
+		ctrl_frame[0] = EXT_OTA_SOF;
+		ctrl_frame[1] = packet->packet_type;
+		ctrl_frame[2] = (uint8_t)data_len;
+		ctrl_frame[3] = (uint8_t)(data_len >> 8);
+		for(uint16_t i = 0u; i < data_len + 4u; ++i)
+		{
+			ctrl_frame[4u + i] = EXT_OTA_Rx_Peek(offset + hdr_len + i);
+		}
+		ctrl_frame[8u + data_len] = EXT_OTA_EOF;
+		packet->ctrl = ctrl_frame;
+	}
+	return HAL_OK;
+}
+
+/*
+ * @brief Receive a packet in place in the receive ring.
+ *        The frame stays in the ring until the caller releases packet->frame_len bytes.
+ * @param packet: view on the received packet
+ * @param max_len: maximum length of the packet
+ * @param timeout: time allowed for the first byte of the frame in ms, the next ones
+ *                 are allowed EXT_OTA_INTER_BYTE_TIMEOUT
+ * @retval uint16_t: length of the packet, 0 on error
+ */
+uint16_t EXT_OTA_Receive_Chunk(EXT_OTA_PACKET_VIEW* packet, uint16_t max_len, uint32_t timeout)
+{
+#if EXT_OTA_MULTIDROP_ENABLE
+	uint16_t len;
+
+	// The frames sent to the other nodes of the bus and their responses are skipped
+	while(1)
+	{
+		len = EXT_OTA_Receive_Frame(packet, max_len, timeout);
+		if(len == 0u || ota_link->multidrop == 0u ||
+		   (packet->packet_type != EXT_OTA_PACKET_TYPE_RESPONSE &&
+			(packet->address == EXT_OTA_NODE_ADDRESS || packet->address == EXT_OTA_ADDR_BROADCAST)))
+		{
+			return len;
+		}
+		EXT_OTA_Rx_Release(packet->frame_len);
+		ota_md_foreign++;
+	}
+#else
+	return EXT_OTA_Receive_Frame(packet, max_len, timeout);
+#endif
+}
+
+/*
+ * @brief Receive a frame in place in the receive ring, in the framing of the session
+ * @param packet: view on the received packet
+ * @param max_len: maximum length of the packet
+ * @param timeout: time allowed for the first byte of the frame in ms, the next ones
+ *                 are allowed EXT_OTA_INTER_BYTE_TIMEOUT
+ * @retval uint16_t: length of the packet, 0 on error
+ */
+static uint16_t EXT_OTA_Receive_Frame(EXT_OTA_PACKET_VIEW* packet, uint16_t max_len, uint32_t timeout)
+{
+	HAL_StatusTypeDef ret = HAL_OK;
 	uint16_t idx = 0u;
+	uint16_t sof_len = 1u;
+	uint16_t hdr_len = 3u;
+	uint8_t addr_len = 0u;
+	uint8_t packet_type;
 	uint16_t data_len;
-	uint32_t cal_data_crc = 0u;
-	uint32_t rec_data_crc = 0u;
+
+	EXT_OTA_Cut_Reset();
+	if(ota_framing == EXT_OTA_FRAMING_COBS)
+	{
+		return EXT_OTA_Receive_Cobs(packet, max_len, timeout);
+	}
+
+	packet->frame_len = 0u;
+	packet->ctrl = NULL;
+#if EXT_OTA_MULTIDROP_ENABLE
+	packet->address = EXT_OTA_NODE_ADDRESS;
+#endif
+	ota_link->rx_error = 0u;
 
 	do
 	{
-		// Receive the SOF byte
-		ret = HAL_UART_Receive(&huart1, &buffer[idx], 1, HAL_MAX_DELAY);
+#if EXT_OTA_AUTOBAUD_ENABLE
+		// The SOF byte of the first frame has already been measured by the autobaud stage
+		if(ota_autobaud_sof)
+		{
+			ota_autobaud_sof = 0u;
+			sof_len = 0u;
+		}
+		else
+#endif
+		{
+			// Receive the SOF byte
+			ret = EXT_OTA_Rx_Wait(1u, timeout);
+			if(ret != HAL_OK)
+			{
+				break;
+			}
+			// Check if the received byte is the SOF
+			if(EXT_OTA_Rx_Peek(0u) != EXT_OTA_SOF)
+			{
+				ret = HAL_ERROR;
+				break;
+			}
+		}
+		// Receive the packet type and the data length of the packet
+		ret = EXT_OTA_Rx_Wait(sof_len + 3u, EXT_OTA_INTER_BYTE_TIMEOUT);
 		if(ret != HAL_OK)
 		{
 			break;
 		}
-		// Check if the received byte is the SOF
-		if(buffer[idx++] != EXT_OTA_SOF)
+		packet_type = EXT_OTA_Rx_Peek(sof_len);
+		data_len = EXT_OTA_Rx_Peek(sof_len + 1u) | (EXT_OTA_Rx_Peek(sof_len + 2u) << 8);
+
+		// Validate the type and the length before trusting them
+		if(packet_type & EXT_OTA_PACKET_HDR_CHECK)
 		{
-			ret = EXT_OTA_EX_ERR;
+			ret = EXT_OTA_Rx_Wait(sof_len + 4u, EXT_OTA_INTER_BYTE_TIMEOUT);
+			if(ret != HAL_OK)
+			{
+				break;
+			}
+			if(EXT_OTA_Rx_Peek(sof_len + 3u) != EXT_OTA_Header_Check(packet_type, data_len))
+			{
+				printf("Header check mismatch\r\n");
+				ret = HAL_ERROR;
+				break;
+			}
+			hdr_len = 4u;
+		}
+		else if(EXT_OTA_HDR_CHECK_REQUIRED)
+		{
+			ret = HAL_ERROR;
+			break;
+		}
+#if EXT_OTA_MULTIDROP_ENABLE
+		// Destination node of the frame
+		if(packet_type & EXT_OTA_PACKET_ADDRESSED)
+		{
+			ret = EXT_OTA_Rx_Wait(sof_len + hdr_len + 1u, EXT_OTA_INTER_BYTE_TIMEOUT);
+			if(ret != HAL_OK)
+			{
+				break;
+			}
+			packet->address = EXT_OTA_Rx_Peek(sof_len + hdr_len);
+			addr_len = 1u;
+			hdr_len++;
+		}
+#endif
+		packet->packet_type = packet_type & (uint8_t)~(EXT_OTA_PACKET_HDR_CHECK | EXT_OTA_PACKET_ADDRESSED);
+		// A garbled length must not wrap the frame size
+		if(data_len > max_len)
+		{
+			printf("Received more data than expected. Expected = %d, Received = %d\r\n", max_len, data_len);
+			ret = HAL_ERROR;
 			break;
 		}
-		// Receive the packet type
-		ret = HAL_UART_Receive(&huart1, &buffer[idx++], 1, HAL_MAX_DELAY);
+		idx = 1u + hdr_len + data_len + 5u;
+
+		// Reject a frame that can not fit before waiting for it
+		if(idx > max_len + (hdr_len - 3u) ||
+		   (EXT_OTA_IS_CTRL_PACKET(packet->packet_type) && idx - (hdr_len - 3u) > sizeof(ctrl_frame)))
+		{
+			printf("Received more data than expected. Expected = %d, Received = %d\r\n", max_len, idx);
+			ret = HAL_ERROR;
+			break;
+		}
+
+		// Program the payload of an in-order DATA packet while the rest of the frame arrives
+		ret = EXT_OTA_Cut_Receive(packet->packet_type, sof_len + hdr_len, data_len);
 		if(ret != HAL_OK)
 		{
 			break;
 		}
-		// Get the data length of the packet
-		ret = HAL_UART_Receive(&huart1, &buffer[idx], 2, HAL_MAX_DELAY);
+		// Receive the data, the CRC and the EOF byte
+		ret = EXT_OTA_Rx_Wait(sof_len + idx - 1u, EXT_OTA_INTER_BYTE_TIMEOUT);
 		if(ret != HAL_OK)
 		{
 			break;
 		}
-		data_len = *(uint16_t *)&buffer[idx];
-		idx += 2;
+		// Check if the received byte is the EOF
+		if(EXT_OTA_Rx_Peek(sof_len + idx - 2u) != EXT_OTA_EOF)
+		{
+			ret = HAL_ERROR;
+			break;
+		}
+		packet->data_len = data_len;
+		ret = EXT_OTA_Check_Frame(packet, sof_len, hdr_len, addr_len);
+		if(ret != HAL_OK)
+		{
+			break;
+		}
+		packet->frame_len = sof_len + idx - 1u;
+	}
+	while(0);
+
+	// Check for error
+	if(ret != HAL_OK)
+	{
+		printf("Received error!\r\n");
+		// What has been programmed from the bad frame can not be trusted
+		EXT_OTA_Cut_Drop();
+		// Drop the bad frame up to the next SOF candidate already received
+		ota_rx_bad_frames++;
+		EXT_OTA_Rx_Resync(sof_len);
+		idx = 0;
+	}
+	rx_status = ret;
+	return idx;
+}
+
+/*
+ * @brief Receive a COBS framed packet in place in the receive ring.
+ *        The frame stays in the ring until the caller releases packet->frame_len bytes.
+ * @param packet: view on the received packet
+ * @param max_len: maximum length of the packet in the SOF/EOF framing
+ * @param timeout: time allowed for the first byte of the frame in ms
+ * @retval uint16_t: length of the packet in the SOF/EOF framing, 0 on error
+ */
+static uint16_t EXT_OTA_Receive_Cobs(EXT_OTA_PACKET_VIEW* packet, uint16_t max_len, uint32_t timeout)
+{
+	HAL_StatusTypeDef ret = HAL_OK;
+	uint32_t enc_len = 0u;
+	uint32_t available;
+	uint16_t dec_len = 0u;
+	uint8_t addr_len = 0u;
+
+	packet->frame_len = 0u;
+	packet->ctrl = NULL;
+#if EXT_OTA_MULTIDROP_ENABLE
+	packet->address = EXT_OTA_NODE_ADDRESS;
+#endif
+	ota_link->rx_error = 0u;
 
-		// Receive the data
-		for(uint16_t i = 0; i < data_len; ++i)
+	do
+	{
+		// Look for the delimiter ending the frame, empty frames are skipped
+		while(1)
 		{
-			ret = HAL_UART_Receive(&huart1, &buffer[idx++], 1, HAL_MAX_DELAY);
+			available = EXT_OTA_Rx_Available();
+			while(enc_len < available && EXT_OTA_Rx_Peek(enc_len) != EXT_OTA_COBS_DELIMITER)
+			{
+				++enc_len;
+			}
+			if(enc_len < available)
+			{
+				if(enc_len != 0u)
+				{
+					break;
+				}
+				EXT_OTA_Rx_Release(1u);
+				continue;
+			}
+			// Reject a frame that can not fit before waiting for the rest of it
+			if(enc_len > EXT_OTA_COBS_MAX_SIZE(max_len - 2u))
+			{
+				printf("Received more data than expected. Expected = %d, Received = %lu\r\n", max_len, enc_len);
+				ret = HAL_ERROR;
+				break;
+			}
+			ret = EXT_OTA_Rx_Wait(enc_len + 1u, (enc_len == 0u) ? timeout : EXT_OTA_INTER_BYTE_TIMEOUT);
 			if(ret != HAL_OK)
 			{
 				break;
 			}
 		}
-
-		// Get the CRC of the data packet
-		ret = HAL_UART_Receive( &huart1, &buffer[idx], 4, HAL_MAX_DELAY);
-		if( ret != HAL_OK )
+		if(ret != HAL_OK)
 		{
-		  break;
+			break;
 		}
-		rec_data_crc = *(uint32_t*)&buffer[idx];
-		idx += 4;
-		// Receive EOF byte
-		ret = HAL_UART_Receive(&huart1, &buffer[idx], 1, HAL_MAX_DELAY);
-		if(ret != HAL_OK)
+
+		// Decode in place: Type, Len, Data, CRC
+		dec_len = EXT_OTA_Cobs_Decode(enc_len);
+		if(dec_len < 7u)
 		{
+			ret = HAL_ERROR;
 			break;
 		}
-		// Check if the received byte is the SOF
-		if(buffer[idx++] != EXT_OTA_EOF)
+		packet->packet_type = EXT_OTA_Rx_Peek(0u);
+		packet->data_len = EXT_OTA_Rx_Peek(1u) | (EXT_OTA_Rx_Peek(2u) << 8);
+#if EXT_OTA_MULTIDROP_ENABLE
+		// Destination node of the frame
+		if(packet->packet_type & EXT_OTA_PACKET_ADDRESSED)
 		{
-			ret = EXT_OTA_EX_ERR;
+			packet->packet_type &= (uint8_t)~EXT_OTA_PACKET_ADDRESSED;
+			packet->address = EXT_OTA_Rx_Peek(3u);
+			addr_len = 1u;
+		}
+#endif
+		if(packet->data_len + addr_len != dec_len - 7u || dec_len - addr_len + 2u > max_len ||
+		   (EXT_OTA_IS_CTRL_PACKET(packet->packet_type) && dec_len - addr_len + 2u > sizeof(ctrl_frame)))
+		{
+			ret = HAL_ERROR;
 			break;
 		}
-		// Validate the CRC
-		cal_data_crc = CalcCRC((uint8_t*)&buffer[4], data_len);
-		if(rec_data_crc != cal_data_crc)
+
+		ret = EXT_OTA_Check_Frame(packet, 0u, 3u + addr_len, addr_len);
+		if(ret != HAL_OK)
 		{
-			printf("CRC mismatch [Cal CRC = 0x%08lX] [Rec CRC = 0x%08lX]\r\n", cal_data_crc, rec_data_crc);
-			ret = EXT_OTA_EX_ERR;
 			break;
 		}
+		packet->frame_len = enc_len + 1u;
 	}
 	while(0);
 
@@ -128,40 +828,191 @@ static uint16_t EXT_OTA_Receive_Chunk(uint8_t* buffer, uint16_t max_len)
 	if(ret != HAL_OK)
 	{
 		printf("Received error!\r\n");
-		idx = 0;
+		ota_rx_bad_frames++;
+		// Drop the frame with its delimiter, the next frame starts right after it
+		available = EXT_OTA_Rx_Available();
+		if(enc_len < available)
+		{
+			++enc_len;
+		}
+		ota_rx_skipped_bytes += enc_len;
+		EXT_OTA_Rx_Release(enc_len);
+		dec_len = 0u;
 	}
+	rx_status = ret;
+	return (dec_len != 0u) ? (dec_len + 2u) : 0u;
+}
 
-	if(max_len < idx)
+/*
+ * @brief Check if the DATA packets carry their offset in the image: pulled, bonded or broadcast
+ *        chunks, written in any order
+ * @param none
+ * @retval uint8_t: 1 - offset mode, 0 - in-order push mode
+ */
+static uint8_t EXT_OTA_Is_Offset_Mode(void)
+{
+	return (ota_mode != NULL && ota_mode->offset) ? 1u : 0u;
+}
+
+/*
+ * @brief Check if the DATA packets are written by the core in order, at the write position:
+ *        no session mode places them
+ * @param none
+ * @retval uint8_t: 1 - in-order push mode, 0 - placed by a session mode
+ */
+uint8_t EXT_OTA_Is_Push_Mode(void)
+{
+	return (ota_mode == NULL || ota_mode->data == NULL) ? 1u : 0u;
+}
+
+/*
+ * @brief Check if the host can select a session mode: before the image, and no other mode selected
+ * @param mode: session mode
+ * @retval uint8_t: 1 - free, 0 - the session is taken
+ */
+uint8_t EXT_OTA_Mode_Free(const EXT_OTA_MODE_OPS* mode)
+{
+	return ((ota_state == EXT_OTA_STATE_START || ota_state == EXT_OTA_STATE_HEADER) &&
+			(ota_mode == NULL || ota_mode == mode)) ? 1u : 0u;
+}
+
+/*
+ * @brief Offer a packet the core does not handle to the session modes
+ * @param packet: view on the received packet
+ * @param ret: result of the packet, set when a mode takes it
+ * @retval uint8_t: 1 - taken by a mode, 0 - left to the state machine
+ */
+static uint8_t EXT_OTA_Mode_Packet(EXT_OTA_PACKET_VIEW* packet, EXT_OTA_EX* ret)
+{
+	for(uint8_t i = 0; i < sizeof(ota_modes) / sizeof(ota_modes[0]); ++i)
 	{
-		printf("Received more data than expected. Expected = %d, Received = %d\r\n", max_len, idx);
-		idx = 0;
+		if(ota_modes[i]->packet != NULL && ota_modes[i]->packet(packet, ret))
+		{
+			return 1u;
+		}
 	}
-	return idx;
+	return 0u;
+}
+
+/*
+ * @brief Get the largest payload of a DATA packet in the current transfer mode
+ * @param none
+ * @retval uint16_t: chunk size, with the offset prefix in offset mode
+ */
+static uint16_t EXT_OTA_Data_Len_Max(void)
+{
+	return EXT_OTA_Is_Offset_Mode() ? (ota_payload_max + EXT_OTA_PAYLOAD_PREFIX_MAX) : ota_payload_max;
 }
 
 /*
  * @brief Process the data received
- * param buffer: the received buffer
- * param len: the data len to be received
+ * param packet: view on the received packet
  * retval ETX_OTA_EX
  */
-static EXT_OTA_EX EXT_OTA_Process_Data(uint8_t* buffer, uint16_t len)
+static EXT_OTA_EX EXT_OTA_Process_Data(EXT_OTA_PACKET_VIEW* packet)
 {
 	EXT_OTA_EX ret = EXT_OTA_EX_ERR;
+	uint8_t* buffer = packet->ctrl;
 
 	do
 	{
-		// Check the receive buffer
-		if(buffer == NULL || len == 0)
+		// Check the received packet
+		if(packet->frame_len == 0)
 			break;
 		// Check if we receive OTA Abort command
-		EXT_OTA_COMMAND* cmd = (EXT_OTA_COMMAND*)&buffer;
-		if(cmd->packet_type == EXT_OTA_PACKET_TYPE_CMD)
+		EXT_OTA_COMMAND* cmd = (EXT_OTA_COMMAND*)buffer;
+		if(packet->packet_type == EXT_OTA_PACKET_TYPE_CMD)
 		{
 			if(cmd->cmd == EXT_OTA_CMD_ABORT)
 			{
 				break;
 			}
+			// The host proposes a new baud rate, it is applied once the ACK is out
+			if(cmd->cmd == EXT_OTA_CMD_SET_BAUD)
+			{
+				EXT_OTA_BAUD_COMMAND* baud_cmd = (EXT_OTA_BAUD_COMMAND*)buffer;
+				if(baud_cmd->data_len == 5u && ota_link->huart != NULL &&
+				   baud_cmd->baudrate >= EXT_OTA_MIN_BAUDRATE &&
+				   baud_cmd->baudrate <= EXT_OTA_MAX_BAUDRATE)
+				{
+					printf("Received OTA SET BAUD command. Baudrate = %lu\r\n", baud_cmd->baudrate);
+					ota_pending_baudrate = baud_cmd->baudrate;
+					ret = EXT_OTA_EX_OK;
+				}
+				break;
+			}
+			// The host selects the compact response format and the ACK interval
+			if(cmd->cmd == EXT_OTA_CMD_COMPACT_RESP)
+			{
+				EXT_OTA_RESP_MODE_COMMAND* resp_cmd = (EXT_OTA_RESP_MODE_COMMAND*)buffer;
+				if(resp_cmd->data_len == 2u &&
+#if EXT_OTA_MULTIDROP_ENABLE
+				   // A compact response has no SOF, the other nodes of the bus could not skip it
+				   ota_link->multidrop == 0u &&
+#endif
+				   resp_cmd->ack_interval != 0u &&
+				   resp_cmd->ack_interval <= EXT_OTA_ACK_INTERVAL_MAX)
+				{
+					printf("Received OTA COMPACT RESP command. ACK interval = %u\r\n", resp_cmd->ack_interval);
+					ota_pending_compact_resp = 1u;
+					ota_ack_interval = resp_cmd->ack_interval;
+					ret = EXT_OTA_EX_OK;
+				}
+				break;
+			}
+			// The host selects the framing of the following packets
+			if(cmd->cmd == EXT_OTA_CMD_FRAMING)
+			{
+				EXT_OTA_FRAMING_COMMAND* framing_cmd = (EXT_OTA_FRAMING_COMMAND*)buffer;
+				if(framing_cmd->data_len == 2u &&
+				   (framing_cmd->framing == EXT_OTA_FRAMING_SOF_EOF || framing_cmd->framing == EXT_OTA_FRAMING_COBS))
+				{
+					printf("Received OTA FRAMING command. Framing = %u\r\n", framing_cmd->framing);
+					ota_pending_framing = framing_cmd->framing;
+					ret = EXT_OTA_EX_OK;
+				}
+				break;
+			}
+			// The host caps the payload size and asks for advice on it
+			if(cmd->cmd == EXT_OTA_CMD_PAYLOAD_SIZE)
+			{
+				EXT_OTA_PAYLOAD_SIZE_COMMAND* size_cmd = (EXT_OTA_PAYLOAD_SIZE_COMMAND*)buffer;
+				if(size_cmd->data_len == 3u && size_cmd->max_payload >= EXT_OTA_DATA_MIN_SIZE)
+				{
+					ota_payload_max = (size_cmd->max_payload < EXT_OTA_DATA_MAX_SIZE) ? size_cmd->max_payload : EXT_OTA_DATA_MAX_SIZE;
+					ota_payload_max &= (uint16_t)~1u;
+					ota_payload_advice = ota_payload_max;
+					ota_adapt_good_run = 0u;
+					printf("Received OTA PAYLOAD SIZE command. Max = %u\r\n", ota_payload_max);
+					ret = EXT_OTA_EX_OK;
+				}
+				break;
+			}
+#if EXT_OTA_FLOW_CONTROL_ENABLE
+			// The host wants to stream the image under RTS/CTS flow control
+			if(cmd->cmd == EXT_OTA_CMD_STREAM)
+			{
+				if(ota_link->flow_control && (ota_mode == NULL || ota_mode->no_stream == 0u) &&
+				   (ota_state == EXT_OTA_STATE_START || ota_state == EXT_OTA_STATE_HEADER))
+				{
+					printf("Received OTA STREAM command\r\n");
+					ota_pending_stream = 1u;
+					ret = EXT_OTA_EX_OK;
+				}
+				break;
+			}
+#endif
+		}
+		// The commands of the session modes, and their packets
+		if(EXT_OTA_Mode_Packet(packet, &ret))
+		{
+			break;
+		}
+		// Late answer to a chunk sent again, the image is already complete
+		if(EXT_OTA_Is_Offset_Mode() && ota_state == EXT_OTA_STATE_END && packet->packet_type == EXT_OTA_PACKET_TYPE_DATA)
+		{
+			ret = EXT_OTA_EX_OK;
+			break;
 		}
 
 		switch(ota_state)
@@ -176,11 +1027,12 @@ static EXT_OTA_EX EXT_OTA_Process_Data(uint8_t* buffer, uint16_t len)
 		case EXT_OTA_STATE_START:
 		{
 			EXT_OTA_COMMAND* cmd = (EXT_OTA_COMMAND*)buffer;
-			if(cmd->packet_type == EXT_OTA_PACKET_TYPE_CMD)
+			if(packet->packet_type == EXT_OTA_PACKET_TYPE_CMD)
 			{
 				if(cmd->cmd == EXT_OTA_CMD_START)
 				{
 					printf("Received OTA START command\r\n");
+					ota_start_tick = HAL_GetTick();
 					ota_state = EXT_OTA_STATE_HEADER;
 					ret = EXT_OTA_EX_OK;
 				}
@@ -191,13 +1043,18 @@ static EXT_OTA_EX EXT_OTA_Process_Data(uint8_t* buffer, uint16_t len)
 		case EXT_OTA_STATE_HEADER:
 		{
 			EXT_OTA_HEADER* header = (EXT_OTA_HEADER*)buffer;
-			if(header->packet_type == EXT_OTA_PACKET_TYPE_HEADER)
+			if(packet->packet_type == EXT_OTA_PACKET_TYPE_HEADER && header->data_len == sizeof(meta_info))
 			{
 				ota_fw_total_size = header->meta_data.packet_size;
 				ota_fw_crc = header->meta_data.packet_crc;
 				printf("Received OTA Header. FW Size = %lu\r\n", ota_fw_total_size);
 				// Get the slot number to write
 				slot_num_to_write_fw = EXT_OTA_Get_Available_Slot_Number();
+				// The session mode gets the slot ready
+				if(slot_num_to_write_fw != 0xFF && ota_mode != NULL && ota_mode->header != NULL && ota_mode->header() != HAL_OK)
+				{
+					break;
+				}
 				if(slot_num_to_write_fw != 0xFF)
 				{
 					ota_state = EXT_OTA_STATE_DATA;
@@ -209,15 +1066,13 @@ static EXT_OTA_EX EXT_OTA_Process_Data(uint8_t* buffer, uint16_t len)
 
 		case EXT_OTA_STATE_DATA:
 		{
-			EXT_OTA_DATA* data = (EXT_OTA_DATA*)buffer;
-			uint16_t data_len = data->data_len;
 			HAL_StatusTypeDef ex;
 
-			if(data->packet_type == EXT_OTA_PACKET_TYPE_DATA)
+			if(packet->packet_type == EXT_OTA_PACKET_TYPE_DATA && packet->data_len <= EXT_OTA_Data_Len_Max())
 			{
 				uint8_t is_first_block = 0;
-				// Check for the first data block
-				if(ota_fw_received_size == 0)
+				// Check for the first data block, unless the session mode got the slot ready on the header
+				if(ota_fw_received_size == 0 && (ota_mode == NULL || ota_mode->header == NULL))
 				{
 					is_first_block = 1;
 
@@ -235,8 +1090,16 @@ static EXT_OTA_EX EXT_OTA_Process_Data(uint8_t* buffer, uint16_t len)
 						break;
 					}
 				}
-				// Write received data to the block space
-				ex = EXT_OTA_Slot_Data_Write(buffer + 4, slot_num_to_write_fw, data_len, is_first_block);
+				// The session mode places the chunks, they carry their offset or their position in a FEC group
+				if(ota_mode != NULL && ota_mode->data != NULL)
+				{
+					ex = ota_mode->data(&packet->payload, packet->data_len, is_first_block);
+				}
+				else
+				{
+					// Write received data to the block space, straight from the receive ring
+					ex = EXT_OTA_Flash_Write(&packet->payload, is_first_block);
+				}
 				if(ex == HAL_OK)
 				{
 					printf("[%ld/%ld]\r\n", ota_fw_received_size/EXT_OTA_DATA_MAX_SIZE, ota_fw_total_size/EXT_OTA_DATA_MAX_SIZE);
@@ -253,12 +1116,18 @@ static EXT_OTA_EX EXT_OTA_Process_Data(uint8_t* buffer, uint16_t len)
 		case EXT_OTA_STATE_END:
 		{
 			EXT_OTA_COMMAND* cmd = (EXT_OTA_COMMAND*)buffer;
-			if(cmd->packet_type == EXT_OTA_PACKET_TYPE_CMD)
+			if(packet->packet_type == EXT_OTA_PACKET_TYPE_CMD)
 			{
 				if(cmd->cmd == EXT_OTA_CMD_END)
 				{
 					printf("Received OTA END command\r\n");
 
+					// The last page is still in the cache
+					if(EXT_OTA_Cache_Flush() != HAL_OK)
+					{
+						printf("Error: Unable to write to Flash, update stopped!");
+						break;
+					}
 					// Check if the received binary has been modified
 					uint32_t slot_address = (slot_num_to_write_fw == 0) ? EXT_APP_SLOT0_FLASH_ADD : EXT_APP_SLOT1_FLASH_ADD;
 					// Verify the CRC of the firmware's image
@@ -268,6 +1137,11 @@ static EXT_OTA_EX EXT_OTA_Process_Data(uint8_t* buffer, uint16_t len)
 						printf("Error: CRC mismatch of fw image!\r\n");
 						break;
 					}
+					// The session mode completes the image, it is kept only if the mode has done so
+					if(ota_mode != NULL && ota_mode->end != NULL && ota_mode->end() != HAL_OK)
+					{
+						break;
+					}
 
 					// Read the configuration
 					EXT_GNRL_CONFIG cfg;
@@ -297,6 +1171,33 @@ static EXT_OTA_EX EXT_OTA_Process_Data(uint8_t* buffer, uint16_t len)
 						ret = EXT_OTA_EX_OK;
 					}
 					ret = EXT_OTA_EX_OK;
+
+					// Report the sustained throughput of the session
+					uint32_t elapsed = HAL_GetTick() - ota_start_tick;
+					printf("Received %lu bytes in %lu ms at %lu baud (%lu B/s)\r\n", ota_fw_total_size, elapsed,
+						   (ota_link->huart != NULL) ? ota_link->huart->Init.BaudRate : 0u, (elapsed != 0u) ? (ota_fw_total_size * 1000u / elapsed) : 0u);
+					printf("Response path: %lu responses, %lu cycles each\r\n", ota_resp_sent,
+						   (ota_resp_sent != 0u) ? (ota_resp_cycles / ota_resp_sent) : 0u);
+					printf("Link: %s framing, %lu frame bytes, %lu bad frames, %lu bytes skipped\r\n",
+						   (ota_framing == EXT_OTA_FRAMING_COBS) ? "COBS" : "SOF/EOF",
+						   ota_rx_frame_bytes, ota_rx_bad_frames, ota_rx_skipped_bytes);
+					EXT_OTA_Flash_Report();
+					if(ota_link->ops->report != NULL)
+					{
+						ota_link->ops->report(ota_link);
+					}
+					printf("Payload: max %u, advised %u, %lu changes\r\n", ota_payload_max, ota_payload_advice, ota_adapt_changes);
+					if(ota_mode != NULL && ota_mode->report != NULL)
+					{
+						ota_mode->report();
+					}
+#if EXT_OTA_MULTIDROP_ENABLE
+					if(ota_link->multidrop)
+					{
+						printf("Bus: node 0x%02X, %lu frames for other nodes, %lu packets not used\r\n",
+							   EXT_OTA_NODE_ADDRESS, ota_md_foreign, ota_md_ignored);
+					}
+#endif
 				}
 			}
 		}
@@ -319,98 +1220,295 @@ static EXT_OTA_EX EXT_OTA_Process_Data(uint8_t* buffer, uint16_t len)
  * @param resp_type: ACK or NACK
  * @retval none
  */
-static void EXT_OTA_Send_Resp(uint8_t resp_type)
+void EXT_OTA_Send_Resp(uint8_t resp_type)
 {
-	EXT_OTA_RESP rsp =
+	// The session mode answers in its own format
+	if(ota_mode != NULL && ota_mode->respond != NULL && ota_mode->respond(resp_type))
+	{
+		return;
+	}
+	if(ota_compact_resp)
+	{
+		EXT_OTA_COMPACT_RESP rsp =
+		{
+			.status 	= resp_type,
+			.seq 		= (uint8_t)ota_packet_count,
+		};
+		rsp.check = (uint8_t)~(rsp.status ^ rsp.seq);
+		EXT_OTA_Transmit_Resp((uint8_t*)&rsp, sizeof(EXT_OTA_COMPACT_RESP));
+	}
+	else if(ota_payload_advice != 0u)
+	{
+		// Tell the host the payload size that suits the link
+		EXT_OTA_ADAPTIVE_RESP rsp =
+		{
+			.sof 			= EXT_OTA_SOF,
+			.packet_type 	= EXT_OTA_PACKET_TYPE_RESPONSE,
+			.data_len 		= 4,
+			.status 		= resp_type,
+			.seq 			= (uint8_t)ota_packet_count,
+			.payload_len 	= ota_payload_advice,
+			.eof			= EXT_OTA_EOF
+		};
+		rsp.crc = CalcCRC((uint8_t*)&rsp.status, 4);
+		EXT_OTA_Transmit_Resp((uint8_t*)&rsp, sizeof(EXT_OTA_ADAPTIVE_RESP));
+	}
+	else if(resp_type == EXT_OTA_NACK)
 	{
-		.sof 			= EXT_OTA_SOF,
-		.packet_type 	= EXT_OTA_PACKET_TYPE_RESPONSE,
-		.data_len 		= 1,
-		.status 		= resp_type,
-		.eof			= EXT_OTA_EOF
-	};
-	rsp.crc = CalcCRC((uint8_t*)&rsp.status, 1);
-	HAL_UART_Transmit(&huart1, (uint8_t*)&rsp, sizeof(EXT_OTA_RESP), 100);
+		// The NACK tells the host which packet to resend
+		EXT_OTA_NACK_RESP rsp =
+		{
+			.sof 			= EXT_OTA_SOF,
+			.packet_type 	= EXT_OTA_PACKET_TYPE_RESPONSE,
+			.data_len 		= 2,
+			.status 		= resp_type,
+			.seq 			= (uint8_t)ota_packet_count,
+			.eof			= EXT_OTA_EOF
+		};
+		rsp.crc = CalcCRC((uint8_t*)&rsp.status, 2);
+		EXT_OTA_Transmit_Resp((uint8_t*)&rsp, sizeof(EXT_OTA_NACK_RESP));
+	}
+	else
+	{
+		EXT_OTA_RESP rsp =
+		{
+			.sof 			= EXT_OTA_SOF,
+			.packet_type 	= EXT_OTA_PACKET_TYPE_RESPONSE,
+			.data_len 		= 1,
+			.status 		= resp_type,
+			.eof			= EXT_OTA_EOF
+		};
+		rsp.crc = CalcCRC((uint8_t*)&rsp.status, 1);
+		EXT_OTA_Transmit_Resp((uint8_t*)&rsp, sizeof(EXT_OTA_RESP));
+	}
 }
 
 /*
- * @brief Write data application to the actual flash memory
- * @param data: data to be written
- * @param data_len: length of the data to be written
- * @param is_first_block: true - if this is the first block
+ * @brief Hand a response frame to the OTA link. With TX DMA the frame is queued and the
+ *        function returns while it is still on the wire.
+ * @param frame: response frame
+ * @param len: length of the frame
+ * @retval none
  */
-static HAL_StatusTypeDef EXT_OTA_Slot_Data_Write(uint8_t* data, uint8_t slot_num, uint16_t data_len, uint8_t is_first_block)
+void EXT_OTA_Transmit_Resp(uint8_t* frame, uint8_t len)
 {
-	HAL_StatusTypeDef ret = HAL_OK;
-	// Data write sequence
-	do
+	uint32_t cycles = DWT->CYCCNT;
+#if EXT_OTA_TX_DMA_ENABLE
+	uint8_t next = (ota_link->tx_head + 1u) % EXT_OTA_TX_QUEUE_DEPTH;
+	uint32_t tick_start = HAL_GetTick();
+
+	// Wait for a free slot in the queue
+	while(next == ota_link->tx_tail)
 	{
-		// Validate the input condition
-		if(slot_num >= EXT_SLOT_NO)
+		if((HAL_GetTick() - tick_start) > EXT_OTA_TX_TIMEOUT)
 		{
-			ret = HAL_ERROR;
+			EXT_OTA_Drop_Resp();
 			break;
 		}
-		// Unlock flash memory
-		ret = HAL_FLASH_Unlock();
-		if(ret != HAL_OK)
+	}
+	memcpy(ota_link->tx_queue[ota_link->tx_head], frame, len);
+	ota_link->tx_len[ota_link->tx_head] = len;
+	ota_link->tx_head = next;
+
+	__disable_irq();
+	EXT_OTA_Start_Next_Resp(ota_link);
+	__enable_irq();
+#else
+	(void)ota_link->ops->tx(ota_link, frame, len);
+#endif
+
+	ota_resp_cycles += DWT->CYCCNT - cycles;
+	ota_resp_sent++;
+}
+
+/*
+ * @brief Wait until all the queued responses have left the OTA link
+ * @param none
+ * @retval none
+ */
+void EXT_OTA_Flush_Resp(void)
+{
+#if EXT_OTA_TX_DMA_ENABLE
+	uint32_t tick_start = HAL_GetTick();
+
+	while(ota_link->tx_busy || ota_link->tx_tail != ota_link->tx_head)
+	{
+		if((HAL_GetTick() - tick_start) > EXT_OTA_TX_TIMEOUT)
 		{
-			printf("Unable to unlock Flash memory, update stopped!");
+			EXT_OTA_Drop_Resp();
 			break;
 		}
-		// Erase the flash in the first time
-		if(is_first_block)
-		{
-			printf("Erasing flash memory");
+	}
+#endif
+}
 
-			FLASH_EraseInitTypeDef EraseInitStruct;
-			uint32_t sector_error;
+#if EXT_OTA_TX_DMA_ENABLE
+/*
+ * @brief Abort the response on the wire and drop the queued ones, the link is not draining
+ * @param none
+ * @retval none
+ */
+static void EXT_OTA_Drop_Resp(void)
+{
+	if(ota_link->ops->tx_abort != NULL)
+	{
+		ota_link->ops->tx_abort(ota_link);
+	}
+	__disable_irq();
+	ota_link->tx_tail = ota_link->tx_head;
+	ota_link->tx_busy = 0u;
+	__enable_irq();
+}
+#endif
 
-			EraseInitStruct.TypeErase 	= FLASH_TYPEERASE_PAGES;
-			// Select the slot to erase
-			EraseInitStruct.PageAddress = (slot_num == 0) ? EXT_APP_SLOT0_FLASH_ADD : EXT_APP_SLOT1_FLASH_ADD;
-			EraseInitStruct.NbPages 	= DATA_FLASH_SIZE;	// 13 KB
-			ret = HAL_FLASHEx_Erase(&EraseInitStruct, &sector_error);
-			if(ret != HAL_OK)
-			{
-				printf("Unable to erase Flash memory, updating stopped");
-				break;
-			}
+#if EXT_OTA_TX_DMA_ENABLE
+/*
+ * @brief Start sending the oldest queued response if the link is free
+ * @param link: OTA link
+ * @retval none
+ */
+static void EXT_OTA_Start_Next_Resp(EXT_OTA_LINK* link)
+{
+	if(link->tx_busy == 0u && link->tx_tail != link->tx_head)
+	{
+		// Busy first, the link may report the response sent before it returns
+		link->tx_busy = 1u;
+		if(link->ops->tx(link, link->tx_queue[link->tx_tail], link->tx_len[link->tx_tail]) != HAL_OK)
+		{
+			link->tx_busy = 0u;
 		}
+	}
+}
 
-		uint32_t slot_address = (slot_num == 0) ? EXT_APP_SLOT0_FLASH_ADD : EXT_APP_SLOT1_FLASH_ADD;
+/*
+ * @brief Release the response that has just been sent on a link and start the next one
+ * @param link: OTA link
+ * @retval none
+ */
+void EXT_OTA_Link_Tx_Done(EXT_OTA_LINK* link)
+{
+	link->tx_tail = (link->tx_tail + 1u) % EXT_OTA_TX_QUEUE_DEPTH;
+	link->tx_busy = 0u;
+	EXT_OTA_Start_Next_Resp(link);
+}
+#endif
 
-		// Write data to the flash memory
-		for(uint16_t i = 0; i < data_len / 2; ++i)
-		{
-			uint16_t halfword_data = data[i * 2] | (data[i * 2 + 1] << 8);
-			ret = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, (slot_address + ota_fw_received_size), halfword_data);
-			if(ret == HAL_OK)
-			{
-				ota_fw_received_size += 2;
-			}
-			else
-			{
-				printf("Error: Unable to write to Flash, update stopped!");
-				break;
-			}
-		}
-		if(ret != HAL_OK)
-		{
-			break;
-		}
+/*
+ * @brief Check if the packet that has just been accepted must be acknowledged
+ * @param none
+ * @retval uint8_t: 1 - send the ACK now, 0 - the ACK is deferred
+ */
+static uint8_t EXT_OTA_Is_Ack_Due(void)
+{
+	// Commands, the header and parity packets are always acknowledged
+	if(rcv_packet.packet_type != EXT_OTA_PACKET_TYPE_DATA)
+	{
+		return 1u;
+	}
+	// The session mode acknowledges its DATA packets its own way
+	if(ota_mode != NULL && ota_mode->ack_due != NULL)
+	{
+		return ota_mode->ack_due();
+	}
+	// The last DATA packet is always acknowledged
+	if(ota_state != EXT_OTA_STATE_DATA)
+	{
+		return 1u;
+	}
+#if EXT_OTA_FLOW_CONTROL_ENABLE
+	// Streamed DATA packets are acknowledged once, after the last one
+	if(ota_streaming)
+	{
+		return 0u;
+	}
+#endif
+	// The ACK of every Nth packet covers the previous ones
+	return ((ota_packet_count % ota_ack_interval) == 0u) ? 1u : 0u;
+}
 
-		// Lock the Flash memory
-		ret = HAL_FLASH_Lock();
-		if(ret != HAL_OK)
+/*
+ * @brief Update the payload size advised to the host after a DATA frame
+ * @param frame_ok: 1 - a DATA packet has been accepted, 0 - a frame has been damaged
+ * @retval none
+ */
+static void EXT_OTA_Adapt_Payload(uint8_t frame_ok)
+{
+	uint16_t advice = ota_payload_advice;
+
+	if(advice == 0u)
+	{
+		return;
+	}
+	if(frame_ok == 0u)
+	{
+		// A damaged frame costs less to send again when it is short
+		advice = (advice / 2u) & (uint16_t)~1u;
+		if(advice < EXT_OTA_DATA_MIN_SIZE)
 		{
-			printf("Error: Unable to lock Flash, update stopped!");
-			break;
+			advice = EXT_OTA_DATA_MIN_SIZE;
 		}
+		ota_adapt_good_run = 0u;
 	}
-	while(0);
+	else if(++ota_adapt_good_run >= EXT_OTA_ADAPT_GOOD_RUN)
+	{
+		// A clean link amortizes the framing over larger payloads
+		advice = (advice < ota_payload_max / 2u) ? (uint16_t)(advice * 2u) : ota_payload_max;
+		ota_adapt_good_run = 0u;
+	}
+	if(advice != ota_payload_advice)
+	{
+		ota_payload_advice = advice;
+		ota_adapt_changes++;
+	}
+}
 
-	return ret;
+/*
+ * @brief Read a byte of a slice
+ * @param slice: slice of the receive ring
+ * @param idx: index of the byte in the slice
+ * @retval uint8_t
+ */
+EXT_OTA_RAMFUNC uint8_t EXT_OTA_Slice_Byte(const EXT_OTA_SLICE* slice, uint16_t idx)
+{
+	return (idx < slice->len[0]) ? slice->ptr[0][idx] : slice->ptr[1][idx - slice->len[0]];
+}
+
+/*
+ * @brief Drop the first bytes of a slice
+ * @param slice: slice of the receive ring
+ * @param count: number of bytes, at most the length of the slice
+ * @retval none
+ */
+void EXT_OTA_Slice_Skip(EXT_OTA_SLICE* slice, uint16_t count)
+{
+	if(count < slice->len[0])
+	{
+		slice->ptr[0] += count;
+		slice->len[0] -= count;
+	}
+	else
+	{
+		count -= slice->len[0];
+		slice->ptr[0] = slice->ptr[1] + count;
+		slice->len[0] = slice->len[1] - count;
+		slice->len[1] = 0u;
+	}
+}
+
+/*
+ * @brief Read the image offset carried in the first bytes of a payload
+ * @param slice: payload in the receive ring, at least EXT_OTA_PAYLOAD_PREFIX_MAX bytes long
+ * @retval uint32_t
+ */
+uint32_t EXT_OTA_Slice_Offset(const EXT_OTA_SLICE* slice)
+{
+	uint32_t offset = 0u;
+
+	for(uint8_t i = 0; i < 4u; ++i)
+	{
+		offset |= (uint32_t)EXT_OTA_Slice_Byte(slice, i) << (8u * i);
+	}
+	return offset;
 }
 
 /*
@@ -448,6 +1546,8 @@ static uint8_t EXT_OTA_Get_Available_Slot_Number()
 static HAL_StatusTypeDef EXT_OTA_App_Data_Write(uint8_t* data, uint32_t data_len)
 {
 	HAL_StatusTypeDef ret;
+	uint32_t pages_kept = 0u;
+	uint32_t programmed = 0u;
 
 	do
 	{
@@ -462,29 +1562,54 @@ static HAL_StatusTypeDef EXT_OTA_App_Data_Write(uint8_t* data, uint32_t data_len
 		uint32_t sector_error;
 
 		EraseInitStruct.TypeErase 	= FLASH_TYPEERASE_PAGES;
-		EraseInitStruct.PageAddress = EXT_APP_START_ADD;
-		EraseInitStruct.NbPages 	= DATA_FLASH_SIZE;	// 13 KB
-		ret = HAL_FLASHEx_Erase(&EraseInitStruct, &sector_error);
-		if(ret != HAL_OK)
-		{
-			printf("Unable to erase Flash memory, updating stopped");
-			break;
-		}
-		// Program the new application into the Flash memory
-		for(uint32_t i = 0; i < data_len / 2; ++i)
+		EraseInitStruct.NbPages 	= 1u;
+		// Page by page, over the 13 KB of the application
+		for(uint32_t page = 0; page < DATA_FLASH_SIZE && ret == HAL_OK; ++page)
 		{
-			uint16_t halfword_data = data[i * 2] | (data[i * 2 + 1] << 8);
-			ret = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, (EXT_APP_START_ADD + (i * 2)), halfword_data);
+			uint32_t offset = page * FLASH_PAGE_SIZE;
+			uint32_t address = EXT_APP_START_ADD + offset;
+			uint32_t len = (data_len > offset) ? (data_len - offset) : 0u;
+
+			if(len > FLASH_PAGE_SIZE)
+			{
+				len = FLASH_PAGE_SIZE;
+			}
+			// A page that already holds the new application, erased past its end, is left as it is
+			if(memcmp((const uint8_t*)address, &data[offset], len) == 0 &&
+			   EXT_OTA_Is_Erased(address + len, FLASH_PAGE_SIZE - len))
+			{
+				pages_kept++;
+				continue;
+			}
+			EraseInitStruct.PageAddress = address;
+			ret = HAL_FLASHEx_Erase(&EraseInitStruct, &sector_error);
 			if(ret != HAL_OK)
 			{
-				printf("Error: Unable to write to Flash, update stopped!");
+				printf("Unable to erase Flash memory, updating stopped");
 				break;
 			}
+			// Program the new application into the Flash memory, the 0xFFFF halfwords are already there
+			for(uint32_t i = 0; i < len; i += 2u)
+			{
+				uint16_t halfword_data = data[offset + i] | ((i + 1u < len) ? (uint16_t)(data[offset + i + 1u] << 8) : (uint16_t)0xFF00u);
+				if(halfword_data == 0xFFFFu)
+				{
+					continue;
+				}
+				ret = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + i, halfword_data);
+				if(ret != HAL_OK)
+				{
+					printf("Error: Unable to write to Flash, update stopped!");
+					break;
+				}
+				programmed += 2u;
+			}
 		}
 		if(ret != HAL_OK)
 		{
 			break;
 		}
+		printf("Application: %lu of %lu pages unchanged, %lu bytes programmed\r\n", pages_kept, (uint32_t)DATA_FLASH_SIZE, programmed);
 
 		// Lock the Flash memory
 		ret = HAL_FLASH_Lock();
@@ -500,50 +1625,154 @@ static HAL_StatusTypeDef EXT_OTA_App_Data_Write(uint8_t* data, uint32_t data_len
 }
 
 /*
- * @brief Write configuration information into Flash memory
- * @param cfg: current configuration
+ * @brief Check if a range of the Flash is erased
+ * @param address: Flash address
+ * @param len: number of bytes
+ * @retval uint8_t: 1 - all bytes are 0xFF, 0 - otherwise
+ */
+static uint8_t EXT_OTA_Is_Erased(uint32_t address, uint32_t len)
+{
+	for(uint32_t i = 0; i < len; ++i)
+	{
+		if(((const uint8_t*)address)[i] != 0xFFu)
+		{
+			return 0u;
+		}
+	}
+	return 1u;
+}
+
+/*
+ * @brief Reconfigure the baud rate of the OTA UART
+ * @param baudrate: new baud rate
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Set_Baudrate(uint32_t baudrate)
+{
+	HAL_StatusTypeDef ret;
+
+	EXT_OTA_Flush_Resp();
+	EXT_OTA_Rx_Stop(ota_link);
+	ota_link->huart->Init.BaudRate = baudrate;
+	ret = HAL_UART_Init(ota_link->huart);
+	EXT_OTA_Rx_Start(ota_link);
+
+	return ret;
+}
+
+/*
+ * @brief Reconfigure the hardware flow control of the OTA UART
+ * @param hw_flow_ctl: UART_HWCONTROL_NONE or UART_HWCONTROL_RTS_CTS
  * @retval HAL_StatusTypeDef
  */
-static HAL_StatusTypeDef EXT_OTA_Write_Config(EXT_GNRL_CONFIG* cfg)
+static HAL_StatusTypeDef EXT_OTA_Set_Flow_Control(uint32_t hw_flow_ctl)
 {
 	HAL_StatusTypeDef ret;
 
+	EXT_OTA_Flush_Resp();
+	EXT_OTA_Rx_Stop(ota_link);
+	ota_link->huart->Init.HwFlowCtl = hw_flow_ctl;
+	ret = HAL_UART_Init(ota_link->huart);
+	EXT_OTA_Rx_Start(ota_link);
+
+	return ret;
+}
+
+/*
+ * @brief Switch the OTA link to the negotiated baud rate and check it with a probe frame.
+ *        The link falls back to the baud rate it had if the probe is not received.
+ * @param baudrate: negotiated baud rate
+ * @retval none
+ */
+static void EXT_OTA_Switch_Baudrate(uint32_t baudrate)
+{
+	// Default or autobaud-detected rate the session started at
+	uint32_t prev_baudrate = ota_link->huart->Init.BaudRate;
+	uint16_t len;
+	uint8_t is_probe;
+
 	do
 	{
-		// Check the input condition
-		if(cfg == NULL)
+		if(EXT_OTA_Set_Baudrate(baudrate) != HAL_OK)
 		{
-			ret = HAL_ERROR;
 			break;
 		}
-		// Erase the Flash memory of the application
-		ret = HAL_FLASH_Unlock();
-		if(ret != HAL_OK)
+		// Wait for the probe frame from the host at the new baud rate
+		len = EXT_OTA_Receive_Chunk(&rcv_packet, EXT_OTA_PACKET_MAX_SIZE, EXT_OTA_BAUD_PROBE_TIMEOUT);
+		is_probe = (len != 0 && rcv_packet.packet_type == EXT_OTA_PACKET_TYPE_CMD &&
+					((EXT_OTA_COMMAND*)rcv_packet.ctrl)->cmd == EXT_OTA_CMD_PROBE);
+		EXT_OTA_Rx_Release(rcv_packet.frame_len);
+		if(!is_probe)
+		{
 			break;
+		}
+		printf("Switched to baudrate %lu\r\n", baudrate);
+		EXT_OTA_Send_Resp(EXT_OTA_ACK);
+		return;
+	}
+	while(0);
 
-		printf("Erasing config flash memory");
+	// The probe failed, the host falls back to the previous baud rate as well
+	EXT_OTA_Set_Baudrate(prev_baudrate);
+	printf("Error: Baudrate probe failed, falling back to %lu\r\n", ota_link->huart->Init.BaudRate);
+}
 
-		FLASH_EraseInitTypeDef EraseInitStruct;
-		uint32_t sector_error;
+#if EXT_OTA_AUTOBAUD_ENABLE
+/*
+ * @brief Measure the baud rate of the host on the SOF byte of the first frame and configure USART1 to it.
+ *        SOF (0xAA) is sent LSB first, so the start bit and bit 0 form a single low pulse of 2 bit times.
+ *        IC3 captures its falling edge and IC4 (mapped on the same TI3 input) the following rising edge.
+ * @param timeout: time to wait for the SOF byte in ms
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Autobaud(uint32_t timeout)
+{
+	HAL_StatusTypeDef ret = HAL_OK;
+	uint32_t tick_start = HAL_GetTick();
+	uint32_t pclk = HAL_RCC_GetPCLK2Freq();
+	uint32_t baudrate = 0u;
+	uint16_t fall_edge;
+	uint16_t two_bits;
 
-		EraseInitStruct.TypeErase 	= FLASH_TYPEERASE_PAGES;
-		EraseInitStruct.PageAddress = EXT_CONFIG_FLASH_ADD;
-		EraseInitStruct.NbPages 	= CONFIG_FLASH_SIZE;	// 6 KB
-		ret = HAL_FLASHEx_Erase(&EraseInitStruct, &sector_error);
+	do
+	{
+		// TIM1 stays configured from one listen slice to the next, only the captures are started
+		if(htim_autobaud.State == HAL_TIM_STATE_RESET)
+		{
+			ret = EXT_OTA_Autobaud_Init();
+			if(ret != HAL_OK)
+			{
+				break;
+			}
+		}
+
+		// Keep the receiver off while the SOF is shifted in at an unknown rate
+		CLEAR_BIT(huart1.Instance->CR1, USART_CR1_RE);
+
+		HAL_TIM_IC_Start(&htim_autobaud, TIM_CHANNEL_3);
+		HAL_TIM_IC_Start(&htim_autobaud, TIM_CHANNEL_4);
+		__HAL_TIM_CLEAR_FLAG(&htim_autobaud, TIM_FLAG_CC3 | TIM_FLAG_CC4 | TIM_FLAG_CC3OF | TIM_FLAG_CC4OF);
+
+		// Wait for the start bit
+		while(__HAL_TIM_GET_FLAG(&htim_autobaud, TIM_FLAG_CC3) == RESET)
+		{
+			if((HAL_GetTick() - tick_start) > timeout)
+			{
+				ret = HAL_TIMEOUT;
+				break;
+			}
+		}
 		if(ret != HAL_OK)
 		{
-			printf("Unable to erase Flash memory, updating stopped");
 			break;
 		}
-		// Program the new application into the Flash memory
-		uint8_t* data = (uint8_t*)cfg;
-		for(uint32_t i = 0; i < sizeof(EXT_GNRL_CONFIG) / 2; ++i)
+		fall_edge = (uint16_t)htim_autobaud.Instance->CCR3;
+		// Wait for the end of bit 0
+		while(__HAL_TIM_GET_FLAG(&htim_autobaud, TIM_FLAG_CC4) == RESET)
 		{
-			uint16_t halfword_data = data[i * 2] | (data[i * 2 + 1] << 8);
-			ret = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, (EXT_CONFIG_FLASH_ADD + (i * 2)), halfword_data);
-			if(ret != HAL_OK)
+			if((uint16_t)(htim_autobaud.Instance->CNT - fall_edge) >= 0xFF00u)
 			{
-				printf("Error: Unable to write to Flash, update stopped!");
+				ret = HAL_TIMEOUT;
 				break;
 			}
 		}
@@ -551,19 +1780,211 @@ static HAL_StatusTypeDef EXT_OTA_Write_Config(EXT_GNRL_CONFIG* cfg)
 		{
 			break;
 		}
+		two_bits = (uint16_t)(htim_autobaud.Instance->CCR4 - fall_edge);
+		// The captures have been overwritten by later edges, the measurement is not reliable
+		if(__HAL_TIM_GET_FLAG(&htim_autobaud, TIM_FLAG_CC3OF | TIM_FLAG_CC4OF) != RESET || two_bits == 0u)
+		{
+			ret = HAL_ERROR;
+			break;
+		}
 
-		// Lock the Flash memory
-		ret = HAL_FLASH_Lock();
+		// Snap the measured rate to the closest standard baud rate
+		uint32_t measured = (2u * pclk) / two_bits;
+		for(uint8_t i = 0; i < sizeof(autobaud_rates) / sizeof(autobaud_rates[0]); ++i)
+		{
+			uint32_t delta = (measured > autobaud_rates[i]) ? (measured - autobaud_rates[i]) : (autobaud_rates[i] - measured);
+			if((delta * 100u) <= (autobaud_rates[i] * EXT_OTA_AUTOBAUD_TOLERANCE))
+			{
+				baudrate = autobaud_rates[i];
+				break;
+			}
+		}
+		if(baudrate == 0u || baudrate > EXT_OTA_MAX_BAUDRATE)
+		{
+			ret = HAL_ERROR;
+			break;
+		}
+
+		// Let the rest of the SOF byte pass (8 data bits + stop bit, sampled in the middle of the stop bit)
+		uint32_t brr = UART_BRR_SAMPLING16(pclk, baudrate);
+		uint32_t sof_end = ((uint32_t)two_bits * 19u) / 4u;
+		uint32_t elapsed = 0u;
+		uint16_t last_cnt = fall_edge;
+		while(elapsed < sof_end)
+		{
+			uint16_t cnt = (uint16_t)htim_autobaud.Instance->CNT;
+			elapsed += (uint16_t)(cnt - last_cnt);
+			last_cnt = cnt;
+		}
+
+		// Configure the USART to the measured rate before the next byte arrives
+		huart1.Instance->BRR = brr;
+		huart1.Init.BaudRate = baudrate;
+		(void)huart1.Instance->SR;
+		(void)huart1.Instance->DR;
+		ota_autobaud_sof = 1u;
+
+		// The packet type byte is already on its way, start the reception right away
+		SET_BIT(huart1.Instance->CR1, USART_CR1_RE);
+		EXT_OTA_Rx_Start(ota_link);
+	}
+	while(0);
+
+	HAL_TIM_IC_Stop(&htim_autobaud, TIM_CHANNEL_3);
+	HAL_TIM_IC_Stop(&htim_autobaud, TIM_CHANNEL_4);
+	SET_BIT(huart1.Instance->CR1, USART_CR1_RE);
+
+	return ret;
+}
+
+/*
+ * @brief Configure TIM1 CH3/CH4 to capture the edges of the SOF byte on PA10
+ * @param none
+ * @retval HAL_StatusTypeDef
+ */
+static HAL_StatusTypeDef EXT_OTA_Autobaud_Init(void)
+{
+	HAL_StatusTypeDef ret;
+	TIM_IC_InitTypeDef sConfigIC = {0};
+
+	do
+	{
+		// TIM1 runs from PCLK2 without prescaler, 16-bit wide: slowest measurable rate ~ 2.2 kbaud
+		htim_autobaud.Instance 					= TIM1;
+		htim_autobaud.Init.Prescaler 			= 0;
+		htim_autobaud.Init.CounterMode 			= TIM_COUNTERMODE_UP;
+		htim_autobaud.Init.Period 				= 0xFFFF;
+		htim_autobaud.Init.ClockDivision 		= TIM_CLOCKDIVISION_DIV1;
+		htim_autobaud.Init.RepetitionCounter 	= 0;
+		htim_autobaud.Init.AutoReloadPreload 	= TIM_AUTORELOAD_PRELOAD_DISABLE;
+		ret = HAL_TIM_IC_Init(&htim_autobaud);
+		if(ret != HAL_OK)
+		{
+			break;
+		}
+		// IC3: falling edge of the start bit
+		sConfigIC.ICPolarity 	= TIM_INPUTCHANNELPOLARITY_FALLING;
+		sConfigIC.ICSelection 	= TIM_ICSELECTION_DIRECTTI;
+		sConfigIC.ICPrescaler 	= TIM_ICPSC_DIV1;
+		sConfigIC.ICFilter 		= 0;
+		ret = HAL_TIM_IC_ConfigChannel(&htim_autobaud, &sConfigIC, TIM_CHANNEL_3);
 		if(ret != HAL_OK)
 		{
-			printf("Error: Unable to lock Flash, update stopped!");
 			break;
 		}
+		// IC4: rising edge at the end of bit 0
+		sConfigIC.ICPolarity 	= TIM_INPUTCHANNELPOLARITY_RISING;
+		sConfigIC.ICSelection 	= TIM_ICSELECTION_INDIRECTTI;
+		ret = HAL_TIM_IC_ConfigChannel(&htim_autobaud, &sConfigIC, TIM_CHANNEL_4);
 	}
 	while(0);
 
+	if(ret != HAL_OK)
+	{
+		HAL_TIM_IC_DeInit(&htim_autobaud);
+	}
 	return ret;
 }
+#endif
+
+/*
+ * @brief Listen to all the links until one of them receives the START command.
+ *        The session is opened on that link, the other links are stopped.
+ *        The START frame is left in rcv_packet and in the ring of the link.
+ * @param none
+ * @retval uint16_t: length of the START frame
+ */
+static uint16_t EXT_OTA_Listen(void)
+{
+#if EXT_OTA_AUTOBAUD_ENABLE
+	HAL_StatusTypeDef ret;
+#endif
+	uint16_t len;
+	uint8_t i;
+
+	for(i = 0; i < EXT_OTA_LINK_COUNT; ++i)
+	{
+		if(!ota_links[i].autobaud)
+		{
+			EXT_OTA_Rx_Start(&ota_links[i]);
+		}
+	}
+
+	while(1)
+	{
+		for(i = 0; i < EXT_OTA_LINK_COUNT; ++i)
+		{
+			ota_link = &ota_links[i];
+#if EXT_OTA_AUTOBAUD_ENABLE
+			if(ota_link->autobaud)
+			{
+				// Measure the rate of the host on the first SOF, retry once the line is idle again
+				ota_autobaud_sof = 0u;
+				ret = EXT_OTA_Autobaud(EXT_OTA_LISTEN_SLICE);
+				if(ret == HAL_ERROR)
+				{
+					printf("Autobaud failed, retrying\r\n");
+					HAL_Delay(EXT_OTA_AUTOBAUD_IDLE_TIME);
+				}
+				if(ret != HAL_OK)
+				{
+					continue;
+				}
+			}
+			else
+#endif
+			if(EXT_OTA_Rx_Available() == 0u)
+			{
+				continue;
+			}
+
+			len = EXT_OTA_Receive_Chunk(&rcv_packet, EXT_OTA_PACKET_MAX_SIZE, EXT_OTA_INTER_BYTE_TIMEOUT);
+			if(len != 0u && rcv_packet.packet_type == EXT_OTA_PACKET_TYPE_CMD &&
+			   ((EXT_OTA_COMMAND*)rcv_packet.ctrl)->cmd == EXT_OTA_CMD_START)
+			{
+				for(uint8_t j = 0; j < EXT_OTA_LINK_COUNT; ++j)
+				{
+					if(j != i)
+					{
+						EXT_OTA_Rx_Stop(&ota_links[j]);
+					}
+				}
+#if EXT_OTA_AUTOBAUD_ENABLE
+				// The session link is chosen, TIM1 and PA10 are released
+				if(htim_autobaud.State != HAL_TIM_STATE_RESET)
+				{
+					HAL_TIM_IC_DeInit(&htim_autobaud);
+				}
+#endif
+				return len;
+			}
+			// Anything else is dropped, the host repeats the START until it is acknowledged
+			EXT_OTA_Rx_Release(rcv_packet.frame_len);
+			if(ota_link->autobaud)
+			{
+				EXT_OTA_Rx_Stop(ota_link);
+			}
+		}
+	}
+}
+
+/*
+ * @brief Check if a UART carries the current OTA session
+ * @param huart: UART handle
+ * @retval uint8_t: 1 - the UART is busy with the session, 0 - it is free
+ */
+uint8_t EXT_OTA_Owns_Uart(UART_HandleTypeDef* huart)
+{
+	if(ota_session_open == 0u)
+	{
+		return 0u;
+	}
+	if(ota_link->huart == huart)
+	{
+		return 1u;
+	}
+	return (ota_mode != NULL && ota_mode->owns != NULL) ? ota_mode->owns(huart) : 0u;
+}
 
 /******************************** General Function Code *****************************/
 /*
@@ -575,6 +1996,9 @@ EXT_OTA_EX EXT_OTA_Update(void)
 {
 	EXT_OTA_EX ret = EXT_OTA_EX_OK;
 	uint16_t len = 0;
+	uint8_t retries = 0u;
+	uint8_t resend;
+	uint8_t listened;
 
 	printf("Waiting for the OTA firmware\r\n");
 
@@ -584,27 +2008,260 @@ EXT_OTA_EX EXT_OTA_Update(void)
 	ota_fw_crc				= 0u;
 	ota_state				= EXT_OTA_STATE_START;
 	slot_num_to_write_fw	= 0xFFu;
+	ota_pending_baudrate	= 0u;
+	ota_start_tick			= HAL_GetTick();
+	ota_framing				= EXT_OTA_FRAMING_SOF_EOF;
+	ota_pending_framing		= EXT_OTA_FRAMING_NONE;
+	ota_rx_frame_bytes		= 0u;
+	ota_rx_bad_frames		= 0u;
+	ota_rx_skipped_bytes	= 0u;
+	ota_packet_count		= 0u;
+	ota_resp_cycles			= 0u;
+	ota_resp_sent			= 0u;
+	ota_flash_programmed	= 0u;
+	ota_pending_compact_resp = 0u;
+	ota_compact_resp		= 0u;
+	ota_ack_interval		= 1u;
+	ota_payload_max			= EXT_OTA_DATA_MAX_SIZE;
+	ota_payload_advice		= 0u;
+	ota_adapt_good_run		= 0u;
+	ota_adapt_changes		= 0u;
+	ota_mode				= NULL;
+	for(uint8_t i = 0; i < sizeof(ota_modes) / sizeof(ota_modes[0]); ++i)
+	{
+		if(ota_modes[i]->open != NULL)
+		{
+			ota_modes[i]->open();
+		}
+	}
+#if EXT_OTA_MULTIDROP_ENABLE
+	ota_md_foreign			= 0u;
+	ota_md_ignored			= 0u;
+#endif
+#if EXT_OTA_FLOW_CONTROL_ENABLE
+	ota_pending_stream		= 0u;
+	ota_streaming			= 0u;
+#endif
+	EXT_OTA_Flash_Open();
+#if EXT_OTA_RAM_VECTORS_ENABLE
+	// Exceptions are taken without reading the Flash
+	memcpy(ota_ram_vectors, (const void*)SCB->VTOR, sizeof(ota_ram_vectors));
+	__disable_irq();
+	ota_flash_vtor = SCB->VTOR;
+	SCB->VTOR = (uint32_t)ota_ram_vectors;
+	__DSB();
+	__enable_irq();
+#endif
+#if EXT_OTA_RAM_EXEC_ENABLE
+	// The handlers left in the Flash must not hold off the receive handlers executed from RAM during an erase
+	HAL_NVIC_SetPriority(USART1_IRQn, 1, 0);
+	HAL_NVIC_SetPriority(USART3_IRQn, 1, 0);
+	HAL_NVIC_SetPriority(DMA1_Channel2_IRQn, 1, 0);
+	HAL_NVIC_SetPriority(DMA1_Channel4_IRQn, 1, 0);
+	printf("Receive path in RAM: %lu bytes of code, %u bytes of CRC table", (uint32_t)(_eramfunc - _sramfunc), sizeof(crc_table));
+#if EXT_OTA_RAM_VECTORS_ENABLE
+	printf(", %u bytes of vectors", sizeof(ota_ram_vectors));
+#endif
+	printf("\r\n");
+#endif
+
+	// Cycle counter used to profile the response path
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	// The session is opened on the first link that receives the START command
+	len = EXT_OTA_Listen();
+	listened = 1u;
+	ota_session_open = 1u;
+	printf("Session opened on %s\r\n", ota_link->name);
+#if EXT_OTA_AUTOBAUD_ENABLE
+	if(ota_link->autobaud)
+	{
+		printf("Autobaud detected %lu baud\r\n", ota_link->huart->Init.BaudRate);
+	}
+#endif
 
 	do
 	{
-		memset(rcv_buffer, 0, EXT_OTA_PACKET_MAX_SIZE);
-
-		len = EXT_OTA_Receive_Chunk(rcv_buffer, EXT_OTA_PACKET_MAX_SIZE);
+		// The START frame received while listening is processed first
+		if(listened)
+		{
+			listened = 0u;
+		}
+		// The session mode may receive from other links, or request the chunks first
+		else if(ota_mode != NULL && ota_mode->receive != NULL)
+		{
+			len = ota_mode->receive(ota_payload_max + EXT_OTA_DATA_OVERHEAD + EXT_OTA_PAYLOAD_PREFIX_MAX,
+									EXT_OTA_INTER_FRAME_TIMEOUT);
+		}
+		else
+		{
+			// Frames longer than the negotiated payload are rejected before their data is received
+			len = EXT_OTA_Receive_Chunk(&rcv_packet, ota_payload_max + EXT_OTA_DATA_OVERHEAD + EXT_OTA_PAYLOAD_PREFIX_MAX,
+										EXT_OTA_INTER_FRAME_TIMEOUT);
+		}
+		resend = (len == 0) ? 1u : 0u;
+		if(len != 0)
+		{
+			if(rcv_packet.packet_type == EXT_OTA_PACKET_TYPE_DATA)
+			{
+				EXT_OTA_Adapt_Payload(1u);
+			}
+		}
+		else if(rx_status == HAL_ERROR)
+		{
+			EXT_OTA_Adapt_Payload(0u);
+		}
 
+		// Responses keep their order: the ACKs held for the Flash go out before any other response
+		if(((len == 0 || rcv_packet.packet_type != EXT_OTA_PACKET_TYPE_DATA) ? EXT_OTA_Flash_Sync() : EXT_OTA_Flash_Poll()) != HAL_OK)
+		{
+			printf("Error: Unable to write to Flash, update stopped!\r\n");
+			EXT_OTA_Send_Resp(EXT_OTA_NACK);
+			ret = EXT_OTA_EX_ERR;
+			break;
+		}
 		if(len != 0)
 		{
-			ret = EXT_OTA_Process_Data(rcv_buffer, len);
+			ret = EXT_OTA_Process_Data(&rcv_packet);
+			// The packet has been consumed, its room in the ring can take new bytes
+			EXT_OTA_Rx_Release(rcv_packet.frame_len);
+			ota_rx_frame_bytes += rcv_packet.frame_len;
+			// The session mode goes on with what has just been received, the host does not wait for the ring to run dry
+			if(ota_mode != NULL && ota_mode->poll != NULL)
+			{
+				ota_mode->poll();
+			}
 		}
-		else
+		// The session mode may leave a damaged frame to be rebuilt, or need more packets sent again
+		if(ota_mode != NULL && ota_mode->resync != NULL)
 		{
+			resend = ota_mode->resync(len, resend);
+		}
+		// Part of a damaged frame is in the Flash, the host sends again from the start of its page
+		if(resend && EXT_OTA_Cut_Rollback() != HAL_OK)
+		{
+			printf("Unable to roll the image back, update stopped\r\n");
+			EXT_OTA_Send_Resp(EXT_OTA_NACK);
 			ret = EXT_OTA_EX_ERR;
+			break;
+		}
+
+#if EXT_OTA_MULTIDROP_ENABLE
+		// No NACK on the bus, the damaged frame may have been sent to another node.
+		// The chunks lost from the broadcast image are reported to the next poll.
+		if(resend && ota_link->multidrop)
+		{
+			if(rx_status == HAL_TIMEOUT && ++retries > EXT_OTA_MAX_RETRIES)
+			{
+				printf("Bus silent, update stopped\r\n");
+				ret = EXT_OTA_EX_ERR;
+				break;
+			}
+			continue;
+		}
+#endif
+		// The session mode gets the lost DATA packets sent again its own way
+		if(resend && ota_mode != NULL && ota_mode->recover != NULL && ota_state == EXT_OTA_STATE_DATA)
+		{
+			if(ota_mode->recover(&retries) != HAL_OK)
+			{
+				printf("Too many retries, update stopped\r\n");
+				ret = EXT_OTA_EX_ERR;
+				break;
+			}
+			continue;
+		}
+		if(resend)
+		{
+			// A lost or damaged frame keeps the session, the host resends from the expected packet
+			if(++retries > EXT_OTA_MAX_RETRIES)
+			{
+				printf("Too many retries, update stopped\r\n");
+				EXT_OTA_Send_Resp(EXT_OTA_NACK);
+				ret = EXT_OTA_EX_ERR;
+				break;
+			}
+			printf("Sending NACK, expecting packet %lu (retry %u)\r\n", ota_packet_count, retries);
+			EXT_OTA_Send_Resp(EXT_OTA_NACK);
+			EXT_OTA_Rx_Drain(EXT_OTA_RETRY_IDLE_TIME);
+			continue;
+		}
+		retries = 0u;
+		if(len == 0)
+		{
+			continue;
 		}
 
 		if(ret == EXT_OTA_EX_OK)
 		{
-			printf("Sending ACK\r\n");
-			EXT_OTA_Send_Resp(EXT_OTA_ACK);
+			ota_packet_count++;
+			if(EXT_OTA_Is_Ack_Due() == 0u)
+			{
+				continue;
+			}
+			// A queued payload is acknowledged once it is in the Flash, nothing waits on its ACK
+			if(rcv_packet.packet_type == EXT_OTA_PACKET_TYPE_DATA && EXT_OTA_Flash_Hold_Ack())
+			{
+				continue;
+			}
+#if EXT_OTA_MULTIDROP_ENABLE
+			// Nobody answers a broadcast packet, the changes it requests apply right away
+			if(rcv_packet.address != EXT_OTA_ADDR_BROADCAST)
+#endif
+			{
+				printf("Sending ACK\r\n");
+				EXT_OTA_Send_Resp(EXT_OTA_ACK);
+			}
+
+			// Switch to compact responses once the full-format ACK is out
+			if(ota_pending_compact_resp)
+			{
+				ota_pending_compact_resp = 0u;
+				ota_compact_resp = 1u;
+			}
+
+			// The session mode starts once its command has been acknowledged
+			if(ota_mode != NULL && ota_mode->activate != NULL)
+			{
+				ota_mode->activate();
+			}
+
+			// The next packet is received in the requested framing
+			if(ota_pending_framing != EXT_OTA_FRAMING_NONE)
+			{
+				ota_framing = ota_pending_framing;
+				ota_pending_framing = EXT_OTA_FRAMING_NONE;
+			}
+
+#if EXT_OTA_FLOW_CONTROL_ENABLE
+			// RTS now holds the host off whenever the bootloader is busy with the Flash
+			if(ota_pending_stream)
+			{
+				ota_pending_stream = 0u;
+				if(EXT_OTA_Set_Flow_Control(UART_HWCONTROL_RTS_CTS) == HAL_OK)
+				{
+					ota_streaming = 1u;
+				}
+			}
+#endif
+
+			// Apply the negotiated baud rate once the ACK has left at the old rate
+			if(ota_pending_baudrate != 0u)
+			{
+				EXT_OTA_Switch_Baudrate(ota_pending_baudrate);
+				ota_pending_baudrate = 0u;
+			}
+		}
+#if EXT_OTA_MULTIDROP_ENABLE
+		// A broadcast packet this node can not use, unless it aborts the update of all the nodes
+		else if(rcv_packet.address == EXT_OTA_ADDR_BROADCAST &&
+				!(rcv_packet.packet_type == EXT_OTA_PACKET_TYPE_CMD &&
+				  ((EXT_OTA_COMMAND*)rcv_packet.ctrl)->cmd == EXT_OTA_CMD_ABORT))
+		{
+			ota_md_ignored++;
 		}
+#endif
 		else
 		{
 			printf("Sending NACK\r\n");
@@ -614,6 +2271,30 @@ EXT_OTA_EX EXT_OTA_Update(void)
 	}
 	while(ota_state != EXT_OTA_STATE_IDLE);
 
+	// An aborted session leaves no Flash job running, nor bytes in the cache
+	EXT_OTA_Flash_Close();
+#if EXT_OTA_RAM_VECTORS_ENABLE
+	__disable_irq();
+	SCB->VTOR = ota_flash_vtor;
+	__DSB();
+	__enable_irq();
+#endif
+#if EXT_OTA_FLOW_CONTROL_ENABLE
+	if(ota_streaming)
+	{
+		EXT_OTA_Set_Flow_Control(UART_HWCONTROL_NONE);
+		ota_streaming = 0u;
+	}
+#endif
+	// The last response must be out before the application is started, on the links of the mode as well
+	if(ota_mode != NULL && ota_mode->close != NULL)
+	{
+		ota_mode->close();
+	}
+	EXT_OTA_Flush_Resp();
+	EXT_OTA_Rx_Stop(ota_link);
+	ota_session_open = 0u;
+
 	return ret;
 }
 
@@ -706,9 +2387,13 @@ void EXT_OTA_Load_New_App()
 	}
 }
 
-uint32_t CalcCRC(uint8_t * pData, uint32_t DataLength)
+EXT_OTA_RAMFUNC uint32_t CalcCRC(uint8_t * pData, uint32_t DataLength)
+{
+    return CalcCRC_Update(0xFFFFFFFF, pData, DataLength);
+}
+
+EXT_OTA_RAMFUNC uint32_t CalcCRC_Update(uint32_t Checksum, uint8_t * pData, uint32_t DataLength)
 {
-    uint32_t Checksum = 0xFFFFFFFF;
     for(unsigned int i=0; i < DataLength; i++)
     {
         uint8_t top = (uint8_t)(Checksum >> 24);
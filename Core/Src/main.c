@@ -26,6 +26,10 @@
 #include <string.h>
 
 #include "ext_ota_update.h"
+#if EXT_OTA_LINK_USB_ENABLE
+#include "usb_device.h"
+#include "usbd_core.h"
+#endif
 
 
 /* USER CODE END Includes */
@@ -49,14 +53,22 @@
 /* Private variables ---------------------------------------------------------*/
 UART_HandleTypeDef huart1;
 UART_HandleTypeDef huart3;
+DMA_HandleTypeDef hdma_usart1_rx;
+DMA_HandleTypeDef hdma_usart1_tx;
+DMA_HandleTypeDef hdma_usart3_rx;
+DMA_HandleTypeDef hdma_usart3_tx;
 
 /* USER CODE BEGIN PV */
+#if EXT_OTA_LINK_USB_ENABLE
+extern USBD_HandleTypeDef hUsbDeviceFS;
+#endif
 
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_USART1_UART_Init(void);
 static void MX_USART3_UART_Init(void);
 /* USER CODE BEGIN PFP */
@@ -99,9 +111,21 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_USART1_UART_Init();
   MX_USART3_UART_Init();
   /* USER CODE BEGIN 2 */
+#if EXT_OTA_LINK_USB_ENABLE
+  // USB clock: PLL 72 MHz / 1.5 = 48 MHz
+  RCC_PeriphCLKInitTypeDef PeriphClkInit = {0};
+  PeriphClkInit.PeriphClockSelection = RCC_PERIPHCLK_USB;
+  PeriphClkInit.UsbClockSelection = RCC_USBCLKSOURCE_PLL_DIV1_5;
+  if (HAL_RCCEx_PeriphCLKConfig(&PeriphClkInit) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  MX_USB_DEVICE_Init();
+#endif
 
   printf("Starting bootloader version 0.3");
   for(uint8_t i = 0; i < 30; ++i)
@@ -139,8 +163,10 @@ int main(void)
   {
 	if(EXT_OTA_Update() != EXT_OTA_EX_OK)
 	{
-	  printf("Error: OTA update halted!\r\n");
-	  while(1);
+	  // The reboot cause is unchanged, the bootloader comes back to the OTA mode
+	  printf("Error: OTA update halted! Restarting...\r\n");
+	  HAL_Delay(10);
+	  NVIC_SystemReset();
 	}
 	else
 	{
@@ -270,6 +296,31 @@ static void MX_USART3_UART_Init(void)
 
 }
 
+/**
+  * Enable DMA controller clock
+  */
+static void MX_DMA_Init(void)
+{
+
+  /* DMA controller clock enable */
+  __HAL_RCC_DMA1_CLK_ENABLE();
+
+  /* DMA interrupt init */
+  /* DMA1_Channel2_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel2_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel2_IRQn);
+  /* DMA1_Channel3_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel3_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel3_IRQn);
+  /* DMA1_Channel4_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel4_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel4_IRQn);
+  /* DMA1_Channel5_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel5_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+
+}
+
 /**
   * @brief GPIO Initialization Function
   * @param None
@@ -309,7 +360,11 @@ int __io_putchar(int ch)
 int fputc(int ch, FILE* f)
 #endif
 {
-	HAL_UART_Transmit(&huart3, (uint8_t*)&ch, 1, 500);
+	// The log output is muted while USART3 carries an OTA session
+	if(EXT_OTA_Owns_Uart(&huart3) == 0u)
+	{
+		HAL_UART_Transmit(&huart3, (uint8_t*)&ch, 1, 500);
+	}
 
 	return ch;
 }
@@ -326,6 +381,22 @@ static void Goto_Application(void)
 		while(1);
 	}
 	// De-init all the peripherals and clock system
+	HAL_UART_DeInit(&huart1);
+	HAL_UART_DeInit(&huart3);
+#if EXT_OTA_LINK_USB_ENABLE
+	// Detach from the host, the application enumerates again if it needs USB
+	USBD_DeInit(&hUsbDeviceFS);
+#endif
+#if EXT_OTA_LINK_CAN_ENABLE
+	// Leave the bus, HAL_DeInit() then resets bxCAN with the other APB1 peripherals
+	HAL_NVIC_DisableIRQ(USB_HP_CAN1_TX_IRQn);
+	HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+	SET_BIT(CAN1->MCR, CAN_MCR_INRQ);
+#endif
+	HAL_NVIC_DisableIRQ(DMA1_Channel2_IRQn);
+	HAL_NVIC_DisableIRQ(DMA1_Channel3_IRQn);
+	HAL_NVIC_DisableIRQ(DMA1_Channel4_IRQn);
+	HAL_NVIC_DisableIRQ(DMA1_Channel5_IRQn);
 	HAL_RCC_DeInit();
 	HAL_DeInit();
 	// Turn off all the fault handler
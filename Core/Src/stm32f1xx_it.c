@@ -22,6 +22,7 @@
 #include "stm32f1xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "ext_ota_update.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -46,7 +47,12 @@
 
 /* Private function prototypes -----------------------------------------------*/
 /* USER CODE BEGIN PFP */
-
+#if EXT_OTA_RAM_EXEC_ENABLE
+// Served from RAM while the Flash is erased
+EXT_OTA_RAMFUNC void SysTick_Handler(void);
+EXT_OTA_RAMFUNC void DMA1_Channel3_IRQHandler(void);
+EXT_OTA_RAMFUNC void DMA1_Channel5_IRQHandler(void);
+#endif
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -55,9 +61,18 @@
 /* USER CODE END 0 */
 
 /* External variables --------------------------------------------------------*/
+extern DMA_HandleTypeDef hdma_usart1_rx;
+extern DMA_HandleTypeDef hdma_usart1_tx;
+extern DMA_HandleTypeDef hdma_usart3_rx;
+extern DMA_HandleTypeDef hdma_usart3_tx;
+extern UART_HandleTypeDef huart1;
+extern UART_HandleTypeDef huart3;
 
 /* USER CODE BEGIN EV */
-
+#if EXT_OTA_LINK_SPI_ENABLE
+extern DMA_HandleTypeDef hdma_spi1_rx;
+extern DMA_HandleTypeDef hdma_spi1_tx;
+#endif
 /* USER CODE END EV */
 
 /******************************************************************************/
@@ -187,7 +202,9 @@ void SysTick_Handler(void)
   /* USER CODE END SysTick_IRQn 0 */
   HAL_IncTick();
   /* USER CODE BEGIN SysTick_IRQn 1 */
-
+#if EXT_OTA_LINK_CAN_ENABLE
+  EXT_OTA_Can_Tick();
+#endif
   /* USER CODE END SysTick_IRQn 1 */
 }
 
@@ -198,6 +215,146 @@ void SysTick_Handler(void)
 /* please refer to the startup file (startup_stm32f1xx.s).                    */
 /******************************************************************************/
 
+/**
+  * @brief This function handles DMA1 channel2 global interrupt.
+  */
+void DMA1_Channel2_IRQHandler(void)
+{
+  /* USER CODE BEGIN DMA1_Channel2_IRQn 0 */
+#if EXT_OTA_LINK_SPI_ENABLE
+  // SPI1_RX of the OTA SPI link, USART3 is then not using its DMA
+  HAL_DMA_IRQHandler(&hdma_spi1_rx);
+  return;
+#endif
+
+  /* USER CODE END DMA1_Channel2_IRQn 0 */
+  HAL_DMA_IRQHandler(&hdma_usart3_tx);
+  /* USER CODE BEGIN DMA1_Channel2_IRQn 1 */
+
+  /* USER CODE END DMA1_Channel2_IRQn 1 */
+}
+
+/**
+  * @brief This function handles DMA1 channel3 global interrupt.
+  */
+void DMA1_Channel3_IRQHandler(void)
+{
+  /* USER CODE BEGIN DMA1_Channel3_IRQn 0 */
+#if EXT_OTA_LINK_SPI_ENABLE
+  // SPI1_TX of the OTA SPI link
+  HAL_DMA_IRQHandler(&hdma_spi1_tx);
+  return;
+#endif
+#if EXT_OTA_RAM_EXEC_ENABLE
+  if(EXT_OTA_Rx_Dma_IRQHandler(&hdma_usart3_rx))
+  {
+    return;
+  }
+#endif
+
+  /* USER CODE END DMA1_Channel3_IRQn 0 */
+  HAL_DMA_IRQHandler(&hdma_usart3_rx);
+  /* USER CODE BEGIN DMA1_Channel3_IRQn 1 */
+
+  /* USER CODE END DMA1_Channel3_IRQn 1 */
+}
+
+/**
+  * @brief This function handles DMA1 channel4 global interrupt.
+  */
+void DMA1_Channel4_IRQHandler(void)
+{
+  /* USER CODE BEGIN DMA1_Channel4_IRQn 0 */
+
+  /* USER CODE END DMA1_Channel4_IRQn 0 */
+  HAL_DMA_IRQHandler(&hdma_usart1_tx);
+  /* USER CODE BEGIN DMA1_Channel4_IRQn 1 */
+
+  /* USER CODE END DMA1_Channel4_IRQn 1 */
+}
+
+/**
+  * @brief This function handles DMA1 channel5 global interrupt.
+  */
+void DMA1_Channel5_IRQHandler(void)
+{
+  /* USER CODE BEGIN DMA1_Channel5_IRQn 0 */
+#if EXT_OTA_RAM_EXEC_ENABLE
+  // The ring moves on from RAM, the HAL takes the rest
+  if(EXT_OTA_Rx_Dma_IRQHandler(&hdma_usart1_rx))
+  {
+    return;
+  }
+#endif
+  /* USER CODE END DMA1_Channel5_IRQn 0 */
+  HAL_DMA_IRQHandler(&hdma_usart1_rx);
+  /* USER CODE BEGIN DMA1_Channel5_IRQn 1 */
+
+  /* USER CODE END DMA1_Channel5_IRQn 1 */
+}
+
+/**
+  * @brief This function handles USART1 global interrupt.
+  */
+void USART1_IRQHandler(void)
+{
+  /* USER CODE BEGIN USART1_IRQn 0 */
+
+  /* USER CODE END USART1_IRQn 0 */
+  HAL_UART_IRQHandler(&huart1);
+  /* USER CODE BEGIN USART1_IRQn 1 */
+
+  /* USER CODE END USART1_IRQn 1 */
+}
+
+/**
+  * @brief This function handles USART3 global interrupt.
+  */
+void USART3_IRQHandler(void)
+{
+  /* USER CODE BEGIN USART3_IRQn 0 */
+
+  /* USER CODE END USART3_IRQn 0 */
+  HAL_UART_IRQHandler(&huart3);
+  /* USER CODE BEGIN USART3_IRQn 1 */
+
+  /* USER CODE END USART3_IRQn 1 */
+}
+
 /* USER CODE BEGIN 1 */
+#if EXT_OTA_LINK_CAN_ENABLE
+/**
+  * @brief This function handles USB high priority or CAN TX interrupts.
+  */
+void USB_HP_CAN1_TX_IRQHandler(void)
+{
+  EXT_OTA_Can_Tx_IRQHandler();
+}
 
+/**
+  * @brief This function handles USB low priority or CAN RX0 interrupts.
+  */
+void USB_LP_CAN1_RX0_IRQHandler(void)
+{
+  EXT_OTA_Can_Rx_IRQHandler();
+}
+#endif
+#if EXT_OTA_FLASH_ASYNC_ENABLE
+/**
+  * @brief This function handles Flash global interrupt.
+  */
+EXT_OTA_RAMFUNC void FLASH_IRQHandler(void)
+{
+  EXT_OTA_Flash_IRQHandler();
+}
+#endif
+#if EXT_OTA_RAM_EXEC_ENABLE
+/**
+  * @brief Tick increment of the SysTick handler, executed from RAM with it.
+  */
+EXT_OTA_RAMFUNC void HAL_IncTick(void)
+{
+  uwTick += uwTickFreq;
+}
+#endif
 /* USER CODE END 1 */
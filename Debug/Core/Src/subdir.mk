@@ -5,6 +5,19 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
+../Core/Src/ext_ota_flash.c \
+../Core/Src/ext_ota_flash_async.c \
+../Core/Src/ext_ota_flash_cut.c \
+../Core/Src/ext_ota_link_can.c \
+../Core/Src/ext_ota_link_loopback.c \
+../Core/Src/ext_ota_link_spi.c \
+../Core/Src/ext_ota_link_uart.c \
+../Core/Src/ext_ota_link_usb.c \
+../Core/Src/ext_ota_mode_bond.c \
+../Core/Src/ext_ota_mode_fec.c \
+../Core/Src/ext_ota_mode_md.c \
+../Core/Src/ext_ota_mode_pull.c \
+../Core/Src/ext_ota_mode_relay.c \
 ../Core/Src/ext_ota_update.c \
 ../Core/Src/main.c \
 ../Core/Src/stm32f1xx_hal_msp.c \
@@ -14,6 +27,19 @@ C_SRCS += \
 ../Core/Src/system_stm32f1xx.c 
 
 OBJS += \
+./Core/Src/ext_ota_flash.o \
+./Core/Src/ext_ota_flash_async.o \
+./Core/Src/ext_ota_flash_cut.o \
+./Core/Src/ext_ota_link_can.o \
+./Core/Src/ext_ota_link_loopback.o \
+./Core/Src/ext_ota_link_spi.o \
+./Core/Src/ext_ota_link_uart.o \
+./Core/Src/ext_ota_link_usb.o \
+./Core/Src/ext_ota_mode_bond.o \
+./Core/Src/ext_ota_mode_fec.o \
+./Core/Src/ext_ota_mode_md.o \
+./Core/Src/ext_ota_mode_pull.o \
+./Core/Src/ext_ota_mode_relay.o \
 ./Core/Src/ext_ota_update.o \
 ./Core/Src/main.o \
 ./Core/Src/stm32f1xx_hal_msp.o \
@@ -23,6 +49,19 @@ OBJS += \
 ./Core/Src/system_stm32f1xx.o 
 
 C_DEPS += \
+./Core/Src/ext_ota_flash.d \
+./Core/Src/ext_ota_flash_async.d \
+./Core/Src/ext_ota_flash_cut.d \
+./Core/Src/ext_ota_link_can.d \
+./Core/Src/ext_ota_link_loopback.d \
+./Core/Src/ext_ota_link_spi.d \
+./Core/Src/ext_ota_link_uart.d \
+./Core/Src/ext_ota_link_usb.d \
+./Core/Src/ext_ota_mode_bond.d \
+./Core/Src/ext_ota_mode_fec.d \
+./Core/Src/ext_ota_mode_md.d \
+./Core/Src/ext_ota_mode_pull.d \
+./Core/Src/ext_ota_mode_relay.d \
 ./Core/Src/ext_ota_update.d \
 ./Core/Src/main.d \
 ./Core/Src/stm32f1xx_hal_msp.d \
@@ -39,7 +78,7 @@ Core/Src/%.o Core/Src/%.su Core/Src/%.cyclo: ../Core/Src/%.c Core/Src/subdir.mk
 clean: clean-Core-2f-Src
 
 clean-Core-2f-Src:
-	-$(RM) ./Core/Src/ext_ota_update.cyclo ./Core/Src/ext_ota_update.d ./Core/Src/ext_ota_update.o ./Core/Src/ext_ota_update.su ./Core/Src/main.cyclo ./Core/Src/main.d ./Core/Src/main.o ./Core/Src/main.su ./Core/Src/stm32f1xx_hal_msp.cyclo ./Core/Src/stm32f1xx_hal_msp.d ./Core/Src/stm32f1xx_hal_msp.o ./Core/Src/stm32f1xx_hal_msp.su ./Core/Src/stm32f1xx_it.cyclo ./Core/Src/stm32f1xx_it.d ./Core/Src/stm32f1xx_it.o ./Core/Src/stm32f1xx_it.su ./Core/Src/syscalls.cyclo ./Core/Src/syscalls.d ./Core/Src/syscalls.o ./Core/Src/syscalls.su ./Core/Src/sysmem.cyclo ./Core/Src/sysmem.d ./Core/Src/sysmem.o ./Core/Src/sysmem.su ./Core/Src/system_stm32f1xx.cyclo ./Core/Src/system_stm32f1xx.d ./Core/Src/system_stm32f1xx.o ./Core/Src/system_stm32f1xx.su
+	-$(RM) ./Core/Src/ext_ota_flash.cyclo ./Core/Src/ext_ota_flash.d ./Core/Src/ext_ota_flash.o ./Core/Src/ext_ota_flash.su ./Core/Src/ext_ota_flash_async.cyclo ./Core/Src/ext_ota_flash_async.d ./Core/Src/ext_ota_flash_async.o ./Core/Src/ext_ota_flash_async.su ./Core/Src/ext_ota_flash_cut.cyclo ./Core/Src/ext_ota_flash_cut.d ./Core/Src/ext_ota_flash_cut.o ./Core/Src/ext_ota_flash_cut.su ./Core/Src/ext_ota_link_can.cyclo ./Core/Src/ext_ota_link_can.d ./Core/Src/ext_ota_link_can.o ./Core/Src/ext_ota_link_can.su ./Core/Src/ext_ota_link_loopback.cyclo ./Core/Src/ext_ota_link_loopback.d ./Core/Src/ext_ota_link_loopback.o ./Core/Src/ext_ota_link_loopback.su ./Core/Src/ext_ota_link_spi.cyclo ./Core/Src/ext_ota_link_spi.d ./Core/Src/ext_ota_link_spi.o ./Core/Src/ext_ota_link_spi.su ./Core/Src/ext_ota_link_uart.cyclo ./Core/Src/ext_ota_link_uart.d ./Core/Src/ext_ota_link_uart.o ./Core/Src/ext_ota_link_uart.su ./Core/Src/ext_ota_link_usb.cyclo ./Core/Src/ext_ota_link_usb.d ./Core/Src/ext_ota_link_usb.o ./Core/Src/ext_ota_link_usb.su ./Core/Src/ext_ota_mode_bond.cyclo ./Core/Src/ext_ota_mode_bond.d ./Core/Src/ext_ota_mode_bond.o ./Core/Src/ext_ota_mode_bond.su ./Core/Src/ext_ota_mode_fec.cyclo ./Core/Src/ext_ota_mode_fec.d ./Core/Src/ext_ota_mode_fec.o ./Core/Src/ext_ota_mode_fec.su ./Core/Src/ext_ota_mode_md.cyclo ./Core/Src/ext_ota_mode_md.d ./Core/Src/ext_ota_mode_md.o ./Core/Src/ext_ota_mode_md.su ./Core/Src/ext_ota_mode_pull.cyclo ./Core/Src/ext_ota_mode_pull.d ./Core/Src/ext_ota_mode_pull.o ./Core/Src/ext_ota_mode_pull.su ./Core/Src/ext_ota_mode_relay.cyclo ./Core/Src/ext_ota_mode_relay.d ./Core/Src/ext_ota_mode_relay.o ./Core/Src/ext_ota_mode_relay.su ./Core/Src/ext_ota_update.cyclo ./Core/Src/ext_ota_update.d ./Core/Src/ext_ota_update.o ./Core/Src/ext_ota_update.su ./Core/Src/main.cyclo ./Core/Src/main.d ./Core/Src/main.o ./Core/Src/main.su ./Core/Src/stm32f1xx_hal_msp.cyclo ./Core/Src/stm32f1xx_hal_msp.d ./Core/Src/stm32f1xx_hal_msp.o ./Core/Src/stm32f1xx_hal_msp.su ./Core/Src/stm32f1xx_it.cyclo ./Core/Src/stm32f1xx_it.d ./Core/Src/stm32f1xx_it.o ./Core/Src/stm32f1xx_it.su ./Core/Src/syscalls.cyclo ./Core/Src/syscalls.d ./Core/Src/syscalls.o ./Core/Src/syscalls.su ./Core/Src/sysmem.cyclo ./Core/Src/sysmem.d ./Core/Src/sysmem.o ./Core/Src/sysmem.su ./Core/Src/system_stm32f1xx.cyclo ./Core/Src/system_stm32f1xx.d ./Core/Src/system_stm32f1xx.o ./Core/Src/system_stm32f1xx.su
 
 .PHONY: clean-Core-2f-Src
 